@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <math.h>
+#include "pico/stdlib.h"
+
+#include "main.h"
+#include "misc.h"
+#include "altitude.h"
+
+// Barometric altitude model
+// Pressure is converted to altitude with the standard atmosphere, then corrected with a table of
+// offsets (one per ALT_BAND_HEIGHT band) learnt from the GPS while both sources are valid.
+// If the GPS loses its fix, or disagrees with the barometer, the corrected barometric altitude is used instead.
+
+// R / (g * M) for dry air, in m/K
+#define GAS_CONSTANT_RATIO 29.27175f
+
+struct TAtmosphereLayer
+{
+    float BaseAltitude;
+    float BasePressure;
+    float BaseTemperature;
+    float LapseRate;
+};
+
+// International Standard Atmosphere, each entry is the base of a layer
+static const TAtmosphereLayer ISA[] = {
+    {0,     101325.0f, 288.15f, -0.0065f},
+    {11000, 22632.1f,  216.65f,  0.0f},
+    {20000, 5474.89f,  216.65f,  0.001f},
+    {32000, 868.019f,  228.65f,  0.0028f},
+    {47000, 110.906f,  270.65f,  0.0f}
+};
+#define NUM_LAYERS (sizeof(ISA) / sizeof(ISA[0]))
+
+// Calibration table - offset between GPS and standard atmosphere altitude in each band
+static float band_offset[ALT_NUM_BANDS];
+static bool band_valid[ALT_NUM_BANDS];
+
+static long gps_altitude = 0;
+static absolute_time_t gps_fix_time;
+static bool gps_has_fixed = false;
+static int gps_rejected_count = 0;
+
+static absolute_time_t rate_time;
+static long rate_altitude = 0;
+static bool rate_valid = false;
+
+float pressure_to_altitude(float pressure) {
+    // Converts pressure in Pa to standard atmosphere altitude in m
+    int i = 0;
+    while ((i < (int)NUM_LAYERS - 1) && (pressure < ISA[i+1].BasePressure)) {
+        i++;
+    }
+
+    const TAtmosphereLayer *layer = &ISA[i];
+
+    if (layer->LapseRate == 0) {
+        return layer->BaseAltitude + GAS_CONSTANT_RATIO * layer->BaseTemperature * logf(layer->BasePressure / pressure);
+    }
+
+    float exponent = -GAS_CONSTANT_RATIO * layer->LapseRate;
+    return layer->BaseAltitude + (layer->BaseTemperature / layer->LapseRate) * (powf(pressure / layer->BasePressure, exponent) - 1);
+}
+
+static int altitude_band(float altitude) {
+    int band = (int)(altitude / ALT_BAND_HEIGHT);
+    if (band < 0) {
+        band = 0;
+    }
+    if (band >= ALT_NUM_BANDS) {
+        band = ALT_NUM_BANDS - 1;
+    }
+    return band;
+}
+
+static bool baro_valid(struct STATE *state) {
+    return state->BMEPressure > 0;
+}
+
+static bool baro_calibrated() {
+    // True once any band has been calibrated against the GPS
+    for (int i = 0; i < ALT_NUM_BANDS; i++) {
+        if (band_valid[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static float band_correction(int band) {
+    // Use the offset of this band, or of the nearest calibrated band if it has not been seen yet
+    for (int distance = 0; distance < ALT_NUM_BANDS; distance++) {
+        if ((band - distance >= 0) && band_valid[band - distance]) {
+            return band_offset[band - distance];
+        }
+        if ((band + distance < ALT_NUM_BANDS) && band_valid[band + distance]) {
+            return band_offset[band + distance];
+        }
+    }
+    return 0;
+}
+
+static long baro_altitude(struct STATE *state) {
+    float isa_altitude = pressure_to_altitude(state->BMEPressure);
+    return (long)(isa_altitude + band_correction(altitude_band(isa_altitude)));
+}
+
+static bool gps_valid(struct STATE *state) {
+    if (!gps_has_fixed) {
+        return false;
+    }
+
+    if (absolute_time_diff_us(gps_fix_time, get_absolute_time()) > ALT_GPS_TIMEOUT_MS * 1000) {
+        return false;
+    }
+
+    if (!baro_valid(state)) {
+        return true;
+    }
+
+    // Cross-check against the barometer once it has been calibrated
+    if (baro_calibrated() && labs(gps_altitude - baro_altitude(state)) > ALT_MAX_DISAGREEMENT) {
+        gps_rejected_count++;
+
+        // Below the COCOM limit a long disagreement is more likely to be barometer drift, so start trusting the GPS again
+        if ((gps_rejected_count > 30) && (gps_altitude < COCOM_ALTITUDE)) {
+            debug("> (0) Barometric altitude drifted - recalibrating from GPS\n");
+            for (int i = 0; i < ALT_NUM_BANDS; i++) {
+                band_valid[i] = false;
+            }
+            gps_rejected_count = 0;
+            return true;
+        }
+        return false;
+    }
+
+    gps_rejected_count = 0;
+    return true;
+}
+
+void altitude_gps_fix(struct STATE *state, long altitude) {
+    // Called with the altitude of every GPS fix with enough satellites
+    gps_altitude = altitude;
+    gps_fix_time = get_absolute_time();
+    gps_has_fixed = true;
+    state->GPSAltitude = altitude;
+}
+
+static void update_ascent_rate(struct STATE *state) {
+    absolute_time_t now = get_absolute_time();
+
+    if (!rate_valid) {
+        rate_time = now;
+        rate_altitude = state->Altitude;
+        rate_valid = true;
+        return;
+    }
+
+    int64_t dt = absolute_time_diff_us(rate_time, now);
+    if (dt < 1000000) {
+        return;
+    }
+
+    float rate = (state->Altitude - rate_altitude) * 1000000.0f / dt;
+    state->AscentRate = (state->AscentRate + rate) / 2;
+    state->PreviousAltitude = rate_altitude;
+
+    rate_time = now;
+    rate_altitude = state->Altitude;
+}
+
+void altitude_update(struct STATE *state) {
+    // Pick the best altitude source and update state->Altitude with it
+    bool has_baro = baro_valid(state);
+    bool has_gps = gps_valid(state);
+
+    if (has_baro) {
+        state->BaroAltitude = baro_altitude(state);
+    }
+
+    if (has_gps) {
+        if (has_baro) {
+            // Learn the difference between the GPS and the standard atmosphere in this band
+            float isa_altitude = pressure_to_altitude(state->BMEPressure);
+            int band = altitude_band(isa_altitude);
+            float offset = gps_altitude - isa_altitude;
+
+            if (band_valid[band]) {
+                band_offset[band] += (offset - band_offset[band]) * 0.1f;
+            } else {
+                band_offset[band] = offset;
+                band_valid[band] = true;
+            }
+        }
+
+        state->Altitude = gps_altitude;
+        state->AltitudeSource = asGPS;
+    } else if (has_baro) {
+        if (state->AltitudeSource == asGPS) {
+            debug("> (0) GPS altitude lost - using barometric altitude\n");
+        }
+        state->Altitude = state->BaroAltitude;
+        state->AltitudeSource = asBaro;
+    } else {
+        // Nothing better available, keep the last altitude
+        return;
+    }
+
+    update_ascent_rate(state);
+}
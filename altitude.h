@@ -0,0 +1,18 @@
+#ifndef ALTITUDE_INCLUDED
+#define ALTITUDE_INCLUDED
+
+// Maximum difference between GPS and calibrated barometric altitude before the GPS is distrusted
+#define ALT_MAX_DISAGREEMENT 500
+// A GPS fix older than this is considered lost
+#define ALT_GPS_TIMEOUT_MS 3000
+// Above this altitude the GPS may hit the COCOM limit and report garbage
+#define COCOM_ALTITUDE 18000
+// Height of each band in the barometric calibration table
+#define ALT_BAND_HEIGHT 2000
+#define ALT_NUM_BANDS 24
+
+void altitude_gps_fix(struct STATE *state, long altitude);
+void altitude_update(struct STATE *state);
+float pressure_to_altitude(float pressure);
+
+#endif
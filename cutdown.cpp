@@ -5,9 +5,8 @@
 #include "misc.h"
 #include "cutdown.h"
 
-// Store the geofence - REMEMBER TO UPDATE NUM_POINTS ACCORDINGLY
+// Store the geofence - REMEMBER TO UPDATE GEOFENCE_POINTS ACCORDINGLY
 // TODO: Make this actually good
-#define NUM_POINTS 33
 const float GEOFENCE[] = {
     -1.0263835, 50.9617035,
     -0.0769043, 50.9447692,
@@ -46,6 +45,7 @@ const float GEOFENCE[] = {
 
 long cut_altitude = 0;
 int test_count = 0;
+static bool burning = false;
 
 void init_cutdown() {
     // Perform initialisation here
@@ -59,12 +59,12 @@ bool should_cut(struct STATE * state) {
     // Checks if payload should be cut down
 
     // If above ceiling, cut
-    if (state->Altitude >= CEILING_ALT) {
+    if (state->Altitude >= config.CeilingAltitude) {
         return true;
     }
 
     // If outside geofence, cut
-    if (!is_in_geofence(state->Longitude, state->Latitude, GEOFENCE, NUM_POINTS)) {
+    if (!is_in_geofence(state->Longitude, state->Latitude, config.Fence, config.FencePoints)) {
         return true;
     }
 
@@ -83,9 +83,9 @@ bool is_in_geofence(float longitude, float latitude, const float *geofence, int
 
     int count = 0;
 
-    for (int i = 0; i < NUM_POINTS; i++) {
-        int next = (i + 1) % NUM_POINTS;
-        if (left_of_line(longitude, latitude, GEOFENCE[2*i], GEOFENCE[2*i + 1], GEOFENCE[2*next], GEOFENCE[2*next + 1])) {
+    for (int i = 0; i < num_points; i++) {
+        int next = (i + 1) % num_points;
+        if (left_of_line(longitude, latitude, geofence[2*i], geofence[2*i + 1], geofence[2*next], geofence[2*next + 1])) {
             count++;
         }
     }
@@ -147,6 +147,7 @@ void cutdown_check(struct STATE * state){
         if (cut_altitude - state->Altitude > 10) {
             debug("> CUTDOWN burn stopped \n");  
             gpio_put(CUT_PIN, 0);
+            burning = false;
         } else {
             debug("> Altitude not decreasing - burn resuming for another second \n");
         }
@@ -164,6 +165,7 @@ void cutdown_check(struct STATE * state){
     if (test_count > 5) {
         debug("> Payload CUTDOWN - burn started! \n");
         gpio_put(CUT_PIN, 1);
+        burning = true;
         state->HasCutDown = 1;
     }
 
@@ -172,4 +174,16 @@ void cutdown_check(struct STATE * state){
 
     return;
 
-}
\ No newline at end of file
+}
+
+void resume_cutdown(long altitude, bool burn) {
+    // After a warm restart - carries on with a burn that the reset interrupted
+    cut_altitude = altitude;
+    burning = burn;
+    gpio_put(CUT_PIN, burn);
+}
+
+bool cutdown_burning(long *altitude) {
+    *altitude = cut_altitude;
+    return burning;
+}
@@ -4,6 +4,10 @@
 // ***************** CHANGE THIS BEFORE LAUNCH - Should be roughly 1000-2000m below predicted burst altitutde! *****************
 #define CEILING_ALT 25500
 
+// Built in geofence, used unless config.txt gives one
+#define GEOFENCE_POINTS 33
+extern const float GEOFENCE[];
+
 void init_cutdown();
 
 bool is_in_geofence(float latitude, float longitude, const float *geofence, int num_points);
@@ -11,5 +15,7 @@ bool left_of_line(float px, float py, float lx0, float ly0, float lx1, float ly1
 
 bool should_cut(struct STATE * state);
 void cutdown_check(struct STATE * state);
+void resume_cutdown(long altitude, bool burn);
+bool cutdown_burning(long *altitude);
 
 #endif
\ No newline at end of file
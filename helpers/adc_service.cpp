@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/adc.h"
+#include "hardware/dma.h"
+#include "../main.h"
+#include "../misc.h"
+#include "adc_service.h"
+#include "power.h"
+
+// Free-running ADC sampler
+// The ADC converts the enabled channels in round robin, and DMA copies every result into a ring buffer.
+// A timer averages the most recent ADC_OVERSAMPLE samples of each channel into a 16 bit value,
+// which consumers read without any locking.
+//
+// The data channel runs for a whole number of trips round the ring, and a whole number of
+// round robin cycles, before a control channel restarts it. So the position of a sample within
+// the current run tells us both where it is in the ring and which channel it came from.
+
+static volatile uint16_t ring[ADC_RING_SAMPLES] __attribute__((aligned(1 << ADC_RING_BITS)));
+
+static uint8_t channel_order[5];
+static int num_channels = 0;
+static uint32_t run_length;
+
+static int data_dma;
+static int control_dma;
+static repeating_timer_t decimate_timer;
+
+// Latest oversampled values, full scale 65535
+static volatile uint16_t adc_values[5];
+
+static uint32_t samples_in_run() {
+    // Samples written so far in the current run
+    return run_length - dma_hw->ch[data_dma].transfer_count;
+}
+
+static bool decimate(repeating_timer_t *rt) {
+    uint32_t written = samples_in_run();
+
+    for (int k = 0; k < num_channels; k++) {
+        // Most recent sample from this channel - kept positive by adding a whole run
+        uint32_t index = written + run_length - 1;
+        index -= (index - k) % num_channels;
+
+        uint32_t sum = 0;
+        for (int j = 0; j < ADC_OVERSAMPLE; j++) {
+            sum += ring[(index - j * num_channels) % ADC_RING_SAMPLES];
+        }
+
+        adc_values[channel_order[k]] = (sum << 4) / ADC_OVERSAMPLE;
+    }
+    return true;
+}
+
+void adc_service_init() {
+    // Work out which inputs are in use
+    uint mask = 0;
+    if (config.Solar0Enabled || config.EnableNO2) {
+        mask |= 1 << 0;
+    }
+    if (config.Solar1Enabled || config.EnableNO2) {
+        mask |= 1 << 1;
+    }
+    if (SOLAR2_EN) {
+        mask |= 1 << 2;                 // Solar 2 / analog muon
+    }
+    mask |= 1 << VSYS_ADC_CHANNEL;
+    mask |= 1 << ADC_TEMP_CHANNEL;
+
+    adc_set_temp_sensor_enabled(true);
+
+    // Round robin goes through the enabled inputs in ascending order
+    for (int i = 0; i < 5; i++) {
+        if (mask & (1 << i)) {
+            channel_order[num_channels++] = i;
+        }
+    }
+    run_length = ADC_RING_SAMPLES * num_channels;
+
+    adc_select_input(channel_order[0]);
+    adc_set_round_robin(mask);
+    adc_fifo_setup(true, true, 1, false, false);
+    adc_set_clkdiv(48000000.0f / ADC_SAMPLE_RATE - 1);
+
+    data_dma = dma_claim_unused_channel(true);
+    control_dma = dma_claim_unused_channel(true);
+
+    dma_channel_config data_config = dma_channel_get_default_config(data_dma);
+    channel_config_set_transfer_data_size(&data_config, DMA_SIZE_16);
+    channel_config_set_read_increment(&data_config, false);
+    channel_config_set_write_increment(&data_config, true);
+    channel_config_set_ring(&data_config, true, ADC_RING_BITS);
+    channel_config_set_dreq(&data_config, DREQ_ADC);
+    channel_config_set_chain_to(&data_config, control_dma);
+    dma_channel_configure(data_dma, &data_config, ring, &adc_hw->fifo, run_length, false);
+
+    // Restarts the data channel by rewriting its transfer count
+    dma_channel_config control_config = dma_channel_get_default_config(control_dma);
+    channel_config_set_transfer_data_size(&control_config, DMA_SIZE_32);
+    channel_config_set_read_increment(&control_config, false);
+    channel_config_set_write_increment(&control_config, false);
+    dma_channel_configure(control_dma, &control_config, &dma_hw->ch[data_dma].al1_transfer_count_trig, &run_length, 1, false);
+
+    dma_channel_start(data_dma);
+    adc_run(true);
+
+    add_repeating_timer_ms(-ADC_DECIMATE_MS, decimate, NULL, &decimate_timer);
+}
+
+uint16_t adc_service_raw(unsigned int channel) {
+    return adc_values[channel];
+}
+
+float adc_service_voltage(unsigned int channel) {
+    return adc_values[channel] * 3.3f / 65536;
+}
+
+const volatile uint16_t *adc_service_ring() {
+    return ring;
+}
+
+uint32_t adc_service_run_position() {
+    return samples_in_run();
+}
+
+uint32_t adc_service_run_length() {
+    return run_length;
+}
+
+int adc_service_num_channels() {
+    return num_channels;
+}
+
+int adc_service_slot(unsigned int channel) {
+    // Position of a channel in the round robin - sample n of a run came from the channel in slot n % num_channels
+    for (int k = 0; k < num_channels; k++) {
+        if (channel_order[k] == channel) {
+            return k;
+        }
+    }
+    return -1;
+}
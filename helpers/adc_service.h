@@ -0,0 +1,29 @@
+#ifndef ADC_SERVICE_INCLUDED
+#define ADC_SERVICE_INCLUDED
+
+#include <stdint.h>
+
+// Total conversions per second, shared between the enabled channels
+// The muon detector needs the ADC flat out to catch its pulses
+#define ADC_SAMPLE_RATE ((ENABLE_MUON && (MUON_MODE == MUON_MODE_ANALOG)) ? 500000 : 10000)
+// Ring buffer of raw samples, filled by DMA - 2^ADC_RING_BITS bytes
+#define ADC_RING_BITS 14
+#define ADC_RING_SAMPLES ((1 << ADC_RING_BITS) / 2)
+// Samples averaged per channel for each published value - 64 samples gives 3 extra bits
+#define ADC_OVERSAMPLE 64
+#define ADC_DECIMATE_MS 50
+
+#define ADC_TEMP_CHANNEL 4
+
+void adc_service_init();
+uint16_t adc_service_raw(unsigned int channel);
+float adc_service_voltage(unsigned int channel);
+
+// Raw sample stream, for consumers that need every sample of a channel
+const volatile uint16_t *adc_service_ring();
+uint32_t adc_service_run_position();
+uint32_t adc_service_run_length();
+int adc_service_num_channels();
+int adc_service_slot(unsigned int channel);
+
+#endif
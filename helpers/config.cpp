@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <ctype.h>
+#include "pico/stdlib.h"
+#include "../main.h"
+#include "../misc.h"
+#include "../cutdown.h"
+#include "repeater.h"
+#include "sd.h"
+#include "memory.h"
+#include "config.h"
+
+// config.txt holds one "key = value" per line, and # starts a comment, e.g.
+//   callsign = WSHABT
+//   frequency = 434.425
+//   fence = -1.0263835, 50.9617035      (one line per point, in order - replaces the built in geofence)
+//   period GPS = 20                     (any named task, see the console's tasks command)
+// Settings that are not given keep their defaults.
+// The last good file is kept in the flash key-value store, see memory.h.
+
+typedef enum {cfString, cfFloat, cfInt, cfByte, cfBool} TConfigFieldType;
+
+static const struct {
+    const char *key;
+    TConfigFieldType type;
+    size_t offset;
+    size_t size;
+} FIELDS[] = {
+    {"callsign",            cfString,   offsetof(struct TConfig, Callsign),         CONFIG_CALLSIGN_LENGTH},
+    {"frequency",           cfFloat,    offsetof(struct TConfig, Frequency),        sizeof(float)},
+    {"lora_mode",           cfByte,     offsetof(struct TConfig, LoRaMode),         sizeof(uint8_t)},
+    {"lora_transmitting",   cfBool,     offsetof(struct TConfig, LoRaTransmitting), sizeof(bool)},
+    {"enable_pm",           cfBool,     offsetof(struct TConfig, EnablePM),         sizeof(bool)},
+    {"enable_no2",          cfBool,     offsetof(struct TConfig, EnableNO2),        sizeof(bool)},
+    {"solar0_en",           cfBool,     offsetof(struct TConfig, Solar0Enabled),    sizeof(bool)},
+    {"solar1_en",           cfBool,     offsetof(struct TConfig, Solar1Enabled),    sizeof(bool)},
+    {"ceiling_alt",         cfInt,      offsetof(struct TConfig, CeilingAltitude),  sizeof(int32_t)}
+};
+#define NUM_FIELDS (sizeof(FIELDS) / sizeof(FIELDS[0]))
+
+static const char *SOURCE_NAMES[] = {"defaults", CONFIG_FILE, "flash", "before the reset"};
+
+struct TConfig config;
+
+static_assert(sizeof(struct TConfig) <= MEMORY_MAX_VALUE, "TConfig is too big for the key-value store");
+
+static void seal(struct TConfig *c) {
+    c->Magic = CONFIG_MAGIC;
+    c->Version = CONFIG_VERSION;
+    c->Size = sizeof(struct TConfig);
+    c->CRC = crc32((const uint8_t *)c, offsetof(struct TConfig, CRC));
+}
+
+static bool valid(const struct TConfig *c) {
+    return (c->Magic == CONFIG_MAGIC) && (c->Version == CONFIG_VERSION) && (c->Size == sizeof(struct TConfig)) &&
+           (c->CRC == crc32((const uint8_t *)c, offsetof(struct TConfig, CRC)));
+}
+
+static void set_defaults(struct TConfig *c) {
+    memset(c, 0, sizeof(*c));
+
+    strncpy(c->Callsign, CALLSIGN, CONFIG_CALLSIGN_LENGTH - 1);
+    c->Frequency = FREQUENCY;
+    c->LoRaMode = LORA_MODE;
+    c->LoRaTransmitting = LORA_TRANSMITTING;
+    c->EnablePM = ENABLE_PM;
+    c->EnableNO2 = ENABLE_NO2;
+    c->Solar0Enabled = SOLAR0_EN;
+    c->Solar1Enabled = SOLAR1_EN;
+    c->CeilingAltitude = CEILING_ALT;
+
+    c->FencePoints = GEOFENCE_POINTS;
+    memcpy(c->Fence, GEOFENCE, sizeof(float) * 2 * GEOFENCE_POINTS);
+}
+
+static char *trim(char *text) {
+    while (isspace((unsigned char)*text)) {
+        text++;
+    }
+    char *end = text + strlen(text);
+    while ((end > text) && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return text;
+}
+
+static bool parse_bool(const char *value, bool *result) {
+    if ((strcasecmp(value, "true") == 0) || (strcasecmp(value, "yes") == 0) || (strcmp(value, "1") == 0)) {
+        *result = true;
+        return true;
+    }
+    if ((strcasecmp(value, "false") == 0) || (strcasecmp(value, "no") == 0) || (strcmp(value, "0") == 0)) {
+        *result = false;
+        return true;
+    }
+    return false;
+}
+
+static bool parse_field(struct TConfig *c, int field, const char *value) {
+    uint8_t *target = (uint8_t *)c + FIELDS[field].offset;
+    char *end;
+
+    switch (FIELDS[field].type) {
+        case cfString:
+            if (strlen(value) >= FIELDS[field].size) {
+                return false;
+            }
+            strcpy((char *)target, value);
+            return true;
+
+        case cfFloat: {
+            float number = strtof(value, &end);
+            if ((end == value) || *end) {
+                return false;
+            }
+            memcpy(target, &number, sizeof(number));
+            return true;
+        }
+
+        case cfInt: {
+            int32_t number = strtol(value, &end, 10);
+            if ((end == value) || *end) {
+                return false;
+            }
+            memcpy(target, &number, sizeof(number));
+            return true;
+        }
+
+        case cfByte: {
+            long number = strtol(value, &end, 10);
+            if ((end == value) || *end || (number < 0) || (number > 255)) {
+                return false;
+            }
+            *target = number;
+            return true;
+        }
+
+        case cfBool:
+            return parse_bool(value, (bool *)target);
+    }
+    return false;
+}
+
+static bool parse_fence_point(struct TConfig *c, const char *value, bool *first) {
+    // The first fence line replaces the built in geofence
+    char *end;
+    float longitude = strtof(value, &end);
+
+    if ((end == value) || (*end != ',')) {
+        return false;
+    }
+    const char *rest = end + 1;
+    float latitude = strtof(rest, &end);
+    if ((end == rest) || *trim(end)) {
+        return false;
+    }
+
+    if (*first) {
+        c->FencePoints = 0;
+        *first = false;
+    }
+    if (c->FencePoints >= CONFIG_MAX_FENCE_POINTS) {
+        return false;
+    }
+    c->Fence[2 * c->FencePoints] = longitude;
+    c->Fence[2 * c->FencePoints + 1] = latitude;
+    c->FencePoints++;
+    return true;
+}
+
+static bool parse_period(struct TConfig *c, const char *task, const char *value) {
+    char *end;
+    long period = strtol(value, &end, 10);
+
+    if (!*task || (strlen(task) >= CONFIG_TASK_NAME_LENGTH) || (end == value) || *end || (period <= 0)) {
+        return false;
+    }
+
+    // A task given twice keeps the last period
+    uint32_t i;
+    for (i = 0; (i < c->NumPeriods) && (strcasecmp(c->Periods[i].Task, task) != 0); i++) {
+    }
+    if (i >= CONFIG_MAX_PERIODS) {
+        return false;
+    }
+
+    strcpy(c->Periods[i].Task, task);
+    c->Periods[i].Period = period;
+    if (i == c->NumPeriods) {
+        c->NumPeriods++;
+    }
+    return true;
+}
+
+static int parse(struct TConfig *c, char *text) {
+    // Returns the number of lines that could not be used
+    int errors = 0;
+    int line_number = 0;
+    bool first_fence = true;
+
+    for (char *line = text, *next; line; line = next) {
+        line_number++;
+
+        next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        }
+
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        line = trim(line);
+        if (!*line) {
+            continue;
+        }
+
+        char *equals = strchr(line, '=');
+        bool ok = false;
+
+        if (equals) {
+            *equals = '\0';
+            char *key = trim(line);
+            char *value = trim(equals + 1);
+
+            if (strcasecmp(key, "fence") == 0) {
+                ok = parse_fence_point(c, value, &first_fence);
+            } else if (strncasecmp(key, "period", 6) == 0 && isspace((unsigned char)key[6])) {
+                ok = parse_period(c, trim(key + 6), value);
+            } else {
+                for (size_t i = 0; i < NUM_FIELDS; i++) {
+                    if (strcasecmp(key, FIELDS[i].key) == 0) {
+                        ok = parse_field(c, i, value);
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (!ok) {
+            LOG_WARN("<!> %s line %d ignored\n", CONFIG_FILE, line_number);
+            errors++;
+        }
+    }
+
+    if ((c->LoRaMode != 0) && (c->LoRaMode != 1) && (c->LoRaMode != 2) && (c->LoRaMode != 5)) {
+        LOG_WARN("<!> %s has no LoRa mode %d - using %d\n", CONFIG_FILE, c->LoRaMode, LORA_MODE);
+        c->LoRaMode = LORA_MODE;
+        errors++;
+    }
+
+    // A fence needs at least a triangle
+    if (c->FencePoints < 3) {
+        LOG_WARN("<!> %s geofence has too few points - using the built in one\n", CONFIG_FILE);
+        c->FencePoints = GEOFENCE_POINTS;
+        memcpy(c->Fence, GEOFENCE, sizeof(float) * 2 * GEOFENCE_POINTS);
+        errors++;
+    }
+    return errors;
+}
+
+TConfigSource config_load(const struct TConfig *resumed) {
+    // Call once the SD card is up, and before anything reads the configuration
+    // A warm restart passes the configuration it was running with, and the card is left alone. The flash copy
+    // is not enough, as a file with a bad line is used but never saved.
+    static char text[CONFIG_FILE_MAX];
+    static struct TConfig saved;
+    bool have_saved = memory_get(mkConfig, &saved, sizeof(saved)) && valid(&saved);
+    TConfigSource source = csDefaults;
+
+    set_defaults(&config);
+
+    if (resumed && valid(resumed)) {
+        config = *resumed;
+        source = csResumed;
+    } else if ((readFileFromSD(CONFIG_FILE, text, sizeof(text)) >= 0)) {
+        int errors = parse(&config, text);
+        seal(&config);
+        source = csSD;
+
+        // Only a file that was read cleanly replaces the copy in flash
+        if ((errors == 0) && (!have_saved || (memcmp(&saved, &config, sizeof(config)) != 0))) {
+            memory_put(mkConfig, &config, sizeof(config));
+            LOG_INFO("> %s saved to flash\n", CONFIG_FILE);
+        }
+    } else if (have_saved) {
+        config = saved;
+        source = csFlash;
+    } else {
+        seal(&config);
+    }
+
+    LOG_INFO("> Config from %s: %s on %.3f MHz mode %d, %stransmitting, ceiling %ld m, %lu point geofence\n",
+             SOURCE_NAMES[source], config.Callsign, config.Frequency, config.LoRaMode, config.LoRaTransmitting ? "" : "NOT ",
+             (long)config.CeilingAltitude, (unsigned long)config.FencePoints);
+    return source;
+}
+
+void config_apply_periods() {
+    // Sets the periods of the tasks named in the configuration - call once the drivers have set their own.
+    // Each task picks its new period up the next time it is checked, so this is safe with both cores running.
+    for (uint32_t i = 0; i < config.NumPeriods; i++) {
+        Repeater *task = repeater_find(config.Periods[i].Task);
+
+        if (task) {
+            task->request_delay(config.Periods[i].Period);
+        } else {
+            LOG_WARN("<!> No task called %s to set the period of\n", config.Periods[i].Task);
+        }
+    }
+}
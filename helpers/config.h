@@ -0,0 +1,56 @@
+#ifndef CONFIG_INCLUDED
+#define CONFIG_INCLUDED
+
+#include <stdint.h>
+
+// Runtime configuration
+// Starts from the #defines in main.h and cutdown.h, then takes any settings in config.txt on the SD card.
+// A good config.txt is also kept in the flash key-value store, so the tracker keeps its settings if the card cannot be read.
+// A warm restart carries on with exactly the configuration it had, wherever that came from - see resume.h.
+#define CONFIG_FILE "config.txt"
+#define CONFIG_FILE_MAX 4096
+#define CONFIG_MAGIC 0x47464E43         // "CNFG"
+#define CONFIG_VERSION 1                // Bump whenever TConfig changes - older flash copies are then ignored
+
+#define CONFIG_CALLSIGN_LENGTH 16
+#define CONFIG_MAX_FENCE_POINTS 48
+#define CONFIG_MAX_PERIODS 8
+#define CONFIG_TASK_NAME_LENGTH 16
+
+typedef enum {csDefaults, csSD, csFlash, csResumed} TConfigSource;
+
+struct TConfigPeriod {
+    char Task[CONFIG_TASK_NAME_LENGTH];
+    uint32_t Period;                    // ms
+};
+
+// Read everywhere as plain fields - config.Frequency and so on. Fields are ordered so there is no padding.
+struct TConfig {
+    uint32_t Magic;
+    uint16_t Version;
+    uint16_t Size;
+
+    float Frequency;
+    int32_t CeilingAltitude;
+    uint32_t FencePoints;
+    uint32_t NumPeriods;
+    float Fence[2 * CONFIG_MAX_FENCE_POINTS];          // Longitude, latitude pairs
+    struct TConfigPeriod Periods[CONFIG_MAX_PERIODS];
+    char Callsign[CONFIG_CALLSIGN_LENGTH];
+    uint8_t LoRaMode;
+    bool LoRaTransmitting;
+    bool EnablePM;
+    bool EnableNO2;
+    bool Solar0Enabled;
+    bool Solar1Enabled;
+    uint8_t Spare[2];
+
+    uint32_t CRC;                       // CRC-32 of everything before it
+};
+
+extern struct TConfig config;
+
+TConfigSource config_load(const struct TConfig *resumed);
+void config_apply_periods();
+
+#endif
@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "pico/stdlib.h"
+#include "../main.h"
+#include "../misc.h"
+#include "../lora.h"
+#include "repeater.h"
+#include "sensor.h"
+#include "i2c_bus.h"
+#include "sd.h"
+#include "power.h"
+#include "console.h"
+
+// USB command console
+// Runs on core 1. Characters are read without waiting, and replies go through the log ring like everything
+// else, so a console with nobody typing at it costs one poll every CONSOLE_POLL_MS.
+// Anything that belongs to core 0 - sensors and core 0's task periods - is changed by request, not directly.
+
+static char line[CONSOLE_LINE_LENGTH];
+static int line_length = 0;
+
+static bool streaming = false;
+static Repeater stream_repeater(CONSOLE_STREAM_MS);
+
+static const char *FLIGHT_MODES[] = {"Idle", "Launched", "Descending", "Landing", "Landed"};
+
+#define reply(...) log_write(llInfo, __VA_ARGS__)
+
+static void command_help() {
+    // One reply per line, as each log message is limited to LOG_LINE_LENGTH
+    reply("> Commands:\n");
+    reply(">   tasks                 task runs, misses, worst jitter and run time\n");
+    reply(">   bus                   I2C health and the slowest lock sites\n");
+    reply(">   sd                    SD card writes\n");
+    reply(">   state                 current state\n");
+    reply(">   probe                 retry failing sensors and rescan the I2C buses\n");
+    reply(">   period <task> <ms>    change a task's period\n");
+    reply(">   lora <mode>           change the LoRa mode (0, 1, 2 or 5)\n");
+    reply(">   stream on [ms] | off  send FRAME lines of binary telemetry\n");
+}
+
+static void command_tasks() {
+    reply("> Task             Runs     Miss  Jitter(us)  Run(us)\n");
+    for (int i = 0; i < repeater_task_count(); i++) {
+        Repeater *task = repeater_task(i);
+        reply("> %-16s %-8lu %-5lu %-11lu %lu\n", task->name, (unsigned long)task->stats.runs, (unsigned long)task->stats.misses,
+              (unsigned long)task->stats.jitter_max, (unsigned long)task->stats.exec_max);
+    }
+}
+
+static void command_bus() {
+    i2c_inst_t *buses[] = {I2C_PORT_0, I2C_PORT_1};
+
+    for (int bus = 0; bus < 2; bus++) {
+        struct TI2CBusHealth *health = i2c_bus_health(buses[bus]);
+        reply("> I2C %d: %lu transactions, %lu NACKs, %lu timeouts, %lu recoveries\n", bus,
+              (unsigned long)health->transactions, (unsigned long)health->nacks,
+              (unsigned long)health->timeouts, (unsigned long)health->recoveries);
+    }
+
+    // Sites that held their lock longest, worst first
+    int shown[8];
+    int count = 0;
+
+    while (count < 8) {
+        int worst = -1;
+        for (int i = 0; i < lock_site_count(); i++) {
+            bool seen = false;
+            for (int j = 0; j < count; j++) {
+                seen |= (shown[j] == i);
+            }
+            if (!seen && ((worst < 0) || (lock_site(i)->hold_max > lock_site(worst)->hold_max))) {
+                worst = i;
+            }
+        }
+        if (worst < 0) {
+            break;
+        }
+        shown[count++] = worst;
+
+        struct TLockSite *site = lock_site(worst);
+        const char *file = strrchr(site->file, '/');
+        reply("> Lock %s:%d (%s): %lu/%lu taken, wait max %lu us, hold max %lu us, %lu out of order\n",
+              file ? file + 1 : site->file, site->line, site->func,
+              (unsigned long)site->count[0], (unsigned long)site->count[1], (unsigned long)site->wait_max,
+              (unsigned long)site->hold_max, (unsigned long)(site->inversions + site->out_of_order));
+    }
+}
+
+static void command_sd() {
+    struct TSDStats *stats = sd_stats();
+    reply("> SD: %lu writes, %lu bytes, %lu failed, %lu skipped, slowest %lu us\n",
+          (unsigned long)stats->writes, (unsigned long)stats->bytes, (unsigned long)stats->failures,
+          (unsigned long)stats->skipped, (unsigned long)stats->write_max_us);
+}
+
+static void command_state() {
+    static struct STATE s;
+
+    LOCK(&mtx);
+    s = state;
+    UNLOCK(&mtx);
+
+    reply("> Time %02d:%02d:%02d, %s, %s power\n", s.Hours, s.Minutes, s.Seconds, FLIGHT_MODES[s.FlightMode],
+          power_mode() == pwLow ? "low" : "full");
+    reply("> Position %.5f, %.5f, %u satellites\n", s.Latitude, s.Longitude, s.Satellites);
+    reply("> Altitude %ld m (%s), GPS %ld m, baro %ld m, min %ld m, max %ld m, rate %.1f m/s\n", s.Altitude,
+          s.AltitudeSource == asGPS ? "GPS" : (s.AltitudeSource == asBaro ? "baro" : "none"),
+          s.GPSAltitude, s.BaroAltitude, s.MinimumAltitude, s.MaximumAltitude, s.AscentRate);
+    reply("> Battery %.2f V, %.0f%% left, %.1f h endurance%s\n", s.BatteryVoltage, s.BatteryRemaining * 100, s.Endurance,
+          s.LowBattery ? ", LOW" : "");
+    reply("> Internal %.1f C, BME280 %.1f C %.0f Pa %.1f%%, TMP117 %.2f C%s, AHT20 %.1f C %.1f%%\n", s.InternalTemperature,
+          s.BMETemperature, s.BMEPressure, s.BMEHumidity, s.TMP117Temperature, s.TMP117Valid ? "" : " (invalid)",
+          s.AHT20Temperature, s.AHT20Humidity);
+    if (config.EnableNO2) {
+        reply("> NO2 WE %.3f V, AE %.3f V\n", s.NO2WE, s.NO2AE);
+    }
+    if (config.EnablePM) {
+        reply("> PM1 %.1f, PM2.5 %.1f, PM10 %.1f ug/m3, %.1f /ml\n", s.PM1, s.PM2, s.PM10, s.PMNumberConcentration);
+    }
+    if (ENABLE_MUON) {
+        reply("> Muons %d, %.2f /s\n", s.muonCount, s.muonRate);
+    }
+    reply("> Cut down %s, LoRa mode %d\n", s.HasCutDown ? "yes" : "no", lora_mode());
+}
+
+static void command_period(char *name, char *ms) {
+    Repeater *task = name ? repeater_find(name) : NULL;
+    long period = ms ? atol(ms) : 0;
+
+    if (!task || (period <= 0)) {
+        reply("<!> Usage: period <task> <ms> - see tasks for the names\n");
+        return;
+    }
+
+    task->request_delay(period);
+    reply("> %s period %ld ms\n", task->name, period);
+}
+
+static void command_lora(char *mode) {
+    if (!mode || !lora_set_mode(atoi(mode))) {
+        reply("<!> Usage: lora <0, 1, 2 or 5>\n");
+        return;
+    }
+    reply("> LoRa mode %s from the next packet\n", mode);
+}
+
+static void command_stream(char *on, char *ms) {
+    if (on && (strcasecmp(on, "on") == 0)) {
+        long period = ms ? atol(ms) : CONSOLE_STREAM_MS;
+        stream_repeater.set_delay(period > 0 ? period : CONSOLE_STREAM_MS);
+        streaming = true;
+    } else if (on && (strcasecmp(on, "off") == 0)) {
+        streaming = false;
+    } else {
+        reply("<!> Usage: stream on [ms] | off\n");
+    }
+}
+
+static void run_command(char *text) {
+    char *command = strtok(text, " \t");
+    char *arg1 = strtok(NULL, " \t");
+    char *arg2 = strtok(NULL, " \t");
+
+    if (!command) {
+        return;
+    }
+
+    if (strcasecmp(command, "help") == 0) {
+        command_help();
+    } else if (strcasecmp(command, "tasks") == 0) {
+        command_tasks();
+    } else if (strcasecmp(command, "bus") == 0) {
+        command_bus();
+    } else if (strcasecmp(command, "sd") == 0) {
+        command_sd();
+    } else if (strcasecmp(command, "state") == 0) {
+        command_state();
+    } else if (strcasecmp(command, "probe") == 0) {
+        sensor_request_rescan();
+        reply("> Sensors will be probed again\n");
+    } else if (strcasecmp(command, "period") == 0) {
+        command_period(arg1, arg2);
+    } else if (strcasecmp(command, "lora") == 0) {
+        command_lora(arg1);
+    } else if (strcasecmp(command, "stream") == 0) {
+        command_stream(arg1, arg2);
+    } else {
+        reply("<!> Unknown command %s - try help\n", command);
+    }
+}
+
+void console_poll() {
+    // Collects whatever has been typed, and runs each line as it is completed
+    int c;
+
+    while ((c = getchar_timeout_us(0)) != PICO_ERROR_TIMEOUT) {
+        if ((c == '\r') || (c == '\n')) {
+            line[line_length] = '\0';
+            line_length = 0;
+            run_command(line);
+        } else if ((c == '\b') || (c == 0x7F)) {
+            if (line_length > 0) {
+                line_length--;
+            }
+        } else if (line_length < CONSOLE_LINE_LENGTH - 1) {
+            line[line_length++] = c;
+        }
+    }
+}
+
+static uint16_t frame_crc(const uint8_t *data, size_t len) {
+    uint16_t crc = 0xFFFF;
+
+    for (size_t i = 0; i < len; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int j = 0; j < 8; j++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+void console_stream() {
+    // Sends a telemetry frame when one is due
+    if (!streaming || !stream_repeater.can_fire()) {
+        return;
+    }
+
+    struct TConsoleFrame frame;
+    char hex[2 * sizeof(frame) + 1];
+
+    LOCK(&mtx);
+    frame.version = CONSOLE_FRAME_VERSION;
+    frame.flight_mode = state.FlightMode;
+    frame.satellites = state.Satellites;
+    frame.altitude_source = state.AltitudeSource;
+    frame.uptime_ms = to_ms_since_boot(get_absolute_time());
+    frame.gps_time = state.Time;
+    frame.latitude = state.Latitude;
+    frame.longitude = state.Longitude;
+    frame.altitude = state.Altitude;
+    frame.ascent_rate = state.AscentRate;
+    frame.battery_voltage = state.BatteryVoltage;
+    frame.internal_temperature = state.InternalTemperature;
+    frame.bme_temperature = state.BMETemperature;
+    frame.bme_pressure = state.BMEPressure;
+    frame.bme_humidity = state.BMEHumidity;
+    frame.tmp117_temperature = state.TMP117Temperature;
+    frame.aht20_temperature = state.AHT20Temperature;
+    frame.aht20_humidity = state.AHT20Humidity;
+    UNLOCK(&mtx);
+
+    frame.crc = frame_crc((const uint8_t *)&frame, offsetof(struct TConsoleFrame, crc));
+
+    const uint8_t *bytes = (const uint8_t *)&frame;
+    for (size_t i = 0; i < sizeof(frame); i++) {
+        hex[2 * i] = Hex(bytes[i] >> 4);
+        hex[2 * i + 1] = Hex(bytes[i] & 15);
+    }
+    hex[2 * sizeof(frame)] = '\0';
+
+    reply("FRAME %s\n", hex);
+}
+
+bool console_streaming() {
+    return streaming;
+}
@@ -0,0 +1,36 @@
+#ifndef CONSOLE_INCLUDED
+#define CONSOLE_INCLUDED
+
+#include <stdint.h>
+
+// USB command console - type "help" for the commands
+#define CONSOLE_POLL_MS 50
+#define CONSOLE_LINE_LENGTH 64
+#define CONSOLE_STREAM_MS 1000          // Default period of the telemetry frame stream
+
+#define CONSOLE_FRAME_VERSION 1
+
+// Telemetry frame sent by "stream on", as a "FRAME " line of hex, little endian
+struct __attribute__((packed)) TConsoleFrame {
+    uint8_t version;
+    uint8_t flight_mode;
+    uint8_t satellites;
+    uint8_t altitude_source;
+    uint32_t uptime_ms;
+    uint32_t gps_time;                  // hhmmss
+    float latitude, longitude;
+    int32_t altitude;
+    float ascent_rate;
+    float battery_voltage;
+    float internal_temperature;
+    float bme_temperature, bme_pressure, bme_humidity;
+    float tmp117_temperature;
+    float aht20_temperature, aht20_humidity;
+    uint16_t crc;                       // CRC-16/CCITT of everything before it
+};
+
+void console_poll();
+void console_stream();
+bool console_streaming();
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef FRAME_INCLUDED
+#define FRAME_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+
+// Compile-time layouts of frames received from devices
+// A field is a type naming its offset, size and encoding, and get() compiles down to just the loads for
+// that field - no offset tables, no per-byte helper calls. Floats are bit-cast straight from the buffer.
+// Multi-byte loads go through memcpy as the M0+ can't do unaligned loads; the compiler picks the instructions.
+
+template <typename T, size_t Offset>
+struct LEField {
+    static const size_t end = Offset + sizeof(T);
+
+    static inline T get(const uint8_t *frame) {
+        T value;
+        memcpy(&value, frame + Offset, sizeof(T));
+        return value;
+    }
+};
+
+template <typename T, size_t Offset, size_t Count>
+struct LEArray {
+    static const size_t end = Offset + Count * sizeof(T);
+    static const size_t count = Count;
+
+    static inline T get(const uint8_t *frame, size_t index) {
+        T value;
+        memcpy(&value, frame + Offset + index * sizeof(T), sizeof(T));
+        return value;
+    }
+};
+
+// Bits [Shift, Shift + Width) of the Bytes byte value at Offset, sign extended if T is signed
+template <typename T, size_t Offset, size_t Bytes, bool BigEndian, unsigned Shift, unsigned Width>
+struct BitField {
+    static_assert((Bytes >= 1) && (Bytes <= 4), "bit fields are read from at most 4 bytes");
+    static_assert((Width >= 1) && (Shift + Width <= Bytes * 8), "bit field does not fit");
+
+    static const size_t end = Offset + Bytes;
+
+    static inline T get(const uint8_t *frame) {
+        uint32_t value = 0;
+        for (size_t i = 0; i < Bytes; i++) {
+            value |= (uint32_t)frame[Offset + i] << (8 * (BigEndian ? Bytes - 1 - i : i));
+        }
+        value >>= Shift;
+
+        if ((T)-1 < 0) {
+            return (T)((int32_t)(value << (32 - Width)) >> (32 - Width));
+        }
+        return (T)(Width == 32 ? value : value & ((1u << Width) - 1));
+    }
+};
+
+template <typename T, size_t Offset, size_t Bytes, unsigned Shift, unsigned Width>
+using BEBits = BitField<T, Offset, Bytes, true, Shift, Width>;
+
+template <typename T, size_t Offset, size_t Bytes, unsigned Shift, unsigned Width>
+using LEBits = BitField<T, Offset, Bytes, false, Shift, Width>;
+
+// A value split across two fields, e.g. the BME280's dig_H4
+template <typename T, typename High, typename Low, unsigned LowWidth>
+struct JoinedField {
+    static inline T get(const uint8_t *frame) {
+        return (T)(((uint32_t)High::get(frame) << LowWidth) | Low::get(frame));
+    }
+};
+
+#endif
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/gpio.h"
+#include "hardware/i2c.h"
+#include "../main.h"
+#include "../misc.h"
+#include "i2c_bus.h"
+#include "trace.h"
+
+// Wrappers round the SDK I2C calls so that a device holding the bus can never hang the core
+// Any timeout is followed by a bus clear, and all transactions are counted per bus
+
+static struct TI2CBusHealth bus_health[2];
+
+struct TI2CBusHealth *i2c_bus_health(i2c_inst_t *i2c) {
+    return &bus_health[i2c_get_index(i2c)];
+}
+
+static void check_result(i2c_inst_t *i2c, int result) {
+    struct TI2CBusHealth *health = i2c_bus_health(i2c);
+
+    health->transactions++;
+
+    if (result == PICO_ERROR_TIMEOUT) {
+        health->timeouts++;
+        i2c_bus_recover(i2c);
+    } else if (result < 0) {
+        health->nacks++;
+    }
+}
+
+int i2c_bus_write(i2c_inst_t *i2c, uint8_t address, const uint8_t *src, size_t len, bool nostop) {
+    uint32_t start = trace_start();
+    int result = i2c_write_timeout_us(i2c, address, src, len, nostop, I2C_TIMEOUT_US + len * I2C_TIMEOUT_PER_BYTE_US);
+    trace_end(trI2C, start, (i2c_get_index(i2c) << 8) | address);
+    check_result(i2c, result);
+    return result;
+}
+
+int i2c_bus_read(i2c_inst_t *i2c, uint8_t address, uint8_t *dst, size_t len, bool nostop) {
+    uint32_t start = trace_start();
+    int result = i2c_read_timeout_us(i2c, address, dst, len, nostop, I2C_TIMEOUT_US + len * I2C_TIMEOUT_PER_BYTE_US);
+    trace_end(trI2C, start, (i2c_get_index(i2c) << 8) | address);
+    check_result(i2c, result);
+    return result;
+}
+
+// Open drain emulation - a line is pulled low by driving it, and released by making it an input
+static inline void line_low(uint pin) {
+    gpio_set_dir(pin, GPIO_OUT);
+    busy_wait_us(5);
+}
+
+static inline void line_release(uint pin) {
+    gpio_set_dir(pin, GPIO_IN);
+    busy_wait_us(5);
+}
+
+void i2c_bus_recover(i2c_inst_t *i2c) {
+    // Clock out whatever a slave is stuck sending (up to 9 clocks), then send a STOP
+    uint sda = i2c_get_index(i2c) ? SDA_1 : SDA_0;
+    uint scl = i2c_get_index(i2c) ? SCL_1 : SCL_0;
+
+    i2c_bus_health(i2c)->recoveries++;
+    LOG_WARN("<!> (%d) I2C %d bus recovery\n", get_core_num(), i2c_get_index(i2c));
+
+    gpio_put(sda, 0);
+    gpio_put(scl, 0);
+    gpio_set_dir(sda, GPIO_IN);
+    gpio_set_dir(scl, GPIO_IN);
+    gpio_set_function(sda, GPIO_FUNC_SIO);
+    gpio_set_function(scl, GPIO_FUNC_SIO);
+
+    for (int i = 0; (i < 9) && !gpio_get(sda); i++) {
+        line_low(scl);
+        line_release(scl);
+    }
+
+    // STOP condition - SDA rising while SCL is high
+    line_low(scl);
+    line_low(sda);
+    line_release(scl);
+    line_release(sda);
+
+    // Reset the controller, which may be stuck mid-transfer as well
+    i2c_init(i2c, I2C_BAUDRATE);
+    gpio_set_function(sda, GPIO_FUNC_I2C);
+    gpio_set_function(scl, GPIO_FUNC_I2C);
+}
@@ -0,0 +1,22 @@
+#ifndef I2C_BUS_INCLUDED
+#define I2C_BUS_INCLUDED
+
+#include "hardware/i2c.h"
+
+// Every transaction gets this long plus I2C_TIMEOUT_PER_BYTE_US for each byte before it is abandoned
+#define I2C_TIMEOUT_US 1000
+#define I2C_TIMEOUT_PER_BYTE_US 100
+
+struct TI2CBusHealth {
+    uint32_t transactions;
+    uint32_t nacks;         // No device answered - normal for absent sensors
+    uint32_t timeouts;      // Bus hung - followed by a recovery
+    uint32_t recoveries;
+};
+
+int i2c_bus_write(i2c_inst_t *i2c, uint8_t address, const uint8_t *src, size_t len, bool nostop);
+int i2c_bus_read(i2c_inst_t *i2c, uint8_t address, uint8_t *dst, size_t len, bool nostop);
+void i2c_bus_recover(i2c_inst_t *i2c);
+struct TI2CBusHealth *i2c_bus_health(i2c_inst_t *i2c);
+
+#endif
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/critical_section.h"
+#include "../main.h"
+#include "../misc.h"
+#include "sd.h"
+#include "trace.h"
+#include "lock.h"
+
+// Lock profiling
+// A site is registered the first time it takes a lock. Its counters are only written by the core taking
+// the lock there, apart from blocked_us[], which the other core adds to while it waits.
+// Each core keeps a stack of the locks it holds, which is what the rank checks look at.
+
+static struct TLockSite *sites[LOCK_MAX_SITES];
+static int num_sites = 0;
+static critical_section_t sites_lock;
+static bool sites_lock_ready = false;
+
+static struct TProfiledMutex *held[2][LOCK_MAX_DEPTH];
+static int depth[2];
+
+
+static const char *site_file(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+void lock_init(struct TProfiledMutex *lock, mutex_t *mutex, const char *name, uint8_t rank, uint16_t trace_arg) {
+    // Call from core 0 before core 1 is started
+    if (!sites_lock_ready) {
+        critical_section_init(&sites_lock);
+        sites_lock_ready = true;
+    }
+
+    lock->mutex = mutex;
+    lock->name = name;
+    lock->rank = rank;
+    lock->trace_arg = trace_arg;
+    lock->holder = NULL;
+}
+
+static void register_site(struct TLockSite *site) {
+    critical_section_enter_blocking(&sites_lock);
+    if (!site->registered && (num_sites < LOCK_MAX_SITES)) {
+        sites[num_sites++] = site;
+        site->registered = true;
+    }
+    critical_section_exit(&sites_lock);
+}
+
+static void check_order(struct TProfiledMutex *lock, struct TLockSite *site, uint core) {
+    for (int i = 0; i < depth[core]; i++) {
+        if (held[core][i]->rank >= lock->rank) {
+            if (site->inversions++ == 0) {
+                LOG_WARN("<!> (%d) Lock order: %s taken holding %s at %s:%d (%s)\n", core, lock->name, held[core][i]->name,
+                       site_file(site->file), site->line, site->func);
+            }
+            return;
+        }
+    }
+}
+
+static void acquired(struct TProfiledMutex *lock, struct TLockSite *site, uint core, uint32_t wait, bool owned) {
+    if (!site->registered) {
+        register_site(site);
+    }
+
+    site->count[core]++;
+    site->wait_us += wait;
+    if (wait > site->wait_max) {
+        site->wait_max = wait;
+    }
+
+    if (depth[core] < LOCK_MAX_DEPTH) {
+        held[core][depth[core]++] = lock;
+    }
+
+    if (owned) {
+        lock->acquired_at = time_us_32();
+        lock->holder = site;
+    }
+}
+
+void lock_enter(struct TProfiledMutex *lock, struct TLockSite *site) {
+    uint core = get_core_num();
+    check_order(lock, site, core);
+
+    uint32_t start = time_us_32();
+    if (mutex_try_enter(lock->mutex, NULL)) {
+        acquired(lock, site, core, 0, true);
+        return;
+    }
+
+    // Blame whoever has it now for the wait
+    struct TLockSite *blocker = lock->holder;
+    mutex_enter_blocking(lock->mutex);
+    uint32_t wait = time_us_32() - start;
+
+    if (blocker) {
+        blocker->blocked_us[core] += wait;
+    }
+    trace_end(trMutexWait, start, lock->trace_arg);
+    acquired(lock, site, core, wait, true);
+}
+
+bool lock_try_enter(struct TProfiledMutex *lock, struct TLockSite *site) {
+    uint core = get_core_num();
+
+    if (!mutex_try_enter(lock->mutex, NULL)) {
+        return false;
+    }
+    check_order(lock, site, core);
+    acquired(lock, site, core, 0, true);
+    return true;
+}
+
+void lock_note_enter(struct TProfiledMutex *lock, struct TLockSite *site) {
+    // The mutex is about to be taken by other code - check the order and count it, but the hold is not timed,
+    // as we cannot tell when it actually gets the mutex
+    uint core = get_core_num();
+    check_order(lock, site, core);
+    acquired(lock, site, core, 0, false);
+}
+
+static void released(struct TProfiledMutex *lock, bool owned) {
+    uint core = get_core_num();
+    struct TLockSite *site = NULL;
+
+    if (owned) {
+        uint32_t hold = time_us_32() - lock->acquired_at;
+
+        site = lock->holder;
+        lock->holder = NULL;
+
+        if (site) {
+            site->hold_us += hold;
+            if (hold > site->hold_max) {
+                site->hold_max = hold;
+            }
+        }
+    }
+
+    // Should be the most recent lock this core took
+    for (int i = depth[core] - 1; i >= 0; i--) {
+        if (held[core][i] == lock) {
+            if (i != depth[core] - 1) {
+                if (!site) {
+                    LOG_WARN("<!> (%d) Lock %s released out of order\n", core, lock->name);
+                } else if (site->out_of_order++ == 0) {
+                    LOG_WARN("<!> (%d) Lock %s released out of order, taken at %s:%d (%s)\n", core, lock->name,
+                           site_file(site->file), site->line, site->func);
+                }
+            }
+            memmove(&held[core][i], &held[core][i + 1], (depth[core] - i - 1) * sizeof(held[core][0]));
+            depth[core]--;
+            break;
+        }
+    }
+}
+
+void lock_exit(struct TProfiledMutex *lock) {
+    released(lock, true);
+    mutex_exit(lock->mutex);
+}
+
+void lock_note_exit(struct TProfiledMutex *lock) {
+    // The other code has released the mutex itself
+    released(lock, false);
+}
+
+void lock_detach(struct TProfiledMutex *lock) {
+    // Takes a held lock off this core's stack, so locks taken before it is released are not checked against it.
+    // Only for an order that has been shown not to deadlock - its hold is still timed.
+    uint core = get_core_num();
+
+    for (int i = depth[core] - 1; i >= 0; i--) {
+        if (held[core][i] == lock) {
+            memmove(&held[core][i], &held[core][i + 1], (depth[core] - i - 1) * sizeof(held[core][0]));
+            depth[core]--;
+            break;
+        }
+    }
+}
+
+void lock_report() {
+    // Every site to lock_log[X].txt, and the ones that held up core 1 - the LoRa core - the most to USB
+    static char log_string[2048];
+    char *pos = log_string;
+    char filename[20];
+    int worst[3] = {-1, -1, -1};
+
+    sprintf(filename, "lock_log%d.txt", sd_log_file(slLock, num_sites));
+
+    for (int i = 0; i < num_sites; i++) {
+        struct TLockSite *site = sites[i];
+
+        if (pos - log_string > (int)sizeof(log_string) - 200) {
+            logStringToSD(log_string, filename);
+            pos = log_string;
+        }
+
+        // site, function, acquisitions per core, wait total/max, hold total/max (us), core 0/1 blocked (us), inversions, out of order
+        pos += sprintf(pos, "%s:%d,%s,%lu,%lu,%llu,%lu,%llu,%lu,%llu,%llu,%lu,%lu\n", site_file(site->file), site->line, site->func,
+                       (unsigned long)site->count[0], (unsigned long)site->count[1],
+                       (unsigned long long)site->wait_us, (unsigned long)site->wait_max,
+                       (unsigned long long)site->hold_us, (unsigned long)site->hold_max,
+                       (unsigned long long)site->blocked_us[0], (unsigned long long)site->blocked_us[1],
+                       (unsigned long)site->inversions, (unsigned long)site->out_of_order);
+
+        for (int j = 0; j < 3; j++) {
+            if ((site->blocked_us[1] > 0) && ((worst[j] < 0) || (site->blocked_us[1] > sites[worst[j]]->blocked_us[1]))) {
+                memmove(&worst[j + 1], &worst[j], (2 - j) * sizeof(worst[0]));
+                worst[j] = i;
+                break;
+            }
+        }
+    }
+
+    if (pos > log_string) {
+        logStringToSD(log_string, filename);
+    }
+
+    for (int j = 0; (j < 3) && (worst[j] >= 0); j++) {
+        struct TLockSite *site = sites[worst[j]];
+        LOG_DEBUG("> Core 1 held up %llu ms by %s:%d (%s)\n", (unsigned long long)(site->blocked_us[1] / 1000),
+                  site_file(site->file), site->line, site->func);
+    }
+}
+
+int lock_site_count() {
+    return num_sites;
+}
+
+struct TLockSite *lock_site(int index) {
+    return sites[index];
+}
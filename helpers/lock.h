@@ -0,0 +1,60 @@
+#ifndef LOCK_INCLUDED
+#define LOCK_INCLUDED
+
+#include <stdint.h>
+#include "pico/mutex.h"
+
+// Profiled mutexes
+// LOCK() records, for each place a lock is taken, how often each core took it there, how long it waited
+// and how long it held it. Locks have a rank and must be taken in increasing rank order; taking one
+// while holding another of equal or higher rank, or releasing them out of order, is flagged.
+#define LOCK_MAX_SITES 64
+#define LOCK_MAX_DEPTH 4
+#define LOCK_REPORT_MS (60 * 1000)
+
+// Ranks - the state is taken before the SPI bus, never the other way round, apart from the OPC on core 0 (see pm.cpp)
+#define LOCK_RANK_STATE 1
+#define LOCK_RANK_SPI0 2
+
+struct TLockSite {
+    const char *file;
+    const char *func;
+    int line;
+    bool registered;
+    uint32_t count[2];              // Acquisitions by each core
+    uint64_t wait_us;
+    uint32_t wait_max;
+    uint64_t hold_us;
+    uint32_t hold_max;
+    uint64_t blocked_us[2];         // Time each core spent waiting while this site held the lock
+    uint32_t inversions;            // Taken while holding a lock of equal or higher rank
+    uint32_t out_of_order;          // Released while a lock taken later was still held
+};
+
+struct TProfiledMutex {
+    mutex_t *mutex;
+    const char *name;
+    uint8_t rank;
+    uint16_t trace_arg;
+    struct TLockSite *volatile holder;
+    uint32_t acquired_at;
+};
+
+void lock_init(struct TProfiledMutex *lock, mutex_t *mutex, const char *name, uint8_t rank, uint16_t trace_arg);
+void lock_enter(struct TProfiledMutex *lock, struct TLockSite *site);
+bool lock_try_enter(struct TProfiledMutex *lock, struct TLockSite *site);
+void lock_exit(struct TProfiledMutex *lock);
+// For mutexes taken inside code we do not control, such as the SD driver
+void lock_note_enter(struct TProfiledMutex *lock, struct TLockSite *site);
+void lock_note_exit(struct TProfiledMutex *lock);
+// For a lock kept from one pass of the main loop to the next, while other tasks take locks of lower rank
+void lock_detach(struct TProfiledMutex *lock);
+void lock_report();
+int lock_site_count();
+struct TLockSite *lock_site(int index);
+
+#define LOCK_SITE(name) static struct TLockSite name = {__FILE__, __func__, __LINE__}
+#define LOCK(lock) do { LOCK_SITE(_lock_site); lock_enter(lock, &_lock_site); } while (0)
+#define UNLOCK(lock) lock_exit(lock)
+
+#endif
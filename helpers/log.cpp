@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include "pico/stdlib.h"
+#include "pico/stdio_usb.h"
+#include "tusb.h"
+#include "../main.h"
+#include "log.h"
+
+// Each core only writes to its own ring and only check_LOG on core 1 reads them, so neither side needs a lock:
+// the writer moves head once the message is in place, the reader moves tail once it has been sent.
+// Messages are stored as a 2 byte length, the level, then the text, and may wrap round the end of the ring.
+// Interrupt handlers must not log.
+
+#define LOG_HEADER_BYTES 3
+
+struct TLogRing {
+    volatile uint32_t head;         // Bytes written since boot
+    volatile uint32_t tail;         // Bytes sent since boot
+    volatile uint32_t dropped;
+    uint32_t dropped_reported;
+    uint8_t data[LOG_RING_BYTES];
+};
+
+static struct TLogRing rings[2];
+
+static void ring_put(struct TLogRing *ring, uint32_t position, const uint8_t *data, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        ring->data[(position + i) & (LOG_RING_BYTES - 1)] = data[i];
+    }
+}
+
+static void ring_get(struct TLogRing *ring, uint32_t position, uint8_t *data, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        data[i] = ring->data[(position + i) & (LOG_RING_BYTES - 1)];
+    }
+}
+
+void log_write(TLogLevel level, const char *format, ...) {
+    char line[LOG_LINE_LENGTH];
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (len <= 0) {
+        return;
+    }
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+
+    struct TLogRing *ring = &rings[get_core_num()];
+    uint32_t head = ring->head;
+
+    if (LOG_RING_BYTES - (head - ring->tail) < (uint32_t)len + LOG_HEADER_BYTES) {
+        ring->dropped++;
+        return;
+    }
+
+    uint8_t header[LOG_HEADER_BYTES] = {(uint8_t)len, (uint8_t)(len >> 8), (uint8_t)level};
+    ring_put(ring, head, header, LOG_HEADER_BYTES);
+    ring_put(ring, head + LOG_HEADER_BYTES, (const uint8_t *)line, len);
+
+    // The message must be complete before the other core can see it
+    __dmb();
+    ring->head = head + LOG_HEADER_BYTES + len;
+}
+
+static bool usb_has_room(const char *text, uint32_t len) {
+    // stdio turns each \n into \r\n, so those take two bytes
+    uint32_t needed = len;
+    for (uint32_t i = 0; i < len; i++) {
+        if (text[i] == '\n') {
+            needed++;
+        }
+    }
+    return tud_cdc_write_available() >= needed;
+}
+
+void log_drain() {
+    // Sends what fits in the USB buffer now, oldest first on each core; the rest waits for the next call
+    // With no host attached the messages are thrown away, as stdio would
+    bool connected = stdio_usb_connected();
+    uint32_t sent = 0;
+
+    for (int core = 0; core < 2; core++) {
+        struct TLogRing *ring = &rings[core];
+        char line[LOG_LINE_LENGTH];
+
+        while ((ring->tail != ring->head) && (sent < LOG_DRAIN_BYTES)) {
+            uint8_t header[LOG_HEADER_BYTES];
+            uint32_t tail = ring->tail;
+
+            ring_get(ring, tail, header, LOG_HEADER_BYTES);
+            uint32_t len = header[0] | (header[1] << 8);
+
+            if (connected) {
+                ring_get(ring, tail + LOG_HEADER_BYTES, (uint8_t *)line, len);
+                if (!usb_has_room(line, len)) {
+                    return;
+                }
+                printf("%.*s", (int)len, line);
+                sent += len;
+            }
+
+            __dmb();
+            ring->tail = tail + LOG_HEADER_BYTES + len;
+        }
+
+        uint32_t dropped = ring->dropped;
+        if (connected && (dropped != ring->dropped_reported)) {
+            int len = snprintf(line, sizeof(line), "<!> (%d) %lu log messages dropped\n", core, (unsigned long)(dropped - ring->dropped_reported));
+            if (!usb_has_room(line, len)) {
+                return;
+            }
+            printf("%s", line);
+            ring->dropped_reported = dropped;
+        }
+    }
+}
+
+bool log_pending() {
+    return (rings[0].tail != rings[0].head) || (rings[1].tail != rings[1].head);
+}
+
+uint32_t log_dropped() {
+    return rings[0].dropped + rings[1].dropped;
+}
@@ -0,0 +1,32 @@
+#ifndef LOG_INCLUDED
+#define LOG_INCLUDED
+
+#include <stdint.h>
+
+// Deferred console output
+// Messages are formatted into a ring owned by the calling core and written to USB later by check_LOG on core 1,
+// so logging never waits for the host. If a ring is full the message is dropped and counted.
+typedef enum {llDebug, llInfo, llWarn, llError} TLogLevel;
+
+// Messages below this level are compiled out
+#ifndef LOG_LEVEL
+#define LOG_LEVEL (DEBUG ? llDebug : llInfo)
+#endif
+
+#define LOG_RING_BITS 12
+#define LOG_RING_BYTES (1 << LOG_RING_BITS)     // Per core
+#define LOG_LINE_LENGTH 256                     // Longer messages are truncated
+#define LOG_DRAIN_MS 10
+#define LOG_DRAIN_BYTES 1024                    // Most written to USB per drain, so a burst cannot hold up core 1
+
+void log_write(TLogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void log_drain();
+bool log_pending();
+uint32_t log_dropped();
+
+#define LOG_DEBUG(...) do { if (llDebug >= LOG_LEVEL) log_write(llDebug, __VA_ARGS__); } while (0)
+#define LOG_INFO(...) do { if (llInfo >= LOG_LEVEL) log_write(llInfo, __VA_ARGS__); } while (0)
+#define LOG_WARN(...) do { if (llWarn >= LOG_LEVEL) log_write(llWarn, __VA_ARGS__); } while (0)
+#define LOG_ERROR(...) do { if (llError >= LOG_LEVEL) log_write(llError, __VA_ARGS__); } while (0)
+
+#endif
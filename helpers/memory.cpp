@@ -1,35 +1,349 @@
 #include <stdio.h>
 #include <string.h>
 #include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "pico/critical_section.h"
 #include "hardware/flash.h"
+#include "hardware/sync.h"
 #include "../main.h"
 #include "../misc.h"
 #include "memory.h"
 
+// Log-structured key-value store
+// Each sector starts with a header holding a sequence number, followed by records of
+// {CRC-32, key, length, value}, each padded to 4 bytes. A later record of a key replaces any earlier one.
+// The sectors are used in turn; whenever a sector is started, the live values in the sector after it are
+// copied into it, so the sector that will be erased next never holds anything still needed.
+// A record cut short by a reset fails its CRC, and the rest of that sector is then left alone.
+//
+// memory_put() can be called from either core. memory_get() and memory_flush() are for core 0 only;
+// the flush holds core 1 in multicore_lockout while the flash is written, as neither core can run from flash then.
 
-void readChunk(const uint8_t *buf, size_t len) {
-    for (size_t i = 0; i < len; ++i) {
-        printf("%02x", buf[i]);
-        if (i % 16 == 15)
-            printf("\n");
-        else
-            printf(" ");
+static_assert(MEMORY_SECTORS >= 2, "the store needs a sector to move values into");
+static_assert(NUM_MEMORY_KEYS * (8 + MEMORY_MAX_VALUE) + 8 <= FLASH_SECTOR_SIZE, "every value must fit in one sector");
+
+#define SECTOR_HEADER_BYTES 8
+#define RECORD_HEADER_BYTES 8
+#define ERASED_KEY 0xFFFF
+#define NO_RECORD 0xFFFFFFFF
+
+struct TSectorHeader {
+    uint32_t magic;
+    uint32_t sequence;
+};
+
+struct TRecordHeader {
+    uint32_t crc;               // Of key, length and value
+    uint16_t key;
+    uint16_t length;
+};
+
+static int active_sector = -1;
+static uint32_t active_sequence = 0;
+static uint32_t write_pos;                          // In the active sector
+static uint32_t latest[NUM_MEMORY_KEYS];            // Offset in the store of each key's newest record
+
+static critical_section_t staging_lock;
+static uint8_t staging[MEMORY_STAGING_BYTES];       // Records waiting to be written, CRCs not filled in
+static uint32_t staged_bytes = 0;
+static absolute_time_t first_staged;
+
+static bool locked_out;
+
+static const uint8_t *flash_at(uint32_t offset) {
+    return (const uint8_t *)(XIP_BASE + MEMORY_OFFSET + offset);
+}
+
+static uint32_t record_size(uint32_t length) {
+    return RECORD_HEADER_BYTES + ((length + 3) & ~3u);
+}
+
+static uint32_t scan_sector(int sector, bool *torn) {
+    // Indexes the records in a sector, returning where the next one would go
+    uint32_t base = sector * FLASH_SECTOR_SIZE;
+    uint32_t pos = SECTOR_HEADER_BYTES;
+
+    while (pos + RECORD_HEADER_BYTES <= FLASH_SECTOR_SIZE) {
+        struct TRecordHeader header;
+        memcpy(&header, flash_at(base + pos), sizeof(header));
+
+        if (header.key == ERASED_KEY) {
+            break;
+        }
+
+        uint32_t size = record_size(header.length);
+        if ((header.key >= NUM_MEMORY_KEYS) || (header.length > MEMORY_MAX_VALUE) || (pos + size > FLASH_SECTOR_SIZE) ||
+            (header.crc != crc32(flash_at(base + pos + 4), 4 + header.length))) {
+            *torn = true;
+            break;
+        }
+
+        latest[header.key] = base + pos;
+        pos += size;
+    }
+    return pos;
+}
+
+void memory_init() {
+    // Finds the newest record of every key - call once at boot
+    critical_section_init(&staging_lock);
+
+    for (int key = 0; key < NUM_MEMORY_KEYS; key++) {
+        latest[key] = NO_RECORD;
+    }
+    active_sector = -1;
+    active_sequence = 0;
+
+    // Sectors in the order they were written
+    int order[MEMORY_SECTORS];
+    uint32_t sequences[MEMORY_SECTORS];
+    int count = 0;
+
+    for (int sector = 0; sector < MEMORY_SECTORS; sector++) {
+        struct TSectorHeader header;
+        memcpy(&header, flash_at(sector * FLASH_SECTOR_SIZE), sizeof(header));
+
+        if ((header.magic != MEMORY_MAGIC) || (header.sequence == 0xFFFFFFFF)) {
+            continue;
+        }
+
+        int i = count++;
+        while ((i > 0) && (sequences[i - 1] > header.sequence)) {
+            order[i] = order[i - 1];
+            sequences[i] = sequences[i - 1];
+            i--;
+        }
+        order[i] = sector;
+        sequences[i] = header.sequence;
+    }
+
+    for (int i = 0; i < count; i++) {
+        bool torn = false;
+        uint32_t pos = scan_sector(order[i], &torn);
+
+        active_sector = order[i];
+        active_sequence = sequences[i];
+        // Nothing more is written after a damaged record - the next write starts a new sector
+        write_pos = torn ? FLASH_SECTOR_SIZE : pos;
+    }
+
+    LOG_INFO("> Memory: %d of %d sectors in use\n", count, MEMORY_SECTORS);
+}
+
+static void program_bytes(uint32_t offset, const uint8_t *data, uint32_t len) {
+    // Flash is programmed in whole pages; the parts of each page outside the new bytes are written back unchanged
+    static uint8_t page[FLASH_PAGE_SIZE];
+    uint32_t end = offset + len;
+
+    for (uint32_t start = offset & ~(FLASH_PAGE_SIZE - 1); start < end; start += FLASH_PAGE_SIZE) {
+        memcpy(page, flash_at(start), FLASH_PAGE_SIZE);
+        for (uint32_t i = (start > offset) ? start : offset; (i < end) && (i < start + FLASH_PAGE_SIZE); i++) {
+            page[i - start] = data[i - offset];
+        }
+        flash_range_program(MEMORY_OFFSET + start, page, FLASH_PAGE_SIZE);
+    }
+}
+
+static void append(TMemoryKey key, const uint8_t *value, uint32_t length);
+
+static void open_next_sector() {
+    int sector = (active_sector + 1) % MEMORY_SECTORS;
+    uint32_t base = sector * FLASH_SECTOR_SIZE;
+
+    flash_range_erase(MEMORY_OFFSET + base, FLASH_SECTOR_SIZE);
+    for (int key = 0; key < NUM_MEMORY_KEYS; key++) {
+        if ((latest[key] != NO_RECORD) && (latest[key] / FLASH_SECTOR_SIZE == (uint32_t)sector)) {
+            latest[key] = NO_RECORD;
+        }
+    }
+
+    struct TSectorHeader header = {MEMORY_MAGIC, ++active_sequence};
+    program_bytes(base, (const uint8_t *)&header, sizeof(header));
+    active_sector = sector;
+    write_pos = SECTOR_HEADER_BYTES;
+
+    // Move the live values out of the sector that will be erased next
+    int next = (sector + 1) % MEMORY_SECTORS;
+    for (int key = 0; key < NUM_MEMORY_KEYS; key++) {
+        if ((latest[key] != NO_RECORD) && (latest[key] / FLASH_SECTOR_SIZE == (uint32_t)next)) {
+            struct TRecordHeader old;
+            memcpy(&old, flash_at(latest[key]), sizeof(old));
+            append((TMemoryKey)key, flash_at(latest[key] + RECORD_HEADER_BYTES), old.length);
+        }
+    }
+}
+
+static void append(TMemoryKey key, const uint8_t *value, uint32_t length) {
+    static uint8_t record[RECORD_HEADER_BYTES + MEMORY_MAX_VALUE + 3];
+    uint32_t size = record_size(length);
+
+    if ((active_sector < 0) || (write_pos + size > FLASH_SECTOR_SIZE)) {
+        open_next_sector();
     }
+
+    struct TRecordHeader header = {0, (uint16_t)key, (uint16_t)length};
+    memset(record, 0, size);
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + RECORD_HEADER_BYTES, value, length);
+    header.crc = crc32(record + 4, 4 + length);
+    memcpy(record, &header.crc, sizeof(header.crc));
+
+    uint32_t offset = active_sector * FLASH_SECTOR_SIZE + write_pos;
+    program_bytes(offset, record, size);
+    latest[key] = offset;
+    write_pos += size;
 }
 
-void clearChunk(const uint32_t offset, size_t len) { 
-    flash_range_erase(FLASH_TARGET_OFFSET + offset * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE*len);
+static int find_staged(TMemoryKey key, uint32_t bytes) {
+    // Newest staged record of a key, or -1
+    int found = -1;
 
+    for (uint32_t pos = 0; pos < bytes; ) {
+        struct TRecordHeader header;
+        memcpy(&header, staging + pos, sizeof(header));
+        if (header.key == key) {
+            found = pos;
+        }
+        pos += record_size(header.length);
+    }
+    return found;
 }
 
-void writeChunk(const uint32_t offset, uint8_t data[], size_t len) {
-    flash_range_program(FLASH_TARGET_OFFSET + offset * FLASH_SECTOR_SIZE, data, FLASH_SECTOR_SIZE*len);
+bool memory_get(TMemoryKey key, void *value, size_t len) {
+    // True if the key has a value of exactly len bytes
+    struct TRecordHeader header;
+    bool ok = false;
+
+    critical_section_enter_blocking(&staging_lock);
+    int pos = find_staged(key, staged_bytes);
+    if (pos >= 0) {
+        memcpy(&header, staging + pos, sizeof(header));
+        if (header.length == len) {
+            memcpy(value, staging + pos + RECORD_HEADER_BYTES, len);
+            ok = true;
+        }
+        critical_section_exit(&staging_lock);
+        return ok;
+    }
+    critical_section_exit(&staging_lock);
+
+    if (latest[key] == NO_RECORD) {
+        return false;
+    }
+    memcpy(&header, flash_at(latest[key]), sizeof(header));
+    if (header.length != len) {
+        return false;
+    }
+    memcpy(value, flash_at(latest[key] + RECORD_HEADER_BYTES), len);
+    return true;
 }
 
-void longToBytes(uint8_t buf[], long in) {
-    buf[0] = in;
-    buf[1] = in >> 8;
-    buf[2] = in >> 16;
-    buf[3] = in >> 24;
+bool memory_put(TMemoryKey key, const void *value, size_t len) {
+    // Stages a value to be written by the next flush; a value staged earlier for the same key is replaced
+    // False if the value is too big, or there is no room left to stage it
+    if (len > MEMORY_MAX_VALUE) {
+        return false;
+    }
+
+    critical_section_enter_blocking(&staging_lock);
+
+    int pos = find_staged(key, staged_bytes);
+    struct TRecordHeader header = {0, (uint16_t)key, (uint16_t)len};
+    bool ok = true;
+
+    if (pos >= 0) {
+        memcpy(&header, staging + pos, sizeof(header));
+    }
+
+    if ((pos >= 0) && (header.length == len)) {
+        memcpy(staging + pos + RECORD_HEADER_BYTES, value, len);
+    } else if (staged_bytes + record_size(len) <= MEMORY_STAGING_BYTES) {
+        if (staged_bytes == 0) {
+            first_staged = get_absolute_time();
+        }
+        header.length = len;
+        memset(staging + staged_bytes, 0, record_size(len));
+        memcpy(staging + staged_bytes, &header, sizeof(header));
+        memcpy(staging + staged_bytes + RECORD_HEADER_BYTES, value, len);
+        staged_bytes += record_size(len);
+    } else {
+        ok = false;
+    }
+
+    critical_section_exit(&staging_lock);
+    return ok;
 }
 
+static uint32_t begin_flash_write() {
+    // Core 1 is parked in RAM, if it is running, and interrupts are off until end_flash_write
+    locked_out = multicore_lockout_victim_is_initialized(1);
+    if (locked_out) {
+        multicore_lockout_start_blocking();
+    }
+    return save_and_disable_interrupts();
+}
+
+static void end_flash_write(uint32_t interrupts) {
+    restore_interrupts(interrupts);
+    if (locked_out) {
+        multicore_lockout_end_blocking();
+    }
+}
+
+void memory_flush() {
+    // Writes everything staged - core 0 only
+    static uint8_t pending[MEMORY_STAGING_BYTES];
+    uint32_t pending_bytes;
+
+    critical_section_enter_blocking(&staging_lock);
+    memcpy(pending, staging, staged_bytes);
+    pending_bytes = staged_bytes;
+    staged_bytes = 0;
+    critical_section_exit(&staging_lock);
+
+    if (pending_bytes == 0) {
+        return;
+    }
+
+    uint32_t start = time_us_32();
+    uint32_t interrupts = begin_flash_write();
+
+    for (uint32_t pos = 0; pos < pending_bytes; ) {
+        struct TRecordHeader header;
+        memcpy(&header, pending + pos, sizeof(header));
+
+        // A key staged again with a different size has a newer record further on
+        uint32_t size = record_size(header.length);
+        uint32_t rest = pos + size;
+        bool newer = false;
+        for (uint32_t later = rest; later < pending_bytes; ) {
+            struct TRecordHeader other;
+            memcpy(&other, pending + later, sizeof(other));
+            newer |= (other.key == header.key);
+            later += record_size(other.length);
+        }
+
+        if (!newer) {
+            append((TMemoryKey)header.key, pending + pos + RECORD_HEADER_BYTES, header.length);
+        }
+        pos = rest;
+    }
+
+    end_flash_write(interrupts);
+
+    LOG_DEBUG("> (0) Memory: %lu bytes written in %lu us, sector %d\n", (unsigned long)pending_bytes,
+              (unsigned long)(time_us_32() - start), active_sector);
+}
+
+void memory_service() {
+    // Flushes once the oldest staged value has waited MEMORY_FLUSH_MS - core 0 only
+    bool due;
+
+    critical_section_enter_blocking(&staging_lock);
+    due = (staged_bytes > 0) && (absolute_time_diff_us(first_staged, get_absolute_time()) >= MEMORY_FLUSH_MS * 1000LL);
+    critical_section_exit(&staging_lock);
+
+    if (due) {
+        memory_flush();
+    }
+}
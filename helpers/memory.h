@@ -1,14 +1,43 @@
 #ifndef MEM_INCLUDED
 #define MEM_INCLUDED
 
+#include <stdint.h>
+#include <stddef.h>
+#include "hardware/flash.h"
 
-//Memory
-static uint32_t FLASH_TARGET_OFFSET = 262144;
-static uint8_t *flash_target_contents = (uint8_t *) (XIP_BASE + 262144);
+// Key-value store in the last MEMORY_SECTORS sectors of flash
+// Values are appended to a log that goes round the sectors in turn, so every sector is erased equally often.
+// Writes are collected in RAM and programmed together by memory_service(), at most every MEMORY_FLUSH_MS.
+#define MEMORY_SECTORS 8
+#define MEMORY_OFFSET (PICO_FLASH_SIZE_BYTES - MEMORY_SECTORS * FLASH_SECTOR_SIZE)
+#define MEMORY_MAGIC 0x4D454D31         // "MEM1"
+#define MEMORY_MAX_VALUE 1024           // Every key's latest value must fit in one sector together
+#define MEMORY_STAGING_BYTES 2048
+#define MEMORY_FLUSH_MS (60 * 1000)
 
-void clearChunk(const uint32_t offset, size_t len);
-void writeChunk(const uint32_t offset, uint8_t data[], size_t len);
-void readChunk(const uint8_t *buf, size_t len);
-void longToBytes(uint8_t buf[], long in);
+typedef enum {mkConfig, mkCounters, mkFlight, NUM_MEMORY_KEYS} TMemoryKey;
 
-#endif
\ No newline at end of file
+// Kept across every reset and power cycle
+struct TMemoryCounters {
+    uint32_t Boots;
+    uint32_t WatchdogResets;
+};
+
+// The last known flight state, saved when it changes and every MEMORY_FLUSH_MS
+struct TMemoryFlight {
+    int32_t FlightMode;
+    int32_t HasCutDown;
+    int32_t MinimumAltitude;
+    int32_t MaximumAltitude;
+    float Latitude, Longitude;
+    int32_t Altitude;
+    int32_t Time;
+};
+
+void memory_init();
+bool memory_get(TMemoryKey key, void *value, size_t len);
+bool memory_put(TMemoryKey key, const void *value, size_t len);
+void memory_flush();
+void memory_service();
+
+#endif
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <math.h>
+#include "pico/stdlib.h"
+#include "pico/critical_section.h"
+#include "hardware/adc.h"
+#include "hardware/clocks.h"
+#include "hardware/pll.h"
+#include "hardware/vreg.h"
+#include "../main.h"
+#include "../misc.h"
+#include "adc_service.h"
+#include "sd.h"
+#include "power.h"
+
+// Energy accounting
+// Drivers report when their loads switch on and off, and the time each has been on is turned into
+// energy with the measured VSYS and the load's datasheet current. The total is taken off the battery
+// capacity, and the recent average power gives the endurance that goes out in the telemetry.
+// Loads are switched from both cores, so their timers are kept in a critical section.
+//
+// The power mode sets the system clock and core voltage. Energy and time are also added up per mode, so the
+// power log gives an estimate of what the low power mode is saving. Only VSYS is measured - the difference
+// between the modes comes entirely from the base currents in power.h, so it is no better than those.
+
+static const char *LOAD_NAMES[NUM_POWER_LOADS] = {"LoRaTX", "LoRaRX", "PMFan", "PMLaser", "SD"};
+static const float LOAD_CURRENTS[NUM_POWER_LOADS] = POWER_CURRENTS_MA;
+static const char *MODE_NAMES[NUM_POWER_MODES] = {"Full", "Low"};
+static const float BASE_CURRENTS[NUM_POWER_MODES] = POWER_BASE_MA;
+
+static critical_section_t power_lock;
+
+struct TLoadTimer {
+    bool on;
+    absolute_time_t on_since;
+    uint64_t on_us;             // Time on since the last update, not counting the current stretch
+};
+static struct TLoadTimer loads[NUM_POWER_LOADS];
+
+static absolute_time_t last_update;
+static float load_energy[NUM_POWER_LOADS];     // J in this telemetry interval
+static float base_energy;                       // J in this telemetry interval
+static float used_energy = 0;                   // J since power on
+static float average_power = 0;                 // W, smoothed - 0 until the first reading
+static float mode_energy[NUM_POWER_MODES];     // J since power on
+static float mode_time[NUM_POWER_MODES];       // s since power on
+static TPowerMode current_mode = pwFull;
+static int low_samples = 0;
+static bool battery_low = false;
+
+
+void power_init() {
+    // Must be called before any peripheral is set up, as it changes their clock
+    critical_section_init(&power_lock);
+    adc_gpio_init(VSYS_PIN);
+    last_update = get_absolute_time();
+
+    // clk_peri runs from clk_sys by default - move it to the USB PLL so baud rates survive clock changes
+    clock_configure(clk_peri, 0, CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB, 48 * MHZ, 48 * MHZ);
+
+    // Stop the clocks to blocks nothing uses
+    uint32_t unused0 = CLOCKS_WAKE_EN0_CLK_SYS_PIO1_BITS | CLOCKS_WAKE_EN0_CLK_SYS_PWM_BITS |
+                       CLOCKS_WAKE_EN0_CLK_SYS_RTC_BITS | CLOCKS_WAKE_EN0_CLK_RTC_RTC_BITS;
+    uint32_t unused1 = CLOCKS_WAKE_EN1_CLK_SYS_UART0_BITS | CLOCKS_WAKE_EN1_CLK_PERI_UART0_BITS;
+
+    if (!ENABLE_MUON || (MUON_MODE != MUON_MODE_PULSE)) {
+        unused0 |= CLOCKS_WAKE_EN0_CLK_SYS_PIO0_BITS;
+    }
+    clocks_hw->wake_en0 &= ~unused0;
+    clocks_hw->wake_en1 &= ~unused1;
+    clocks_hw->sleep_en0 &= ~unused0;
+    clocks_hw->sleep_en1 &= ~unused1;
+    clock_stop(clk_rtc);
+}
+
+TPowerMode power_select_mode(struct STATE *state) {
+    // Full power while the flight is changing - low on the ground, at float and when the battery is low
+    if (state->LowBattery) {
+        return pwLow;
+    }
+
+    switch (state->FlightMode) {
+        case fmIdle:
+        case fmLanded:
+            return pwLow;
+        case fmLaunched:
+            if ((state->Altitude > LOW_POWER_ALTITUDE) && (fabsf(state->AscentRate) < POWER_FLOAT_RATE)) {
+                return pwLow;
+            }
+            return pwFull;
+        default:
+            return pwFull;
+    }
+}
+
+TPowerMode power_mode() {
+    return current_mode;
+}
+
+void power_set_mode(TPowerMode mode) {
+    // Change the system clock and core voltage - core 0 only
+    if (mode == current_mode) {
+        return;
+    }
+
+    if (mode == pwLow) {
+        // Slow down before dropping the voltage
+        clock_configure(clk_sys, CLOCKS_CLK_SYS_CTRL_SRC_VALUE_CLKSRC_CLK_SYS_AUX, CLOCKS_CLK_SYS_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB,
+                        48 * MHZ, POWER_LOW_KHZ * KHZ);
+        pll_deinit(pll_sys);
+        vreg_set_voltage(POWER_LOW_VREG);
+    } else {
+        // Raise the voltage before speeding up
+        uint vco, postdiv1, postdiv2;
+        check_sys_clock_khz(POWER_FULL_KHZ, &vco, &postdiv1, &postdiv2);
+
+        vreg_set_voltage(VREG_VOLTAGE_DEFAULT);
+        busy_wait_us(POWER_VREG_SETTLE_US);
+        pll_init(pll_sys, 1, vco, postdiv1, postdiv2);
+        clock_configure(clk_sys, CLOCKS_CLK_SYS_CTRL_SRC_VALUE_CLKSRC_CLK_SYS_AUX, CLOCKS_CLK_SYS_CTRL_AUXSRC_VALUE_CLKSRC_PLL_SYS,
+                        POWER_FULL_KHZ * KHZ, POWER_FULL_KHZ * KHZ);
+    }
+
+    current_mode = mode;
+    LOG_INFO("> %s power mode, clk_sys %lu kHz\n", MODE_NAMES[mode], (unsigned long)(clock_get_hz(clk_sys) / KHZ));
+}
+
+void power_idle(absolute_time_t until) {
+    // Sleep the calling core until its next deadline - the core stops in WFE until the timer wakes it
+    // Dormant would also stop the timer, USB and the ADC DMA, so is no use while flying
+    if (absolute_time_diff_us(get_absolute_time(), until) > 0) {
+        sleep_until(until);
+    }
+}
+
+void power_load(TPowerLoad load, bool on) {
+    // Called by the drivers whenever a load changes state
+    critical_section_enter_blocking(&power_lock);
+    struct TLoadTimer *timer = &loads[load];
+
+    if (on && !timer->on) {
+        timer->on_since = get_absolute_time();
+    } else if (!on && timer->on) {
+        timer->on_us += absolute_time_diff_us(timer->on_since, get_absolute_time());
+    }
+    timer->on = on;
+    critical_section_exit(&power_lock);
+}
+
+static uint64_t take_on_time(TPowerLoad load, absolute_time_t now) {
+    // Time the load has been on since the last call
+    critical_section_enter_blocking(&power_lock);
+    struct TLoadTimer *timer = &loads[load];
+    uint64_t on_us = timer->on_us;
+
+    if (timer->on) {
+        on_us += absolute_time_diff_us(timer->on_since, now);
+        timer->on_since = now;
+    }
+    timer->on_us = 0;
+    critical_section_exit(&power_lock);
+
+    return on_us;
+}
+
+bool power_update(struct STATE *state) {
+    // Measure VSYS and add up the energy used since the last update - called with mtx held
+    // True when the battery has just gone low
+    absolute_time_t now = get_absolute_time();
+    float dt = absolute_time_diff_us(last_update, now) / 1000000.0f;
+    last_update = now;
+
+    float vsys = adc_service_voltage(VSYS_ADC_CHANNEL) * VSYS_DIVIDER;
+    state->BatteryVoltage = vsys;
+    stats_sample(state, stBatteryVoltage, vsys);
+
+    float energy = vsys * BASE_CURRENTS[current_mode] / 1000 * dt;
+    base_energy += energy;
+
+    for (int i = 0; i < NUM_POWER_LOADS; i++) {
+        float load = vsys * LOAD_CURRENTS[i] / 1000 * take_on_time((TPowerLoad)i, now) / 1000000.0f;
+        load_energy[i] += load;
+        energy += load;
+    }
+
+    used_energy += energy;
+    mode_energy[current_mode] += energy;
+    mode_time[current_mode] += dt;
+    if (dt > 0) {
+        // The first reading seeds the average, or the endurance would start out many times too long
+        if (average_power > 0) {
+            average_power += (energy / dt - average_power) * 0.01f;
+        } else {
+            average_power = energy / dt;
+        }
+    }
+
+    float remaining = POWER_BATTERY_WH - used_energy / 3600;
+    if (remaining < 0) {
+        remaining = 0;
+    }
+    state->BatteryRemaining = remaining / POWER_BATTERY_WH;
+    state->Endurance = (average_power > 0) ? remaining / average_power : 0;
+
+    if ((vsys < POWER_LOW_VOLTAGE) || (state->BatteryRemaining < POWER_LOW_RESERVE)) {
+        low_samples++;
+    } else {
+        low_samples = 0;
+    }
+
+    if (!battery_low && (low_samples >= POWER_LOW_SAMPLES)) {
+        battery_low = true;
+        state->LowBattery = true;
+        return true;
+    }
+    return false;
+}
+
+void power_end_interval(struct STATE *state) {
+    // Log the energy used by each load over the telemetry interval - called with mtx held
+    char log_string[320];
+    char *pos = log_string;
+
+    pos += sprintf(pos, "%02d:%02d:%02d,%.3f,Base,%.2f", state->Hours, state->Minutes, state->Seconds,
+                   state->BatteryVoltage, base_energy);
+    for (int i = 0; i < NUM_POWER_LOADS; i++) {
+        pos += sprintf(pos, ",%s,%.2f", LOAD_NAMES[i], load_energy[i]);
+        load_energy[i] = 0;
+    }
+    pos += sprintf(pos, ",%.3f,%.1f", used_energy / 3600, state->Endurance);
+
+    // Estimated average power in each mode since power on, labelled as such - see POWER_BASE_MA
+    for (int i = 0; i < NUM_POWER_MODES; i++) {
+        pos += sprintf(pos, ",%sEst,%.0f,%.3f", MODE_NAMES[i], mode_time[i], mode_time[i] > 0 ? mode_energy[i] / mode_time[i] : 0);
+    }
+    sprintf(pos, "\n");
+    base_energy = 0;
+
+    char filename[20];
+    sprintf(filename, "power_log%d.txt", sd_log_file(slPower, 1));
+    logStringToSD(log_string, filename);
+}
+
+float power_used_energy() {
+    // J since power on, for the warm restart - called with mtx held
+    return used_energy;
+}
+
+void power_resume(float energy, bool low) {
+    // Carries the energy budget and the low battery latch on over a watchdog reset - before the first power_update
+    used_energy = energy;
+    battery_low = low;
+}
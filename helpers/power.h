@@ -0,0 +1,53 @@
+#ifndef POWER_INCLUDED
+#define POWER_INCLUDED
+
+#include <stdint.h>
+#include "pico/time.h"
+
+// VSYS is divided by 3 onto ADC3 (GPIO29) on the Pico
+#define VSYS_PIN 29
+#define VSYS_ADC_CHANNEL 3
+#define VSYS_DIVIDER 3.0f
+
+// Battery - usable energy when full, and the point below which the low battery policy kicks in
+#define POWER_BATTERY_WH 36.0f
+#define POWER_LOW_VOLTAGE 3.4f
+#define POWER_LOW_RESERVE 0.1f          // Fraction of the battery left
+#define POWER_LOW_SAMPLES 10            // Consecutive low readings needed, so a TX dip does not trigger it
+#define POWER_INTERVAL_MS 1000
+
+// Loads that are switched on and off - current drawn from VSYS while on, in mA
+// These are datasheet figures, the battery voltage is measured
+typedef enum {plLoRaTX, plLoRaRX, plPMFan, plPMLaser, plSD, NUM_POWER_LOADS} TPowerLoad;
+#define POWER_CURRENTS_MA {45, 12, 110, 70, 40}
+// Always on - both cores, GPS and the I2C sensors - for each power mode
+// Estimates, not measured - the per-mode power in the power log is only as good as these until they are
+// replaced with bench figures
+#define POWER_BASE_MA {60, 32}
+
+// Power modes - full speed while the flight is changing, slowed down on the ground and at float
+// clk_peri, clk_adc and clk_usb run from the 48 MHz USB PLL and the timer from the crystal, so none of
+// them - nor the UART and SPI baud rates or the repeaters - move when clk_sys is changed. I2C is clocked from
+// clk_sys, so its baud rate has to be set again after every change, as does the muon PIO's divider.
+typedef enum {pwFull, pwLow, NUM_POWER_MODES} TPowerMode;
+#define POWER_FULL_KHZ 125000
+#define POWER_LOW_KHZ 48000             // Straight from the USB PLL, so the system PLL can be stopped
+#define POWER_LOW_VREG VREG_VOLTAGE_1_00
+#define POWER_VREG_SETTLE_US 1000
+// Launched, above LOW_POWER_ALTITUDE, and going up or down slower than this is float
+#define POWER_FLOAT_RATE 1.0f
+// Minimum time in a mode, so a balloon bobbing around at float does not keep switching
+#define POWER_MODE_HOLD_MS (60 * 1000)
+
+void power_init();
+TPowerMode power_select_mode(struct STATE *state);
+TPowerMode power_mode();
+void power_set_mode(TPowerMode mode);
+void power_idle(absolute_time_t until);
+void power_load(TPowerLoad load, bool on);
+bool power_update(struct STATE *state);
+void power_end_interval(struct STATE *state);
+float power_used_energy();
+void power_resume(float used_energy, bool battery_low);
+
+#endif
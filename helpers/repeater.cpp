@@ -1,23 +1,67 @@
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
 #include <cinttypes>
 #include "repeater.h"
 #include "pico/time.h"
+#include "../main.h"
+#include "sd.h"
 
-Repeater::Repeater(uint64_t delay) {
+// Task statistics
+// Named repeaters are registered as tasks. When one fires, how late it is goes in its jitter histogram,
+// and when the task calls done() the time since it fired goes in its execution histogram.
+// Each repeater is only used from one core, so the statistics are updated without any locking.
+
+static Repeater *tasks[REPEATER_MAX_TASKS];
+static int num_tasks = 0;
+
+
+Repeater::Repeater(uint64_t delay, const char *name) {
     active = true;
+    running = false;
+    requested_delay = 0;
     delay_times = {delay*1000};
     delay_index = delay_times.begin();
     current_time = get_absolute_time();
     next_fire = get_absolute_time();
+    period = delay*1000;
+    this->name = name;
+    memset(&stats, 0, sizeof(stats));
+
+    if (name && (num_tasks < REPEATER_MAX_TASKS)) {
+        tasks[num_tasks++] = this;
+    }
+}
+
+static void add_to_histogram(uint32_t *histogram, uint32_t us) {
+    int bin = us ? 31 - __builtin_clz(us) : 0;
+    histogram[bin < REPEATER_HIST_BINS ? bin : REPEATER_HIST_BINS - 1]++;
 }
 
 bool Repeater::can_fire() {
     if (!active) {
         return false;
     }
+    if (requested_delay) {
+        set_delay(requested_delay);
+        requested_delay = 0;
+    }
     current_time = get_absolute_time();
     int64_t diff = absolute_time_diff_us(current_time, next_fire);
     if (diff < 0) {
+        // The first release is the end of boot, so is not counted
+        if (name && (stats.runs++ > 0)) {
+            uint32_t late = -diff;
+            add_to_histogram(stats.jitter, late);
+            if (late > stats.jitter_max) {
+                stats.jitter_max = late;
+            }
+            if (late > period) {
+                stats.misses++;
+            }
+        }
+        running = true;
+
         if (delay_index == --delay_times.end()) {
             delay_index = delay_times.begin();
         } else {
@@ -26,6 +70,7 @@ bool Repeater::can_fire() {
         uint64_t delay = *delay_index;
         //printf("delay: %" PRIu64 "\n", delay);
         next_fire = delayed_by_us(current_time, delay);
+        period = delay;
         return true;
     } else {
         return false;
@@ -44,7 +89,111 @@ void Repeater::clear() {
     delay_times.clear();
 }
 
+void Repeater::set_delay(uint64_t delay) {
+    // Replace the delay sequence with a single delay, starting from the next firing
+    delay_times = {delay*1000};
+    delay_index = delay_times.begin();
+}
+
+void Repeater::request_delay(uint32_t delay) {
+    // As set_delay, but safe from the other core - the owner picks it up the next time it checks the repeater
+    requested_delay = delay;
+}
+
 std::list<uint64_t>* Repeater::queue() {
     return &delay_times;
 }
 
+
+void Repeater::done() {
+    // Called by a task when it has finished the work it was released for
+    if (!running || !name) {
+        return;
+    }
+    running = false;
+
+    uint32_t exec = absolute_time_diff_us(current_time, get_absolute_time());
+    add_to_histogram(stats.exec, exec);
+    if (exec > stats.exec_max) {
+        stats.exec_max = exec;
+    }
+    if (exec > period) {
+        stats.misses++;
+    }
+}
+
+int repeater_task_count() {
+    return num_tasks;
+}
+
+Repeater *repeater_task(int index) {
+    return tasks[index];
+}
+
+Repeater *repeater_find(const char *name) {
+    for (int i = 0; i < num_tasks; i++) {
+        if (strcasecmp(tasks[i]->name, name) == 0) {
+            return tasks[i];
+        }
+    }
+    return NULL;
+}
+
+int repeater_health_string(char *buffer, int len) {
+    // Misses, worst jitter and worst execution time (ms) of every task, e.g. "GPS:0/3/1,LoRa:0/12/140"
+    int count = 0;
+    buffer[0] = '\0';
+
+    for (int i = 0; i < num_tasks; i++) {
+        struct TTaskStats *stats = &tasks[i]->stats;
+
+        // Tasks of disabled modules never run
+        if (stats->runs == 0) {
+            continue;
+        }
+
+        int length = snprintf(buffer + count, len - count, count ? ",%s:%lu/%lu/%lu" : "%s:%lu/%lu/%lu", tasks[i]->name,
+                              (unsigned long)stats->misses, (unsigned long)(stats->jitter_max / 1000), (unsigned long)(stats->exec_max / 1000));
+        if (count + length >= len) {
+            // Out of room - leave off the tasks that did not fit
+            buffer[count] = '\0';
+            break;
+        }
+        count += length;
+    }
+    return count;
+}
+
+void repeater_log_health(struct STATE *state) {
+    // One line per task with its counts and both histograms, to health_log[X].txt
+    static char log_string[2048];
+    char *pos = log_string;
+    char filename[20];
+
+    sprintf(filename, "health_log%d.txt", sd_log_file(slHealth, num_tasks));
+
+    for (int i = 0; i < num_tasks; i++) {
+        struct TTaskStats *stats = &tasks[i]->stats;
+
+        // Longest line is about 300 characters
+        if (pos - log_string > (int)sizeof(log_string) - 320) {
+            logStringToSD(log_string, filename);
+            pos = log_string;
+        }
+
+        pos += sprintf(pos, "%02d:%02d:%02d,%s,%lu,%lu,%lu,%lu", state->Hours, state->Minutes, state->Seconds, tasks[i]->name,
+                       (unsigned long)stats->runs, (unsigned long)stats->misses,
+                       (unsigned long)stats->jitter_max, (unsigned long)stats->exec_max);
+        for (int j = 0; j < REPEATER_HIST_BINS; j++) {
+            pos += sprintf(pos, ",%lu", (unsigned long)stats->jitter[j]);
+        }
+        for (int j = 0; j < REPEATER_HIST_BINS; j++) {
+            pos += sprintf(pos, ",%lu", (unsigned long)stats->exec[j]);
+        }
+        pos += sprintf(pos, "\n");
+    }
+
+    if (pos > log_string) {
+        logStringToSD(log_string, filename);
+    }
+}
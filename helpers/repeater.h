@@ -4,20 +4,43 @@
 #include "pico/time.h"
 #include <list>
 
+// Named repeaters are tasks - each keeps statistics of how late it is released and how long it runs
+#define REPEATER_MAX_TASKS 24
+// Bin i holds times of 2^i to 2^(i+1) us, the last bin everything longer
+#define REPEATER_HIST_BINS 16
+
+struct TTaskStats {
+    uint32_t runs;
+    uint32_t misses;            // Released more than a period late, or ran for longer than a period
+    uint32_t jitter_max, exec_max;      // us
+    uint32_t jitter[REPEATER_HIST_BINS];
+    uint32_t exec[REPEATER_HIST_BINS];
+};
+
 class Repeater {
     
     std::list<uint64_t> delay_times;
     std::list<uint64_t>::iterator delay_index;
     absolute_time_t current_time;
     absolute_time_t next_fire;
+    uint64_t period;            // us from the last release to the next
     bool active;
+    bool running;               // Fired, and done() not called yet
+    volatile uint32_t requested_delay;  // ms, from request_delay() - 0 for none
 
     public: 
-        Repeater(uint64_t delay);
+        const char *name;
+        struct TTaskStats stats;
+
+        Repeater(uint64_t delay, const char *name = NULL);
         bool can_fire();
+        void done();
+        absolute_time_t next_time() {return next_fire;};
         void play();
         void pause();
         void clear();
+        void set_delay(uint64_t delay);
+        void request_delay(uint32_t delay);
         std::list<uint64_t>* queue();
         bool update_delay() {return true;};
         template <typename ... Ts> bool update_delay(uint64_t delay, Ts... ts);
@@ -31,4 +54,10 @@ bool Repeater::update_delay(uint64_t delay, Ts... delays) {
 }
 
 
+int repeater_task_count();
+Repeater *repeater_task(int index);
+Repeater *repeater_find(const char *name);
+int repeater_health_string(char *buffer, int len);
+void repeater_log_health(struct STATE *state);
+
 #endif
\ No newline at end of file
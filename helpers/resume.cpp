@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/watchdog.h"
+#include "../main.h"
+#include "../misc.h"
+#include "../lora.h"
+#include "../cutdown.h"
+#include "../sensors/pm.h"
+#include "sd.h"
+#include "power.h"
+#include "resume.h"
+
+// Two copies are kept and written in turn, so a reset part way through a save leaves the other one intact.
+// Only a reset by the watchdog timer resumes - a power cycle, the reset button or a reboot into the
+// bootloader starts afresh.
+
+static struct TResumeState __uninitialized_ram(resume_copies)[2];
+
+static struct TResumeState resumed;
+static bool have_resumed = false;
+static uint32_t sequence = 0;
+static uint32_t warm_restarts = 0;
+
+static bool valid(const struct TResumeState *r) {
+    return (r->Magic == RESUME_MAGIC) && (r->CRC == crc32((const uint8_t *)r, offsetof(struct TResumeState, CRC)));
+}
+
+bool resume_init() {
+    // Call first thing - true if there is state to carry on from. Log positions are put back straight away,
+    // before anything is written to the SD card.
+    const struct TResumeState *newest = NULL;
+
+    if (watchdog_enable_caused_reboot()) {
+        for (int i = 0; i < 2; i++) {
+            if (valid(&resume_copies[i]) && (!newest || (resume_copies[i].Sequence > newest->Sequence))) {
+                newest = &resume_copies[i];
+            }
+        }
+    }
+
+    resume_copies[0].Magic = 0;
+    resume_copies[1].Magic = 0;
+
+    if (!newest) {
+        return false;
+    }
+
+    resumed = *newest;
+    have_resumed = true;
+    sequence = resumed.Sequence;
+    warm_restarts = resumed.WarmRestarts + 1;
+
+    // PM histograms are coded from the start of each file, so they carry on in a new one
+    resumed.Logs[slPMHist].file++;
+    resumed.Logs[slPMHist].lines = 0;
+    memcpy(sd_log_positions(), resumed.Logs, sizeof(resumed.Logs));
+
+    return true;
+}
+
+bool resume_fast() {
+    // Whether the slow parts of the boot can be skipped - not if the last few warm restarts did not help
+    return have_resumed && (warm_restarts <= RESUME_MAX_WARM);
+}
+
+bool resume_pm_stopped() {
+    return have_resumed && resumed.PMStopped;
+}
+
+const struct TConfig *resume_config() {
+    // The configuration to carry on with, or NULL for the full boot to load one
+    return resume_fast() ? &resumed.Config : NULL;
+}
+
+void resume_restore(struct STATE *s) {
+    // Call once the modules are initialised, before core 1 is started
+    if (!have_resumed) {
+        return;
+    }
+
+    s->FlightMode = (TFlightMode)resumed.FlightMode;
+    s->HasCutDown = resumed.HasCutDown;
+    s->MinimumAltitude = resumed.MinimumAltitude;
+    s->MaximumAltitude = resumed.MaximumAltitude;
+    s->Time = resumed.Time;
+    s->Hours = resumed.Hours;
+    s->Minutes = resumed.Minutes;
+    s->Seconds = resumed.Seconds;
+    s->Latitude = resumed.Latitude;
+    s->Longitude = resumed.Longitude;
+    s->Altitude = resumed.Altitude;
+    s->PreviousAltitude = resumed.Altitude;
+    s->LowBattery = resumed.LowBattery;
+
+    power_resume(resumed.UsedEnergy, resumed.LowBattery);
+    lora_resume_sentences(resumed.SentenceCounter);
+    resume_cutdown(resumed.CutAltitude, resumed.Burning);
+
+    LOG_INFO("> Resumed after watchdog reset %lu in a row: flight mode %ld, %scut down, %.5f, %.5f, %ld m, sentence %lu, %.2f Wh used%s\n",
+             (unsigned long)warm_restarts, (long)resumed.FlightMode, resumed.HasCutDown ? "" : "not ", resumed.Latitude,
+             resumed.Longitude, (long)resumed.Altitude, (unsigned long)resumed.SentenceCounter, resumed.UsedEnergy / 3600,
+             resumed.LowBattery ? ", battery low" : "");
+}
+
+void resume_save(struct STATE *s) {
+    // Core 0, without mtx held - static as it is too big for the stack
+    static struct TResumeState r;
+    long cut_altitude;
+
+    memset(&r, 0, sizeof(r));
+    r.Magic = RESUME_MAGIC;
+    r.Sequence = ++sequence;
+
+    if (to_ms_since_boot(get_absolute_time()) >= RESUME_STABLE_MS) {
+        warm_restarts = 0;
+    }
+    r.WarmRestarts = warm_restarts;
+
+    LOCK(&mtx);
+    r.FlightMode = s->FlightMode;
+    r.HasCutDown = s->HasCutDown;
+    r.MinimumAltitude = s->MinimumAltitude;
+    r.MaximumAltitude = s->MaximumAltitude;
+    r.Time = s->Time;
+    r.Hours = s->Hours;
+    r.Minutes = s->Minutes;
+    r.Seconds = s->Seconds;
+    r.Latitude = s->Latitude;
+    r.Longitude = s->Longitude;
+    r.Altitude = s->Altitude;
+    r.Burning = cutdown_burning(&cut_altitude);
+    r.CutAltitude = cut_altitude;
+    r.UsedEnergy = power_used_energy();
+    r.LowBattery = s->LowBattery;
+    UNLOCK(&mtx);
+
+    // Written by core 1 as it goes; a count that is one behind does no harm
+    r.SentenceCounter = lora_sentence_count();
+    r.PMStopped = config.EnablePM && isPMStopped();
+    memcpy(r.Logs, sd_log_positions(), sizeof(r.Logs));
+    r.Config = config;
+
+    r.CRC = crc32((const uint8_t *)&r, offsetof(struct TResumeState, CRC));
+    resume_copies[r.Sequence & 1] = r;
+}
@@ -0,0 +1,49 @@
+#ifndef RESUME_INCLUDED
+#define RESUME_INCLUDED
+
+#include <stdint.h>
+#include "sd.h"
+#include "config.h"
+
+// Warm restart
+// Core 0 keeps a copy of the state that has to outlive a watchdog reset in RAM that the boot does not clear.
+// After a watchdog reset it is put back and the slow parts of the boot are skipped, so the tracker carries on
+// in the same flight mode, with the same configuration, cutdown, altitude range, energy budget, sentence count
+// and log files.
+#define RESUME_MAGIC 0x524D5352             // "RSMR"
+#define RESUME_SAVE_MS 1000
+#define RESUME_MAX_WARM 3                   // Warm restarts in a row before the full boot is used again
+#define RESUME_STABLE_MS (5 * 60 * 1000)    // Running this long ends a run of warm restarts
+
+struct TResumeState {
+    uint32_t Magic;
+    uint32_t Sequence;
+    uint32_t WarmRestarts;                  // In a row
+
+    int32_t FlightMode;
+    int32_t HasCutDown;
+    int32_t Burning;
+    int32_t CutAltitude;
+    int32_t MinimumAltitude, MaximumAltitude;
+    int32_t Time;
+    int32_t Hours, Minutes, Seconds;
+    float Latitude, Longitude;
+    int32_t Altitude;
+    uint32_t SentenceCounter;
+    int32_t PMStopped;
+    float UsedEnergy;                       // J
+    int32_t LowBattery;
+    struct TSDLogPosition Logs[NUM_SD_LOGS];
+    struct TConfig Config;                  // As in use, which need not be the copy in flash
+
+    uint32_t CRC;                           // CRC-32 of everything before it
+};
+
+bool resume_init();
+bool resume_fast();
+bool resume_pm_stopped();
+const struct TConfig *resume_config();
+void resume_restore(struct STATE *s);
+void resume_save(struct STATE *s);
+
+#endif
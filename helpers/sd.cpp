@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 
 // Includes from SD card file
 #include "f_util.h"
@@ -9,37 +10,40 @@
 #include "hardware/spi.h"
 #include "../main.h"
 #include "../misc.h"
+#include "spi_bus.h"
+#include "power.h"
+#include "trace.h"
 #include "sd.h"
 
-// Select/deselect cs pin (active low)
-inline void sd_cs_select() {
-    asm volatile("nop \n nop \n nop");
-    gpio_put(CS_SD, 0);
-    asm volatile("nop \n nop \n nop");
-}
+// Written by both cores without a lock - a lost count now and then does not matter
+static struct TSDStats sd_stats_counts;
 
-inline void sd_cs_deselect() {
-    asm volatile("nop \n nop \n nop");
-    gpio_put(CS_SD, 1);
-    asm volatile("nop \n nop \n nop");
-}
+// Each log is written by one core only
+static struct TSDLogPosition sd_logs[NUM_SD_LOGS];
 
-void logStringToSD(const char * text, const char * filename) {
-    // Save a string to the sd card
+// Writes held back by sd_defer_begin(), each a TDeferredHeader followed by its data padded to 4 bytes
+struct TDeferredHeader {
+    char filename[SD_FILENAME_LENGTH];
+    uint32_t length;
+};
+static uint8_t deferred[SD_DEFER_BYTES];
+static uint32_t deferred_bytes = 0;
+static volatile int deferring_core = -1;
+
+static bool appendToSD(const void * data, UINT len, const char * filename) {
+    // Append data to a file on the sd card
 
      // See FatFs - Generic FAT Filesystem Module, "Application Interface",
     // http://elm-chan.org/fsw/ff/00index_e.html
 
-    sd_cs_select();
-
     sd_card_t *pSD = sd_get_by_num(0);
 
     FRESULT fr = f_mount(&pSD->fatfs, pSD->pcName, 1);
 
     if (FR_OK != fr) {
         // Return if mounting error
-        printf("f_mount error: %s (%d)\n", FRESULT_str(fr), fr);
-        return;
+        LOG_ERROR("f_mount error: %s (%d)\n", FRESULT_str(fr), fr);
+        return false;
     }
 
     FIL fil;
@@ -47,22 +51,170 @@ void logStringToSD(const char * text, const char * filename) {
     fr = f_open(&fil, filename, FA_OPEN_APPEND | FA_WRITE);
     if (FR_OK != fr && FR_EXIST != fr) {
         // Return if file error
-        printf("f_open(%s) error: %s (%d)\n", filename, FRESULT_str(fr), fr);
-        return;
+        LOG_ERROR("f_open(%s) error: %s (%d)\n", filename, FRESULT_str(fr), fr);
+        return false;
     }
     
-    // Actually write text
-    if (f_printf(&fil, text) < 0) {
-        printf("f_printf failed\n");
+    // Actually write data
+    UINT written;
+    bool ok = true;
+    fr = f_write(&fil, data, len, &written);
+    if ((FR_OK != fr) || (written != len)) {
+        LOG_ERROR("f_write failed\n");
+        ok = false;
     }
 
     fr = f_close(&fil);
     if (FR_OK != fr) {
-        printf("f_close error: %s (%d)\n", FRESULT_str(fr), fr);
+        LOG_ERROR("f_close error: %s (%d)\n", FRESULT_str(fr), fr);
+        ok = false;
     }
 
     f_unmount(pSD->pcName);
+    return ok;
+}
+
+static bool defer(const void * data, UINT len, const char * filename) {
+    // Keeps a write for sd_write_deferred(), or drops it if there is no room
+    struct TDeferredHeader header;
+    uint32_t size = sizeof(header) + ((len + 3) & ~3u);
+
+    if ((deferred_bytes + size > SD_DEFER_BYTES) || (strlen(filename) >= SD_FILENAME_LENGTH)) {
+        LOG_WARN("<!> SD deferred writes full, %s not logged\n", filename);
+        sd_stats_counts.skipped++;
+        return false;
+    }
+
+    memset(&header, 0, sizeof(header));
+    strcpy(header.filename, filename);
+    header.length = len;
+    memcpy(deferred + deferred_bytes, &header, sizeof(header));
+    memcpy(deferred + deferred_bytes + sizeof(header), data, len);
+    deferred_bytes += size;
+    return true;
+}
+
+static bool logToSD(const void * data, UINT len, const char * filename) {
+    // Returns whether the data was written, or kept to be written - the card draws its active current from mount to unmount
+    LOCK_SITE(site);
 
-    sd_cs_deselect();
+    if (deferring_core == (int)get_core_num()) {
+        return defer(data, len, filename);
+    }
+
+    // Another device on this core is part way through a transaction - waiting for it would never end
+    if (spi_bus_held_here()) {
+        LOG_WARN("<!> SD bus busy, %s not logged\n", filename);
+        sd_stats_counts.skipped++;
+        return false;
+    }
+
+    uint32_t start = trace_start();
+
+    lock_note_enter(spi_bus_lock(), &site);
+    power_load(plSD, true);
+    bool ok = appendToSD(data, len, filename);
+    power_load(plSD, false);
+    lock_note_exit(spi_bus_lock());
+    trace_end(trSDWrite, start, len > 0xFFFF ? 0xFFFF : len);
+
+    uint32_t duration = time_us_32() - start;
+    if (ok) {
+        sd_stats_counts.writes++;
+        sd_stats_counts.bytes += len;
+    } else {
+        sd_stats_counts.failures++;
+    }
+    if (duration > sd_stats_counts.write_max_us) {
+        sd_stats_counts.write_max_us = duration;
+    }
+    return ok;
 }
 
+bool logStringToSD(const char * text, const char * filename) {
+    // Save a string to the sd card
+    return logToSD(text, strlen(text), filename);
+}
+
+bool logBytesToSD(const uint8_t * data, size_t len, const char * filename) {
+    // Save binary data to the sd card
+    return logToSD(data, len, filename);
+}
+
+int readFileFromSD(const char * filename, char * buffer, size_t size) {
+    // Reads up to size - 1 bytes of a file and terminates them, returning the length or -1 if it could not be read
+    LOCK_SITE(site);
+
+    if (spi_bus_held_here()) {
+        return -1;
+    }
+
+    lock_note_enter(spi_bus_lock(), &site);
+    power_load(plSD, true);
+
+    sd_card_t *pSD = sd_get_by_num(0);
+    int length = -1;
+
+    if (f_mount(&pSD->fatfs, pSD->pcName, 1) == FR_OK) {
+        FIL fil;
+        if (f_open(&fil, filename, FA_READ) == FR_OK) {
+            UINT read;
+            if (f_read(&fil, buffer, size - 1, &read) == FR_OK) {
+                buffer[read] = '\0';
+                length = read;
+            }
+            f_close(&fil);
+        }
+        f_unmount(pSD->pcName);
+    }
+
+    power_load(plSD, false);
+    lock_note_exit(spi_bus_lock());
+    return length;
+}
+
+struct TSDStats *sd_stats() {
+    return &sd_stats_counts;
+}
+
+int sd_log_file(TSDLog log, int lines) {
+    // Counts lines about to be written to a log, returning the number of the file they go in
+    struct TSDLogPosition *position = &sd_logs[log];
+
+    position->lines += lines;
+    if (position->lines > SD_MAX_LINES) {
+        position->lines = 0;
+        position->file++;
+    }
+    return position->file;
+}
+
+int sd_log_new_file(TSDLog log) {
+    // For logs that start a new file every time, or have to start one early
+    sd_logs[log].lines = 0;
+    return sd_logs[log].file++;
+}
+
+struct TSDLogPosition *sd_log_positions() {
+    // All NUM_SD_LOGS of them, so they can be carried across a warm restart
+    return sd_logs;
+}
+
+void sd_defer_begin() {
+    // Until sd_write_deferred(), this core's SD writes are kept in RAM - for core 1 while it holds mtx, so it never
+    // waits for spi0 with the state locked, and core 0 is not kept off the state for the length of a card write
+    deferring_core = get_core_num();
+}
+
+void sd_write_deferred() {
+    // Writes everything kept since sd_defer_begin() - call without mtx held
+    deferring_core = -1;
+
+    for (uint32_t pos = 0; pos < deferred_bytes; ) {
+        struct TDeferredHeader header;
+        memcpy(&header, deferred + pos, sizeof(header));
+        logToSD(deferred + pos + sizeof(header), header.length, header.filename);
+        pos += sizeof(header) + ((header.length + 3) & ~3u);
+    }
+    deferred_bytes = 0;
+}
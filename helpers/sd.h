@@ -1,6 +1,39 @@
 #ifndef SD_INCLUDED
 #define SD_INCLUDED
 
-void logStringToSD(const char * text, const char * filename);
+#include <stdint.h>
+#include <stddef.h>
+
+// SD writes made while core 1 holds mtx are kept until it lets go
+#define SD_DEFER_BYTES 6144
+#define SD_FILENAME_LENGTH 24
+
+// Logs that are split into numbered files of SD_MAX_LINES lines each, e.g. lora_log3.txt
+typedef enum {slLoRa, slPower, slHealth, slLock, slStats, slPM, slPMHist, slMuon, slTrace, NUM_SD_LOGS} TSDLog;
+
+struct TSDLogPosition {
+    int32_t file;
+    int32_t lines;              // Lines in the current file
+};
+
+struct TSDStats {
+    uint32_t writes;
+    uint32_t failures;          // Mount, open, write or close failed
+    uint32_t skipped;           // The bus was held by this core, or no room to defer the write
+    uint32_t bytes;
+    uint32_t write_max_us;      // Mount to unmount
+};
+
+// Both return false if the data was not written - true for a deferred write only means it was kept, and a failure
+// when it is written later shows up in sd_stats()
+bool logStringToSD(const char * text, const char * filename);
+bool logBytesToSD(const uint8_t * data, size_t len, const char * filename);
+int readFileFromSD(const char * filename, char * buffer, size_t size);
+struct TSDStats *sd_stats();
+int sd_log_file(TSDLog log, int lines);
+int sd_log_new_file(TSDLog log);
+struct TSDLogPosition *sd_log_positions();
+void sd_defer_begin();
+void sd_write_deferred();
 
 #endif
\ No newline at end of file
@@ -41,7 +41,7 @@ static spi_t spis[] = {  // One for each SPI.
         .mosi_gpio = 19,
         .sck_gpio = 18,
         
-        .baud_rate = 500000,
+        .baud_rate = 12500 * 1000,  // Shared with the OPC, which gets its own clock from the spi0 arbiter
         .dma_isr = spi0_dma_isr
     }
 };
@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/i2c.h"
+#include "../main.h"
+#include "../misc.h"
+#include "i2c_bus.h"
+#include "sensor.h"
+
+// Addresses of every device we know about, used for the boot scan
+static const struct {
+    uint8_t address;
+    const char *name;
+} KNOWN_DEVICES[] = {
+    {0x38, "AHT20"},
+    {0x48, "TMP117/ADS1115"},
+    {0x76, "BME280"},
+    {0x77, "BME280"}
+};
+#define NUM_KNOWN_DEVICES (sizeof(KNOWN_DEVICES) / sizeof(KNOWN_DEVICES[0]))
+
+static SensorDriver *sensors[MAX_SENSORS];
+static int num_sensors = 0;
+
+// Sensors that were found - the only ones scheduled by the main loop
+static SensorDriver *active[MAX_SENSORS];
+static int num_active = 0;
+
+static Repeater maintain_repeater(1000, "SensorMaintain");
+static TSensorPhase current_phase = spIdle;
+static absolute_time_t next_rescan;
+static volatile bool rescan_requested = false;
+
+SensorDriver::SensorDriver(const char *name, const uint8_t *addresses, int num_addresses, uint64_t period) : repeater(period, name) {
+    this->name = name;
+    this->addresses = addresses;
+    this->num_addresses = num_addresses;
+    i2c = NULL;
+    address = 0;
+    health = shAbsent;
+    reads = 0;
+    errors = 0;
+    consecutive_failures = 0;
+    backoff_ms = SENSOR_MIN_BACKOFF_MS;
+    retry_time = get_absolute_time();
+    pending = false;
+    collect_time = get_absolute_time();
+}
+
+void SensorDriver::collect_after_ms(uint32_t ms) {
+    pending = true;
+    collect_time = make_timeout_time_ms(ms);
+}
+
+bool SensorDriver::uses_address(uint8_t address) {
+    for (int i = 0; i < num_addresses; i++) {
+        if (addresses[i] == address) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SensorDriver::write(const uint8_t *data, size_t len, bool nostop) {
+    if (i2c_bus_write(i2c, address, data, len, nostop) != (int)len) {
+        errors++;
+        return false;
+    }
+    return true;
+}
+
+bool SensorDriver::read(uint8_t *data, size_t len) {
+    if (i2c_bus_read(i2c, address, data, len, false) != (int)len) {
+        errors++;
+        return false;
+    }
+    return true;
+}
+
+bool SensorDriver::write_register(uint8_t reg, uint8_t data) {
+    uint8_t buffer[2] = {reg, data};
+    return write(buffer, 2);
+}
+
+bool SensorDriver::read_registers(uint8_t reg, uint8_t *data, size_t len) {
+    // true to keep master control of bus
+    return write(&reg, 1, true) && read(data, len);
+}
+
+void sensor_register(SensorDriver *sensor) {
+    if (num_sensors < MAX_SENSORS) {
+        sensors[num_sensors++] = sensor;
+    }
+}
+
+static bool device_present(i2c_inst_t *i2c, uint8_t address) {
+    uint8_t rxdata;
+    return i2c_bus_read(i2c, address, &rxdata, 1, false) > 0;
+}
+
+static bool address_claimed(i2c_inst_t *i2c, uint8_t address) {
+    for (int i = 0; i < num_active; i++) {
+        if ((active[i]->i2c == i2c) && (active[i]->address == address)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void attach_sensors(i2c_inst_t *i2c, int bus, uint8_t address) {
+    // Offer a device that answered to every driver that is still looking for one
+    for (int i = 0; i < num_sensors; i++) {
+        SensorDriver *sensor = sensors[i];
+
+        if ((sensor->health != shAbsent) || !sensor->uses_address(address) || address_claimed(i2c, address)) {
+            continue;
+        }
+
+        sensor->i2c = i2c;
+        sensor->address = address;
+
+        if (sensor->probe() && sensor->start() && sensor->configure(current_phase)) {
+            LOG_INFO("> %s found on I2C %d at 0x%02x\n", sensor->name, bus, address);
+            sensor->health = shOK;
+            active[num_active++] = sensor;
+        } else {
+            sensor->i2c = NULL;
+            sensor->address = 0;
+        }
+    }
+}
+
+static void scan_buses(bool verbose) {
+    i2c_inst_t *buses[] = {I2C_PORT_0, I2C_PORT_1};
+
+    for (int bus = 0; bus < 2; bus++) {
+        for (unsigned int i = 0; i < NUM_KNOWN_DEVICES; i++) {
+            uint8_t address = KNOWN_DEVICES[i].address;
+
+            if (address_claimed(buses[bus], address) || !device_present(buses[bus], address)) {
+                continue;
+            }
+
+            if (verbose) {
+                LOG_INFO("> I2C %d: device at 0x%02x (%s)\n", bus, address, KNOWN_DEVICES[i].name);
+            }
+            attach_sensors(buses[bus], bus, address);
+        }
+    }
+}
+
+void sensor_probe_all() {
+    // Scan both buses for the devices we know about and start their drivers
+    scan_buses(true);
+
+    for (int i = 0; i < num_sensors; i++) {
+        if (sensors[i]->health == shAbsent) {
+            LOG_INFO("> %s not found - not scheduled\n", sensors[i]->name);
+        }
+    }
+
+    next_rescan = make_timeout_time_ms(SENSOR_RESCAN_MS);
+}
+
+static void deactivate(SensorDriver *sensor) {
+    for (int i = 0; i < num_active; i++) {
+        if (active[i] == sensor) {
+            active[i] = active[--num_active];
+            return;
+        }
+    }
+}
+
+bool sensor_due(SensorDriver *sensor) {
+    // A reading in progress is collected when ready, otherwise a new one is started on the sensor's schedule
+    if (sensor->pending) {
+        return time_reached(sensor->collect_time);
+    }
+    return sensor->repeater.can_fire();
+}
+
+bool sensor_poll(SensorDriver *sensor) {
+    // Takes or collects a reading, and takes the sensor off the schedule if it keeps failing
+    // True when there is a new reading to publish
+    sensor->pending = false;
+
+    TPollResult result = sensor->poll();
+    sensor->repeater.done();
+
+    if (result == prPending) {
+        return false;
+    }
+
+    if (result == prDone) {
+        sensor->reads++;
+        sensor->consecutive_failures = 0;
+        sensor->backoff_ms = SENSOR_MIN_BACKOFF_MS;
+        return true;
+    }
+
+    if (++sensor->consecutive_failures >= SENSOR_MAX_FAILURES) {
+        LOG_WARN("<!> %s failing - retrying in %lu ms\n", sensor->name, (unsigned long)sensor->backoff_ms);
+        sensor->health = shFailing;
+        sensor->retry_time = make_timeout_time_ms(sensor->backoff_ms);
+        deactivate(sensor);
+    }
+    return false;
+}
+
+void sensor_maintain() {
+    // Re-probes failing sensors once their backoff has expired, and looks for missing ones
+    if (!maintain_repeater.can_fire()) {
+        return;
+    }
+
+    if (rescan_requested) {
+        rescan_requested = false;
+        next_rescan = get_absolute_time();
+        for (int i = 0; i < num_sensors; i++) {
+            if (sensors[i]->health == shFailing) {
+                sensors[i]->retry_time = get_absolute_time();
+                sensors[i]->backoff_ms = SENSOR_MIN_BACKOFF_MS;
+            }
+        }
+    }
+
+    for (int i = 0; i < num_sensors; i++) {
+        SensorDriver *sensor = sensors[i];
+
+        if ((sensor->health != shFailing) || !time_reached(sensor->retry_time)) {
+            continue;
+        }
+
+        if (sensor->probe() && sensor->start() && sensor->configure(current_phase)) {
+            LOG_INFO("> %s recovered\n", sensor->name);
+            sensor->health = shOK;
+            sensor->consecutive_failures = 0;
+            sensor->backoff_ms = SENSOR_MIN_BACKOFF_MS;
+            active[num_active++] = sensor;
+        } else {
+            sensor->backoff_ms *= 2;
+            if (sensor->backoff_ms > SENSOR_MAX_BACKOFF_MS) {
+                sensor->backoff_ms = SENSOR_MAX_BACKOFF_MS;
+            }
+            sensor->retry_time = make_timeout_time_ms(sensor->backoff_ms);
+        }
+    }
+
+    if (time_reached(next_rescan)) {
+        scan_buses(false);
+        next_rescan = make_timeout_time_ms(SENSOR_RESCAN_MS);
+    }
+
+    maintain_repeater.done();
+}
+
+void sensor_request_rescan() {
+    // From either core - failing sensors are retried and the buses scanned on the next maintenance pass
+    rescan_requested = true;
+}
+
+TSensorPhase sensor_phase(struct STATE *state) {
+    switch (state->FlightMode) {
+        case fmIdle:
+            return spIdle;
+        case fmLaunched:
+            return (state->Altitude > SENSOR_NEAR_BURST_ALTITUDE) ? spNearBurst : spAscent;
+        case fmDescending:
+        case fmLanding:
+            return spDescent;
+        default:
+            return spLanded;
+    }
+}
+
+void sensor_set_phase(TSensorPhase phase) {
+    // Reconfigures the active sensors when the flight phase changes
+    if (phase == current_phase) {
+        return;
+    }
+    current_phase = phase;
+
+    for (int i = 0; i < num_active; i++) {
+        if (!active[i]->configure(phase)) {
+            LOG_WARN("<!> %s could not be reconfigured\n", active[i]->name);
+        }
+    }
+}
+
+int sensor_errors_string(char *buffer, int len) {
+    // Error count of every registered sensor, in registration order, e.g. "0/2/0" - cut short if it does not fit
+    int count = 0;
+    buffer[0] = '\0';
+
+    for (int i = 0; (i < num_sensors) && (count < len); i++) {
+        uint32_t errors = sensors[i]->errors;
+        if (errors > SENSOR_ERRORS_SHOWN_MAX) {
+            errors = SENSOR_ERRORS_SHOWN_MAX;
+        }
+        count += snprintf(buffer + count, len - count, i ? "/%lu" : "%lu", (unsigned long)errors);
+    }
+    return (count < len) ? count : len - 1;
+}
+
+int sensor_active_count() {
+    return num_active;
+}
+
+SensorDriver *sensor_active(int index) {
+    return active[index];
+}
@@ -0,0 +1,81 @@
+#ifndef SENSOR_INCLUDED
+#define SENSOR_INCLUDED
+
+#include "hardware/i2c.h"
+#include "../main.h"
+#include "repeater.h"
+
+#define MAX_SENSORS 8
+
+// Consecutive failed polls before a sensor is taken off the schedule
+#define SENSOR_MAX_FAILURES 3
+// Failing sensors are re-probed after a backoff that doubles on each failed attempt
+#define SENSOR_MIN_BACKOFF_MS 2000
+#define SENSOR_MAX_BACKOFF_MS (5 * 60 * 1000)
+// Sensors not found at boot are looked for again this often
+#define SENSOR_RESCAN_MS (30 * 1000)
+// Above this altitude on the way up, sensors run as they would for the burst
+#define SENSOR_NEAR_BURST_ALTITUDE 20000
+// Error counts in the telemetry stop here, so MAX_SENSORS of them fit in 32 characters
+#define SENSOR_ERRORS_SHOWN_MAX 999
+
+typedef enum {shAbsent, shOK, shFailing} TSensorHealth;
+
+// Flight phases sensors can tune themselves for
+typedef enum {spIdle, spAscent, spNearBurst, spDescent, spLanded} TSensorPhase;
+
+// A poll can take a reading straight away, or start one and ask to be called back to collect it
+typedef enum {prFailed, prPending, prDone} TPollResult;
+
+// Common interface for the I2C sensors
+// Drivers list the addresses they can live at; the registry probes both buses at boot
+// and only schedules the drivers whose device was found.
+class SensorDriver {
+
+    const uint8_t *addresses;
+    int num_addresses;
+
+    protected:
+        void collect_after_ms(uint32_t ms);
+        bool write(const uint8_t *data, size_t len, bool nostop = false);
+        bool read(uint8_t *data, size_t len);
+        bool write_register(uint8_t reg, uint8_t data);
+        bool read_registers(uint8_t reg, uint8_t *data, size_t len);
+
+    public:
+        const char *name;
+        i2c_inst_t *i2c;
+        uint8_t address;
+        Repeater repeater;
+        TSensorHealth health;
+        uint32_t reads, errors;
+        int consecutive_failures;
+        uint32_t backoff_ms;
+        absolute_time_t retry_time;
+        bool pending;                   // A reading has been started and is waiting to be collected
+        absolute_time_t collect_time;
+
+        SensorDriver(const char *name, const uint8_t *addresses, int num_addresses, uint64_t period);
+        bool uses_address(uint8_t address);
+
+        virtual bool probe() = 0;                       // Check the device at i2c/address is the one we drive
+        virtual bool start() = 0;                       // Configure the device after a successful probe
+        virtual TPollResult poll() = 0;                 // Take or collect a reading
+        virtual void publish(struct STATE *s) = 0;      // Copy the latest reading into the state - called with mtx held
+        virtual bool configure(TSensorPhase phase) { return true; }    // Adjust settings and period for the flight phase
+        virtual void withdraw(struct STATE *s) {}       // Mark the reading as stale once the sensor is failing - called with mtx held
+};
+
+void sensor_register(SensorDriver *sensor);
+void sensor_probe_all();
+bool sensor_due(SensorDriver *sensor);
+bool sensor_poll(SensorDriver *sensor);
+TSensorPhase sensor_phase(struct STATE *state);
+void sensor_set_phase(TSensorPhase phase);
+void sensor_maintain();
+void sensor_request_rescan();
+int sensor_errors_string(char *buffer, int len);
+int sensor_active_count();
+SensorDriver *sensor_active(int index);
+
+#endif
@@ -0,0 +1,100 @@
+#include <stdio.h>
+
+#include "hw_config.h"
+#include "spi.h"
+
+#include "pico/stdlib.h"
+#include "hardware/spi.h"
+#include "../main.h"
+#include "../misc.h"
+#include "spi_bus.h"
+#include "trace.h"
+
+// spi0 arbiter
+// The SD driver already serialises its own use of the bus with the mutex in its spi_t, so the other
+// devices take the same mutex. Waiting for it is how transactions from the two cores queue up;
+// a driver stepped from the main loop can ask not to wait and try again next time instead.
+
+static spi_t *bus = NULL;
+static struct TProfiledMutex bus_lock;
+static uint sd_baudrate;
+static uint32_t transaction_start;      // Only touched by the holder of the bus
+
+void spi_bus_init() {
+    // Sets up spi0, its DMA channels and the SD card chip select
+    sd_init_driver();
+    bus = sd_get_by_num(0)->spi;
+    lock_init(&bus_lock, &bus->mutex, "spi0", LOCK_RANK_SPI0, TRACE_MUTEX_SPI0);
+}
+
+void spi_bus_add(const struct TSPIDevice *device) {
+    gpio_init(device->cs);
+    gpio_set_dir(device->cs, GPIO_OUT);
+    gpio_put(device->cs, 1);
+}
+
+bool spi_bus_begin(const struct TSPIDevice *device, bool wait) {
+    // Takes the bus, sets it up for this device and selects it
+    LOCK_SITE(site);
+
+    if (wait) {
+        lock_enter(&bus_lock, &site);
+    } else if (!lock_try_enter(&bus_lock, &site)) {
+        return false;
+    }
+
+    sd_baudrate = spi_get_baudrate(SPI_PORT_0);
+    spi_set_format(SPI_PORT_0, 8, device->cpol, device->cpha, SPI_MSB_FIRST);
+    spi_set_baudrate(SPI_PORT_0, device->baudrate);
+
+    asm volatile("nop \n nop \n nop");
+    gpio_put(device->cs, 0);
+    asm volatile("nop \n nop \n nop");
+
+    transaction_start = trace_start();
+    return true;
+}
+
+bool spi_bus_transfer(const struct TSPIDevice *device, const uint8_t *tx, uint8_t *rx, size_t len) {
+    // Either direction can be NULL; reads clock out 0xFF
+    if (device->dma) {
+        return spi_transfer(bus, tx, rx, len);
+    }
+
+    if (tx && rx) {
+        return spi_write_read_blocking(SPI_PORT_0, tx, rx, len) == (int)len;
+    }
+    if (tx) {
+        return spi_write_blocking(SPI_PORT_0, tx, len) == (int)len;
+    }
+    return spi_read_blocking(SPI_PORT_0, 0xFF, rx, len) == (int)len;
+}
+
+void spi_bus_end(const struct TSPIDevice *device) {
+    asm volatile("nop \n nop \n nop");
+    gpio_put(device->cs, 1);
+    asm volatile("nop \n nop \n nop");
+
+    // Back to how the SD card had it
+    spi_set_format(SPI_PORT_0, 8, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
+    spi_set_baudrate(SPI_PORT_0, sd_baudrate);
+
+    trace_end(trSPI, transaction_start, device->cs);
+    UNLOCK(&bus_lock);
+}
+
+bool spi_bus_held_here() {
+    // True if a transaction on this core is holding the bus - waiting for it from this core would never end
+    uint32_t owner;
+
+    if (mutex_try_enter(&bus->mutex, &owner)) {
+        mutex_exit(&bus->mutex);
+        return false;
+    }
+    return owner == get_core_num();
+}
+
+struct TProfiledMutex *spi_bus_lock() {
+    // For the SD driver, which takes the bus mutex itself
+    return &bus_lock;
+}
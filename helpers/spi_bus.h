@@ -0,0 +1,26 @@
+#ifndef SPI_BUS_INCLUDED
+#define SPI_BUS_INCLUDED
+
+#include "hardware/spi.h"
+
+// Everything on spi0 apart from the SD card, which FatFs drives itself
+// Each device brings its own mode and clock; they are switched in when a transaction begins and
+// the SD card's are put back when it ends, so the SD card always finds the bus as it left it.
+struct TSPIDevice {
+    const char *name;
+    uint cs;
+    spi_cpol_t cpol;
+    spi_cpha_t cpha;
+    uint baudrate;
+    bool dma;               // Use the SD driver's DMA channels for transfers
+};
+
+void spi_bus_init();
+void spi_bus_add(const struct TSPIDevice *device);
+bool spi_bus_begin(const struct TSPIDevice *device, bool wait);
+bool spi_bus_transfer(const struct TSPIDevice *device, const uint8_t *tx, uint8_t *rx, size_t len);
+void spi_bus_end(const struct TSPIDevice *device);
+bool spi_bus_held_here();
+struct TProfiledMutex *spi_bus_lock();
+
+#endif
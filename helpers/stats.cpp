@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <math.h>
+#include "pico/stdlib.h"
+#include "../main.h"
+#include "../misc.h"
+#include "sd.h"
+#include "stats.h"
+
+// Per-interval sensor statistics
+// Every sample is added to its field's accumulator, telemetry sends the interval mean,
+// and at the end of each interval either the statistics or the raw samples are logged to SD.
+// All of these are called with mtx held, as the accumulators live in the STATE.
+
+static const char *STAT_NAMES[NUM_STATS] = {
+	"BMETemp", "BMEPres", "BMEHum",
+	"TMP117Temp", "AHT20Temp", "AHT20Hum",
+	"Solar0", "Solar1", "Solar2", "NO2WE", "NO2AE",
+	"IntTemp", "VSYS"
+};
+
+// Samples waiting to be written to SD when logging at full rate
+static char sample_buffer[2048];
+static int sample_length = 0;
+static uint32_t samples_dropped = 0;
+
+static int stats_sd_file_count = 0;
+
+void stat_add(struct TStat *stat, float value) {
+	int32_t x = (int32_t)lroundf(value * STAT_SCALE);
+
+	stat->count++;
+
+	if (stat->count == 1) {
+		stat->min = x;
+		stat->max = x;
+		stat->mean = (int64_t)x << 16;
+		stat->m2 = 0;
+		return;
+	}
+
+	if (x < stat->min) stat->min = x;
+	if (x > stat->max) stat->max = x;
+
+	int64_t delta = ((int64_t)x << 16) - stat->mean;
+	stat->mean += delta / stat->count;
+	int64_t delta2 = ((int64_t)x << 16) - stat->mean;
+	stat->m2 += (delta >> 8) * (delta2 >> 8);
+}
+
+void stat_reset(struct TStat *stat) {
+	stat->count = 0;
+	stat->min = 0;
+	stat->max = 0;
+	stat->mean = 0;
+	stat->m2 = 0;
+}
+
+float stat_mean(const struct TStat *stat) {
+	return stat->mean / 65536.0f / STAT_SCALE;
+}
+
+float stat_min(const struct TStat *stat) {
+	return (float)stat->min / STAT_SCALE;
+}
+
+float stat_max(const struct TStat *stat) {
+	return (float)stat->max / STAT_SCALE;
+}
+
+float stat_stddev(const struct TStat *stat) {
+	if (stat->count < 2) {
+		return 0;
+	}
+	return sqrtf(stat->m2 / 65536.0f / (stat->count - 1)) / STAT_SCALE;
+}
+
+void stats_sample(struct STATE *state, TStatField field, float value) {
+	stat_add(&state->Stats[field], value);
+
+	if (!SD_LOG_AGGREGATED) {
+		int remaining = sizeof(sample_buffer) - sample_length;
+		int length = snprintf(sample_buffer + sample_length, remaining, "%02d:%02d:%02d,%s,%.3f\n",
+							  state->Hours, state->Minutes, state->Seconds, STAT_NAMES[field], value);
+		if (length < remaining) {
+			sample_length += length;
+		} else {
+			sample_buffer[sample_length] = '\0';
+			samples_dropped++;
+		}
+	}
+}
+
+float stats_value(struct STATE *state, TStatField field, float latest) {
+	// Value to send for a field - the interval mean if there were any samples
+	if (state->Stats[field].count == 0) {
+		return latest;
+	}
+	return stat_mean(&state->Stats[field]);
+}
+
+static void log_statistics(struct STATE *state) {
+	// One line per interval, count,min,max,mean,sd for each field
+	char log_string[1024];
+	char *pos = log_string;
+
+	pos += sprintf(pos, "%02d:%02d:%02d", state->Hours, state->Minutes, state->Seconds);
+
+	for (int i = 0; i < NUM_STATS; i++) {
+		struct TStat *stat = &state->Stats[i];
+		if (stat->count > 0) {
+			pos += sprintf(pos, ",%lu,%.3f,%.3f,%.3f,%.3f", (unsigned long)stat->count,
+						   stat_min(stat), stat_max(stat), stat_mean(stat), stat_stddev(stat));
+		} else {
+			pos += sprintf(pos, ",0,,,,");
+		}
+	}
+	sprintf(pos, "\n");
+
+	char filename[20];
+	sprintf(filename, "stats_log%d.txt", stats_sd_file_count);
+	logStringToSD(log_string, filename);
+}
+
+static void log_samples() {
+	if (sample_length == 0) {
+		return;
+	}
+
+	if (samples_dropped) {
+		LOG_WARN("<!> %lu samples dropped - SD sample buffer full\n", (unsigned long)samples_dropped);
+		samples_dropped = 0;
+	}
+
+	char filename[20];
+	sprintf(filename, "samples_log%d.txt", stats_sd_file_count);
+	logStringToSD(sample_buffer, filename);
+	sample_length = 0;
+}
+
+void stats_end_interval(struct STATE *state) {
+	// Log this interval and start a new one
+	stats_sd_file_count = sd_log_file(slStats, 1);
+
+	debug("> (1) Logging sensor statistics to SD...");
+	if (SD_LOG_AGGREGATED) {
+		log_statistics(state);
+	} else {
+		log_samples();
+	}
+	debug("Done\n");
+
+	for (int i = 0; i < NUM_STATS; i++) {
+		stat_reset(&state->Stats[i]);
+	}
+}
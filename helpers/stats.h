@@ -0,0 +1,35 @@
+#ifndef STATS_INCLUDED
+#define STATS_INCLUDED
+
+#include <stdint.h>
+
+// Values are held in fixed point, in 1/STAT_SCALE of their unit
+#define STAT_SCALE 1000
+
+// Streaming statistics for one field over one telemetry interval (Welford's algorithm)
+struct TStat
+{
+	uint32_t count;
+	int32_t min, max;		// 1/STAT_SCALE units
+	int64_t mean;			// 1/STAT_SCALE units, Q16
+	int64_t m2;				// Sum of squared differences from the mean, Q16
+};
+
+// Fields that are sampled faster than telemetry is sent
+typedef enum {stBMETemperature, stBMEPressure, stBMEHumidity,
+			  stTMP117Temperature, stAHT20Temperature, stAHT20Humidity,
+			  stSolar0, stSolar1, stSolar2, stNO2WE, stNO2AE,
+			  stInternalTemperature, stBatteryVoltage, NUM_STATS} TStatField;
+
+void stat_add(struct TStat *stat, float value);
+void stat_reset(struct TStat *stat);
+float stat_mean(const struct TStat *stat);
+float stat_min(const struct TStat *stat);
+float stat_max(const struct TStat *stat);
+float stat_stddev(const struct TStat *stat);
+
+void stats_sample(struct STATE *state, TStatField field, float value);
+float stats_value(struct STATE *state, TStatField field, float latest);
+void stats_end_interval(struct STATE *state);
+
+#endif
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/watchdog.h"
+#include "../main.h"
+#include "../misc.h"
+#include "sd.h"
+#include "trace.h"
+
+// Binary event trace
+// Each core only ever writes to its own ring, from thread context, so recording needs no lock:
+// the event is filled in and then the head is moved on. Interrupt handlers must not record events.
+// The rings are left alone by the C runtime at boot, so after a watchdog reset the trace of the run
+// that hung is still there. It is kept frozen until core 1 has sent the first packet and dumped it,
+// so the card writes do not hold up the boot, and only then are the rings cleared.
+// tools/trace_to_chrome.py turns a dump into a Chrome / Perfetto trace.
+
+#define TRACE_MAGIC 0x54524331      // "TRC1"
+
+static const char *TRACE_NAMES[NUM_TRACE_IDS] = {
+    "LED", "Buzzer", "Sensors", "NO2", "GPS", "Cutdown", "Solar", "PM", "Muon",
+    "InternalTemps", "Power", "LoRa", "Memory", "Resume",
+    "MutexWait", "SPI", "I2C", "LoRaTX", "LoRaTXDone", "SDWrite", "Dump"
+};
+
+struct TTraceRing {
+    uint32_t magic;
+    uint32_t head;          // Events recorded since the ring was cleared
+    struct TTraceEvent events[TRACE_RING_EVENTS];
+};
+
+static struct TTraceRing __uninitialized_ram(trace_rings)[2];
+
+static volatile bool trace_frozen = false;
+static absolute_time_t next_dump;
+static const char *volatile requested_dump = NULL;
+static volatile bool dump_held = false;         // Until the first packet after boot
+static bool clear_after_dump = false;           // The rings still hold the run before the reset
+
+static void record(TTraceId id, uint32_t start, uint32_t duration, uint16_t arg, bool instant) {
+    if (!TRACE_ENABLED || trace_frozen) {
+        return;
+    }
+
+    struct TTraceRing *ring = &trace_rings[get_core_num()];
+    struct TTraceEvent *event = &ring->events[ring->head & (TRACE_RING_EVENTS - 1)];
+
+    event->start = start;
+    event->duration = duration;
+    event->arg = arg;
+    event->id = id;
+    event->instant = instant;
+
+    // The event must be complete before the other core can see it
+    __compiler_memory_barrier();
+    ring->head++;
+}
+
+static void clear_rings() {
+    for (int core = 0; core < 2; core++) {
+        trace_rings[core].magic = TRACE_MAGIC;
+        trace_rings[core].head = 0;
+    }
+}
+
+void trace_init() {
+    // The trace of a run that ended in a watchdog reset is kept, and dumped by core 1 after the first packet
+    bool kept = (trace_rings[0].magic == TRACE_MAGIC) && (trace_rings[1].magic == TRACE_MAGIC);
+
+    next_dump = get_absolute_time();
+
+    if (kept && watchdog_caused_reboot()) {
+        trace_frozen = true;
+        clear_after_dump = true;
+        dump_held = true;
+        trace_request_dump("watchdog reset");
+    } else {
+        clear_rings();
+    }
+}
+
+void trace_first_packet() {
+    // Lets a dump held since boot go ahead
+    dump_held = false;
+}
+
+void trace_end(TTraceId id, uint32_t start, uint16_t arg) {
+    // Records a span from start to now, if it was long enough to matter
+    uint32_t duration = time_us_32() - start;
+
+    if (duration >= TRACE_MIN_US) {
+        record(id, start, duration, arg, false);
+    }
+}
+
+void trace_event(TTraceId id, uint16_t arg) {
+    record(id, time_us_32(), 0, arg, true);
+}
+
+static void dump_bytes(const void *data, size_t len, const char *filename) {
+    // To the SD card, and as hex lines to USB when debugging
+    logBytesToSD((const uint8_t *)data, len, filename);
+
+    if (DEBUG) {
+        const uint8_t *bytes = (const uint8_t *)data;
+        char line[80];
+
+        for (size_t i = 0; i < len; i += 32) {
+            char *pos = line;
+            for (size_t j = i; (j < len) && (j < i + 32); j++) {
+                pos += sprintf(pos, "%02X", bytes[j]);
+            }
+            printf("TRACE %s\n", line);
+        }
+    }
+}
+
+void trace_request_dump(const char *reason) {
+    // For code that holds mtx - a dump takes too long to do there. One already waiting is not replaced
+    if (!requested_dump) {
+        requested_dump = reason;
+    }
+}
+
+void trace_service() {
+    // Carries out a requested dump - call without mtx held
+    const char *reason = requested_dump;
+
+    if (reason && !dump_held) {
+        requested_dump = NULL;
+        trace_dump(reason);
+    }
+}
+
+void trace_dump(const char *reason) {
+    // Write both rings to trace[X].bin
+    if (!time_reached(next_dump)) {
+        return;
+    }
+    next_dump = make_timeout_time_ms(TRACE_DUMP_HOLD_MS);
+
+    LOG_INFO("> (%d) Dumping trace - %s\n", get_core_num(), reason);
+    trace_frozen = true;
+
+    char filename[20];
+    sprintf(filename, "trace%d.bin", sd_log_new_file(slTrace));
+
+    uint8_t header[256];
+    uint8_t *pos = header;
+    uint32_t now = time_us_32();
+
+    memcpy(pos, "TRC1", 4);
+    pos += 4;
+    *pos++ = NUM_TRACE_IDS;
+    for (int i = 0; i < NUM_TRACE_IDS; i++) {
+        strcpy((char *)pos, TRACE_NAMES[i]);
+        pos += strlen(TRACE_NAMES[i]) + 1;
+    }
+    strncpy((char *)pos, reason, 32);
+    pos[31] = '\0';
+    pos += strlen((char *)pos) + 1;
+    memcpy(pos, &now, 4);
+    pos += 4;
+    dump_bytes(header, pos - header, filename);
+
+    for (int core = 0; core < 2; core++) {
+        struct TTraceRing *ring = &trace_rings[core];
+        uint32_t head = ring->head;
+        uint16_t count = (head < TRACE_RING_EVENTS) ? head : TRACE_RING_EVENTS;
+        uint32_t first = (head - count) & (TRACE_RING_EVENTS - 1);
+
+        uint8_t core_header[3] = {(uint8_t)core, (uint8_t)count, (uint8_t)(count >> 8)};
+        dump_bytes(core_header, 3, filename);
+
+        // Oldest first - the ring may have wrapped, in which case it goes out in two pieces
+        uint32_t to_end = TRACE_RING_EVENTS - first;
+        if (count <= to_end) {
+            dump_bytes(&ring->events[first], count * sizeof(struct TTraceEvent), filename);
+        } else {
+            dump_bytes(&ring->events[first], to_end * sizeof(struct TTraceEvent), filename);
+            dump_bytes(&ring->events[0], (count - to_end) * sizeof(struct TTraceEvent), filename);
+        }
+    }
+
+    if (clear_after_dump) {
+        clear_after_dump = false;
+        clear_rings();
+    }
+
+    trace_frozen = false;
+    trace_event(trDump, 0);
+}
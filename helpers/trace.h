@@ -0,0 +1,50 @@
+#ifndef TRACE_INCLUDED
+#define TRACE_INCLUDED
+
+#include <stdint.h>
+#include "pico/stdlib.h"
+#include "pico/mutex.h"
+
+// Event trace - each core has its own ring of the most recent events, which survives a watchdog reset
+// Spans shorter than TRACE_MIN_US are not recorded, so idle passes round the loops do not flood the ring
+#define TRACE_ENABLED true
+#define TRACE_RING_BITS 10
+#define TRACE_RING_EVENTS (1 << TRACE_RING_BITS)
+#define TRACE_MIN_US 20
+// A gap between LoRa transmissions longer than this dumps the trace, at most once per TRACE_DUMP_HOLD_MS
+#define TRACE_LATE_PACKET_MS 10000
+#define TRACE_DUMP_HOLD_MS (5 * 60 * 1000)
+
+// Names are written into each dump, so the converter does not need to know this list
+typedef enum {trLED, trBuzzer, trSensors, trNO2, trGPS, trCutdown, trSolar, trPM, trMuon,
+              trInternalTemps, trPower, trLoRa, trMemory, trResume,
+              trMutexWait, trSPI, trI2C, trLoRaTX, trLoRaTXDone, trSDWrite, trDump, NUM_TRACE_IDS} TTraceId;
+
+// Arguments of trMutexWait, recorded by the profiled locks
+#define TRACE_MUTEX_STATE 0
+#define TRACE_MUTEX_SPI0 1
+
+// Dump format, all little endian:
+//   "TRC1", uint8 number of names, the names NUL terminated, the reason NUL terminated, uint32 time of the dump (us)
+//   then for each core: uint8 core, uint16 count, and count events oldest first
+struct TTraceEvent {
+    uint32_t start;         // time_us_32()
+    uint32_t duration;      // us, 0 for an instant event
+    uint16_t arg;
+    uint8_t id;
+    uint8_t instant;
+};
+
+void trace_init();
+static inline uint32_t trace_start() { return time_us_32(); }
+void trace_end(TTraceId id, uint32_t start, uint16_t arg);
+void trace_event(TTraceId id, uint16_t arg);
+void trace_dump(const char *reason);
+void trace_request_dump(const char *reason);
+void trace_first_packet();
+void trace_service();
+
+// Times a call as a span of the given id
+#define TRACE_TASK(id, call) do { uint32_t _trace_start = trace_start(); call; trace_end(id, _trace_start, 0); } while (0)
+
+#endif
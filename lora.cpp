@@ -8,6 +8,11 @@
 #include "misc.h"
 #include "lora.h"
 #include "helpers/sd.h"
+#include "helpers/sensor.h"
+#include "helpers/power.h"
+#include "helpers/trace.h"
+#include "helpers/repeater.h"
+#include "sensors/pm_distribution.h"
 
 typedef enum {lmIdle, lmListening, lmSending} tLoRaMode;
 
@@ -25,6 +30,8 @@ struct TBinaryPacket
 static tLoRaMode LoRaMode;
 static char PayloadID[32];
 static int CallingCount=0;
+static int PMCount=0;
+static int HealthCount=0;
 static int RTTYCount=0;
 static int InRTTYMode=0;
 static int SendingRTTY=0;
@@ -35,9 +42,10 @@ static struct TBinaryPacket PacketToRepeat;
 static uint8_t SendRepeatedPacket, RepeatedPacketType=0;
 static unsigned char Sentence[256];
 static int ImplicitOrExplicit;
+static int LoRaSettingsMode;
+static volatile int RequestedMode = -1;
 
-static int lora_sd_line_count = 0;
-static int lora_sd_file_count = 0;
+static unsigned int SentenceCounter = 0;
 
 static inline void cs_select()
 {
@@ -63,7 +71,7 @@ static void writeRegister(uint8_t reg, uint8_t data)
     spi_write_blocking(SPI_PORT_1, buf, 2);
     cs_deselect();
 	
-    sleep_ms(1);
+    busy_wait_us(LORA_REGISTER_GAP_US);
 }
 
 static uint8_t readRegister(uint8_t addr)
@@ -74,11 +82,10 @@ static uint8_t readRegister(uint8_t addr)
 	
     cs_select();
     spi_write_blocking(SPI_PORT_1, &addr, 1);
-    sleep_ms(1);
     spi_read_blocking(SPI_PORT_1, 0, buf, 1);
     cs_deselect();
 	
-    sleep_ms(1);
+    busy_wait_us(LORA_REGISTER_GAP_US);
 	
 	// printf("READ %02X\n", buf[0]);
 	
@@ -120,6 +127,9 @@ void SetDeviceMode(uint8_t newMode)
 
 		default: return;
 	} 
+
+	power_load(plLoRaTX, newMode == RF98_MODE_TX);
+	power_load(plLoRaRX, newMode == RF98_MODE_RX_CONTINUOUS);
   
 	if (newMode != RF98_MODE_SLEEP)
 	{
@@ -143,7 +153,7 @@ void SetFrequency(double Frequency)
 {
 	unsigned long FrequencyValue;
 
-	printf("Frequency is %.3f", Frequency);
+	LOG_DEBUG("Frequency is %.3f", Frequency);
 
 	Frequency = Frequency * 7110656 / 434;
 	FrequencyValue = (unsigned long)(Frequency);
@@ -283,7 +293,7 @@ int TimeToSend(struct STATE *s)
 	if ((millis() > (LastLoRaTX + LORA_CYCLETIME*1000+2000)) && (TimeToSendIfNoGPS))
 	{
 		// Timed out
-		printf("Using Timeout\n");
+		LOG_DEBUG("Using Timeout\n");
 		return 1;
 	}
 	*/
@@ -302,14 +312,14 @@ int TimeToSend(struct STATE *s)
 
 			if (CycleSeconds == LORA_SLOT)
 			{
-				printf("Using GPS Timing\n");
+				LOG_DEBUG("Using GPS Timing\n");
 				SendRepeatedPacket = 0;
 				return 1;
 			}
 
 			if (RepeatedPacketType && ((CycleSeconds == LORA_REPEAT_SLOT_1) || (CycleSeconds == LORA_REPEAT_SLOT_2)))
 			{
-				printf("Time to repeat\n");
+				LOG_DEBUG("Time to repeat\n");
 				SendRepeatedPacket = RepeatedPacketType;
 				RepeatedPacketType = 0;
 				return 1;
@@ -320,7 +330,7 @@ int TimeToSend(struct STATE *s)
 	/*
 	else if ((TimeToSendIfNoGPS > 0) && (millis() >= TimeToSendIfNoGPS))
 	{
-		printf("Using LoRa Timing\n");
+		LOG_DEBUG("Using LoRa Timing\n");
 		SendRepeatedPacket = 0;
 		return 1;
 	}
@@ -339,6 +349,9 @@ int LoRaIsFree(struct STATE *state)
 		  // Clear that IRQ flag
 			writeRegister( REG_IRQ_FLAGS, 0x08); 
 			LoRaMode = lmIdle;
+			// The radio drops back to standby by itself once the packet is out
+			power_load(plLoRaTX, false);
+			trace_event(trLoRaTXDone, 0);
 		}
 					
 		// Now we test to see if we're doing TDM or not
@@ -384,9 +397,10 @@ void initLora()
 	// DIO0 is input
     gpio_set_dir(DIO0, GPIO_IN);
 	
-	SetupRFM98(FREQUENCY, LORA_MODE);
+	LoRaSettingsMode = config.LoRaMode;
+	SetupRFM98(config.Frequency, LoRaSettingsMode);
 	
-	strcpy(PayloadID, CALLSIGN);
+	strcpy(PayloadID, config.Callsign);
                            
 }
 
@@ -439,6 +453,17 @@ void SendLoRaPacket(unsigned char *buffer, int Length, int CallingPacket)
 
 	// go into transmit mode
 	SetDeviceMode(RF98_MODE_TX);
+	trace_event(trLoRaTX, Length);
+
+	// A long gap since the last packet is worth a look at what the cores were doing
+	static absolute_time_t last_tx = nil_time;
+	if (is_nil_time(last_tx)) {
+		LOG_INFO("> (1) First packet %lu ms after boot\n", (unsigned long)to_ms_since_boot(get_absolute_time()));
+		trace_first_packet();
+	} else if (absolute_time_diff_us(last_tx, get_absolute_time()) > TRACE_LATE_PACKET_MS * 1000) {
+		trace_request_dump("late packet");
+	}
+	last_tx = get_absolute_time();
 
 	LoRaMode = lmSending;
 	SendingRTTY = 0;
@@ -452,6 +477,15 @@ void check_lora(struct STATE *state)
 	if (LoRaIsFree(state))
 	{		
 		//printf("LoRa is free\n");
+		if (RequestedMode >= 0)
+		{
+			// Switch modes between packets, never during one
+			LoRaSettingsMode = RequestedMode;
+			RequestedMode = -1;
+			SetupRFM98(config.Frequency, LoRaSettingsMode);
+			LOG_INFO("> LoRa mode %d\n", LoRaSettingsMode);
+		}
+
 		if (SendRepeatedPacket == 3)
 		{
 			// Repeat ASCII sentence
@@ -463,7 +497,7 @@ void check_lora(struct STATE *state)
 		}
 		else if (SendRepeatedPacket == 2)
 		{
-			printf("Repeating uplink packet\n");
+			LOG_DEBUG("Repeating uplink packet\n");
 
 			// 0x80 | (LORA_ID << 3) | TargetID
 			SendLoRaPacket((unsigned char *)&PacketToRepeat, sizeof(PacketToRepeat), 0);
@@ -473,7 +507,7 @@ void check_lora(struct STATE *state)
 		}
 		else if (SendRepeatedPacket == 1)
 		{
-			printf("Repeating balloon packet\n");
+			LOG_DEBUG("Repeating balloon packet\n");
 
 			// 0x80 | (LORA_ID << 3) | TargetID
 
@@ -483,6 +517,7 @@ void check_lora(struct STATE *state)
 		else			
 		{
 			int PacketLength;
+			bool LogSentence = false;
 
 			if (++RTTYCount >= (LORA_RTTY_COUNT + LORA_RTTY_EVERY))
 			{
@@ -494,7 +529,7 @@ void check_lora(struct STATE *state)
 				/*
 				// Send RTTY packet
 				PacketLength = BuildSentence(state, (char *)Sentence, PayloadID);
-				printf("LoRa: Tx RTTY packet\n");
+				LOG_DEBUG("LoRa: Tx RTTY packet\n");
 				SendLoRaRTTY(PacketLength);    
 				*/
 			}
@@ -505,7 +540,7 @@ void check_lora(struct STATE *state)
 					CallingCount = 0;
 					SetupRFM98(LORA_CALL_FREQ, LORA_CALL_MODE);
 					PacketLength = BuildLoRaCall(Sentence);
-					printf("LoRa: Calling Mode");
+					LOG_DEBUG("LoRa: Calling Mode");
 					SendLoRaPacket(Sentence, PacketLength, 1);
 				}
 				else
@@ -515,39 +550,56 @@ void check_lora(struct STATE *state)
 			//  			    setupRFM98(LORA_FREQUENCY, LORA_MODE);
 			//  		    }
 
-					if (LORA_BINARY)
+					if ((LORA_PM_EVERY > 0) && config.EnablePM && (++PMCount >= LORA_PM_EVERY) &&
+						((PacketLength = BuildPMSentence((char *)Sentence, PayloadID)) > 0))
+					{
+						PMCount = 0;
+						LOG_DEBUG("LoRa: Tx PM distribution\n");
+					}
+					else if ((LORA_HEALTH_EVERY > 0) && (++HealthCount >= LORA_HEALTH_EVERY))
+					{
+						HealthCount = 0;
+						PacketLength = BuildHealthSentence((char *)Sentence, PayloadID);
+						LOG_DEBUG("LoRa: Tx task health\n");
+						repeater_log_health(state);
+					}
+					else if (LORA_BINARY)
 					{
 						// 0x80 | (LORA_ID << 3) | TargetID
 						PacketLength = BuildLoRaPositionPacket(state, Sentence);
-						printf("LoRa: Tx Binary packet");
+						LOG_DEBUG("LoRa: Tx Binary packet");
 					}
 					else
 					{
 						
 						PacketLength = BuildSentence(state, (char *)Sentence, PayloadID);
 						// printf("LoRa: Tx ASCII Sentence\n");
-						printf("> (1) ");
-						printf("%s\r", (char *)Sentence);
-
-						// Write sentence to SD card - filename is lora_log[xx].txt
-						lora_sd_line_count++;
+						LOG_INFO("> (1) %s\r", (char *)Sentence);
+						LogSentence = true;
+					}
 
-						if (lora_sd_line_count > SD_MAX_LINES) {
-							lora_sd_line_count = 0;
-							lora_sd_file_count++;
-						}
+					if (config.LoRaTransmitting) {
+						SendLoRaPacket(Sentence, PacketLength, 0);
+					}  
 
+					// The SD card is written while the radio sends, rather than holding up the packet
+					if (LogSentence)
+					{
+						// Write sentence to SD card - filename is lora_log[xx].txt
 						char lora_filename[20];
-						sprintf(lora_filename, "lora_log%d.txt", lora_sd_file_count);
+						sprintf(lora_filename, "lora_log%d.txt", sd_log_file(slLoRa, 1));
 
 						debug("> (1) Logging lora data to SD...");
 						logStringToSD((char *)Sentence, lora_filename);
 						debug("Done\n");
-					}
 
-					if (LORA_TRANSMITTING) {
-						SendLoRaPacket(Sentence, PacketLength, 0);
-					}  
+						// Start a new statistics interval
+						stats_end_interval(state);
+						if (config.EnablePM) {
+							pm_distribution_end_interval(state);
+						}
+						power_end_interval(state);
+					}
 				}
 			}
 		}
@@ -557,19 +609,29 @@ void check_lora(struct STATE *state)
 
 int BuildSentence(struct STATE *state, char *TxLine, const char *PayloadID)
 {
-	static unsigned int SentenceCounter=0;
     int Count, i, j;
     unsigned char c;
     unsigned int CRC, xPolynomial;
     char CRCString[8];
+	char SensorErrors[32];
+	char TMP117Temperature[16];
 	
     SentenceCounter++;
+
+	sensor_errors_string(SensorErrors, sizeof(SensorErrors));
+
+	// Empty field rather than a made up value when there is no valid reading
+	TMP117Temperature[0] = '\0';
+	if (state->TMP117Valid) {
+		snprintf(TMP117Temperature, sizeof(TMP117Temperature), "%.3f", stats_value(state, stTMP117Temperature, state->TMP117Temperature));
+	}
 	
-	// TODO: Modify to transmit new sensor data
-    sprintf(TxLine,
-            // SENTENCE_LENGTH-6,
-			// 28 Different fields 
-            "$$%s,%d,%02d:%02d:%02d,%.5f,%.5f,%05.5ld,%u,%.1f,%.1f,%.1f,%.0f,%.1f,%.1f,%.1f,%d,%.5f,%.5f,%.5f,%.5f,%.5f,%.5f,%.5f,%.5f,%.2f,%.2f,%.3f,%.3f,%.3f",
+	// Sampled sensors send their mean over the interval since the last sentence
+	// Cut short rather than overrun the packet, leaving room for the CRC and line end
+    snprintf(TxLine,
+            PAYLOAD_LENGTH - 8,
+			// 30 Different fields 
+            "$$%s,%d,%02d:%02d:%02d,%.5f,%.5f,%05.5ld,%u,%.1f,%.1f,%.1f,%.0f,%.1f,%.1f,%.1f,%d,%.5f,%.5f,%.5f,%.5f,%.5f,%.5f,%.5f,%.5f,%.2f,%.2f,%.3f,%.3f,%s,%c,%s,%d,%.2f,%.1f",
             PayloadID,
             SentenceCounter,
 			state->Hours, state->Minutes, state->Seconds,
@@ -577,27 +639,32 @@ int BuildSentence(struct STATE *state, char *TxLine, const char *PayloadID)
             state->Longitude,
             state->Altitude,
 			state->Satellites,
-            state->BatteryVoltage,
-			state->InternalTemperature,
-			state->BMETemperature,
-			state->BMEPressure,
-			state->BMEHumidity,
+            stats_value(state, stBatteryVoltage, state->BatteryVoltage),
+			stats_value(state, stInternalTemperature, state->InternalTemperature),
+			stats_value(state, stBMETemperature, state->BMETemperature),
+			stats_value(state, stBMEPressure, state->BMEPressure),
+			stats_value(state, stBMEHumidity, state->BMEHumidity),
 			state->PMTemperature,
 			state->PMHumidity,
 			state->HasCutDown,
-			state->NO2WE,
-			state->NO2AE,
-			state->Solar0,
-			state->Solar1,
-			state->Solar2,
+			stats_value(state, stNO2WE, state->NO2WE),
+			stats_value(state, stNO2AE, state->NO2AE),
+			stats_value(state, stSolar0, state->Solar0),
+			stats_value(state, stSolar1, state->Solar1),
+			stats_value(state, stSolar2, state->Solar2),
 			state->PM1,
 			state->PM2,
 			state->PM10,
 			state->PMSamplePeriod,
 			state->PMFlowRate,
-			state->AHT20Temperature,
-			state->AHT20Humidity,
-			state->TMP117Temperature
+			stats_value(state, stAHT20Temperature, state->AHT20Temperature),
+			stats_value(state, stAHT20Humidity, state->AHT20Humidity),
+			TMP117Temperature,
+			state->AltitudeSource == asBaro ? 'B' : 'G',
+			SensorErrors,
+			state->muonCount,
+			state->muonRate,
+			state->Endurance
             );
     Count = strlen(TxLine);
 	// DEBUG: printf("Message length: %d \n", Count);
@@ -627,3 +694,107 @@ int BuildSentence(struct STATE *state, char *TxLine, const char *PayloadID)
 	
 	return strlen(TxLine) + 1;
 }
+
+int BuildPMSentence(char *TxLine, const char *PayloadID)
+{
+	// Latest OPC size distribution record, hex coded - 0 if there isn't one or it won't fit
+	uint8_t Frame[PM_RECORD_MAX];
+	int Length = pm_distribution_frame(Frame);
+	int Count, i, j;
+	unsigned int CRC;
+
+	if ((Length == 0) || (strlen(PayloadID) + 2 * Length + 16 > PAYLOAD_LENGTH))
+	{
+		return 0;
+	}
+
+	Count = sprintf(TxLine, "$$%s-PM,", PayloadID);
+	for (i = 0; i < Length; i++)
+	{
+		TxLine[Count++] = Hex(Frame[i] >> 4);
+		TxLine[Count++] = Hex(Frame[i] & 15);
+	}
+
+	CRC = 0xffff;
+	for (i = 2; i < Count; i++)
+	{
+		CRC ^= (((unsigned int)TxLine[i]) << 8);
+		for (j=0; j<8; j++)
+		{
+			if (CRC & 0x8000)
+				CRC = (CRC << 1) ^ 0x1021;
+			else
+				CRC <<= 1;
+		}
+	}
+
+	TxLine[Count++] = '*';
+	TxLine[Count++] = Hex((CRC >> 12) & 15);
+	TxLine[Count++] = Hex((CRC >> 8) & 15);
+	TxLine[Count++] = Hex((CRC >> 4) & 15);
+	TxLine[Count++] = Hex(CRC & 15);
+	TxLine[Count++] = '\n';
+	TxLine[Count++] = '\0';
+
+	return Count;
+}
+
+int BuildHealthSentence(char *TxLine, const char *PayloadID)
+{
+	// Deadline misses, worst release jitter and worst run time of each task
+	int Count, i, j;
+	unsigned int CRC;
+
+	Count = sprintf(TxLine, "$$%s-HEALTH,", PayloadID);
+	Count += repeater_health_string(TxLine + Count, PAYLOAD_LENGTH - Count - 8);
+
+	CRC = 0xffff;
+	for (i = 2; i < Count; i++)
+	{
+		CRC ^= (((unsigned int)TxLine[i]) << 8);
+		for (j=0; j<8; j++)
+		{
+			if (CRC & 0x8000)
+				CRC = (CRC << 1) ^ 0x1021;
+			else
+				CRC <<= 1;
+		}
+	}
+
+	TxLine[Count++] = '*';
+	TxLine[Count++] = Hex((CRC >> 12) & 15);
+	TxLine[Count++] = Hex((CRC >> 8) & 15);
+	TxLine[Count++] = Hex((CRC >> 4) & 15);
+	TxLine[Count++] = Hex(CRC & 15);
+	TxLine[Count++] = '\n';
+	TxLine[Count++] = '\0';
+
+	return Count;
+}
+
+int lora_mode()
+{
+	return LoRaSettingsMode;
+}
+
+bool lora_set_mode(int Mode)
+{
+	// Takes effect before the next packet
+	if ((Mode != 0) && (Mode != 1) && (Mode != 2) && (Mode != 5))
+	{
+		return false;
+	}
+	RequestedMode = Mode;
+	return true;
+}
+
+unsigned int lora_sentence_count()
+{
+	return SentenceCounter;
+}
+
+void lora_resume_sentences(unsigned int Count)
+{
+	// After a warm restart, so receivers do not see the counter go back to 1
+	SentenceCounter = Count;
+}
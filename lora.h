@@ -113,9 +113,18 @@
 #define LORA_SLOT			0
 #define LORA_CYCLETIME		0
 #define LORA_ID				0
+#define LORA_PM_EVERY		0		// Send the OPC size distribution instead of every Nth sentence, 0 = never
+#define LORA_HEALTH_EVERY	30		// Send (and log) the task health instead of every Nth sentence, 0 = never
+#define LORA_REGISTER_GAP_US	10		// Chip select high time between register accesses
 
 void initLora();
 void check_lora(struct STATE *s);
 int BuildSentence(struct STATE *state, char *TxLine, const char *PayloadID);
+int BuildPMSentence(char *TxLine, const char *PayloadID);
+int BuildHealthSentence(char *TxLine, const char *PayloadID);
+int lora_mode();
+bool lora_set_mode(int Mode);
+unsigned int lora_sentence_count();
+void lora_resume_sentences(unsigned int Count);
 
 #endif
\ No newline at end of file
@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <string.h>
 #include "pico/stdlib.h"
 #include "pico/multicore.h"
+#include "pico/stdio_usb.h"
 #include "pico/mutex.h"
 #include "hardware/adc.h"
 #include "hardware/i2c.h"
@@ -12,6 +14,7 @@
 #include "misc.h"
 #include "lora.h"
 #include "cutdown.h"
+#include "altitude.h"
 #include "sensors/bme.h"
 #include "sensors/gps.h"
 #include "sensors/no2.h"
@@ -23,29 +26,56 @@
 #include "sensors/aht20.h"
 
 #include "helpers/repeater.h"
+#include "helpers/sensor.h"
+#include "helpers/adc_service.h"
 #include "helpers/memory.h"
+#include "helpers/resume.h"
 #include "helpers/sd.h"
+#include "helpers/spi_bus.h"
+#include "helpers/power.h"
+#include "helpers/trace.h"
+#include "helpers/console.h"
 
 //RUNTIME VARIABLES
 
+struct STATE state;
+static mutex_t state_mutex;
+struct TProfiledMutex mtx;
+
+// Named repeaters are reported as tasks in the health frame - the LED only runs low down, so is left out
+
 static Repeater LED_repeater(3000);
-static Repeater BZ_repeater(1000);
-static Repeater BME_repeater(500);
-static Repeater GPS_repeater(10);
-static Repeater FM_repeater(60 * 1000);
-static Repeater NO2_repeater(1000);
-static Repeater MUON_repeater(1000);     //Originally (1), update as Voltmeter run by Arduino
-static Repeater iTemp_repeater(1000);
-static Repeater Lora_repeater(2000);
-static Repeater CUTDOWN_repeater(1000);
-static Repeater Solar_repeater(1000);
-static Repeater PM_repeater(2000);
-static Repeater AHT20_repeater(1000);
-static Repeater TMP117_repeater(1000);
+static Repeater BZ_repeater(1000, "Buzzer");
+static Repeater GPS_repeater(10, "GPS");
+static Repeater FM_repeater(60 * 1000, "FlightMode");
+static Repeater NO2_repeater(1000, "NO2");
+static Repeater MUON_repeater(MUON_INTERVAL_MS, "Muon");
+static Repeater iTemp_repeater(1000, "IntTemp");
+static Repeater Lora_repeater(2000, "LoRa");
+static Repeater CUTDOWN_repeater(1000, "Cutdown");
+static Repeater Solar_repeater(1000, "Solar");
+static Repeater PM_repeater(2000, "PM");
+static Repeater POWER_repeater(POWER_INTERVAL_MS, "Power");
+static Repeater LOCK_repeater(LOCK_REPORT_MS, "LockReport");
+static Repeater LOG_repeater(LOG_DRAIN_MS, "LogDrain");
+static Repeater CONSOLE_repeater(CONSOLE_POLL_MS, "Console");
+static Repeater MEMORY_repeater(1000, "Memory");
+static Repeater RESUME_repeater(RESUME_SAVE_MS, "Resume");
+static absolute_time_t power_mode_hold;
+
+//I2C SENSORS - periods are set by each driver
+static BME280Sensor bme;
+static AHT20Sensor aht20;
+static TMP117Sensor tmp117;
 
 //MAIN CORE FUNCTIONS
 
 int main() {
+    // Boot order - only what the first packet needs is done before core 1 is started:
+    //   SD card -> configuration -> core 1 -> LoRa -> first packet
+    // The GPS UART, ADC and GPIO are set up on the way, as they take no time. Core 0 then brings up the
+    // I2C sensors and the OPC while core 1 is already transmitting; each sensor joins the telemetry when
+    // it is found, and the OPC waits out its power up in its own state machine.
 
     //init usb output
     stdio_init_all();
@@ -54,8 +84,17 @@ int main() {
     debug("\n>>> Initialising modules ...\n\n");
     
     debug("> Init mutex... ");
-    mutex_init(&mtx);
-    mutex_init(&mtx_adc);
+    mutex_init(&state_mutex);
+    lock_init(&mtx, &state_mutex, "state", LOCK_RANK_STATE, TRACE_MUTEX_STATE);
+    debug("Done\n");
+
+    // After a watchdog reset the state is carried over, and the slow parts of the boot are skipped
+    resume_init();
+    bool fast = resume_fast();
+
+    // Before anything else, as it moves the peripheral clock
+    debug("> Init power monitor... ");
+    power_init();
     debug("Done\n");
 
     debug("> Init LED... ");
@@ -75,107 +114,62 @@ int main() {
     adc_init();
     debug("Done\n");
     
-    if (ENABLE_NO2 == true){
-        debug("> Init NO2 sensor... ");
-        initNO2();
-        debug("Done\n");
-    }
-
-    debug("> Init Muon line... ");
-    initMuon();
-    debug("Done\n");
-    
-    debug("> Init SPI 0 & 1 @500kHz... ");
-    spi_init(SPI_PORT_0, 500000);
+    debug("> Init SPI 0 & 1... ");
+    // spi0 is shared by the SD card and OPC, and belongs to the arbiter
+    spi_bus_init();
     spi_init(SPI_PORT_1, 500000);
 
-    // SPI Chip Select lines
-    gpio_init(CS_PM);
-    gpio_set_dir(CS_PM, GPIO_OUT);
-    gpio_put(CS_PM, 1);
-    
-    gpio_init(CS_SD);
-    gpio_set_dir(CS_SD, GPIO_OUT);
-    gpio_put(CS_SD, 1);
-
-    // Set spi to correct mode for PM sensor
-    spi_set_format(SPI_PORT_0, 8, SPI_CPOL_0, SPI_CPHA_1, SPI_MSB_FIRST);
-
     //GPIO for SPI
-    gpio_set_function(MISO_0, GPIO_FUNC_SPI);
-    gpio_set_function(SCLK_0, GPIO_FUNC_SPI);
-    gpio_set_function(MOSI_0, GPIO_FUNC_SPI);
     gpio_set_function(MISO_1, GPIO_FUNC_SPI);
     gpio_set_function(SCLK_1, GPIO_FUNC_SPI);
     gpio_set_function(MOSI_1, GPIO_FUNC_SPI);
-
     debug("Done\n");
 
-    debug("> Init I2C 0 and 1 @400kHz... ");
-    i2c_init(I2C_PORT_0, 400*1000);
-    i2c_init(I2C_PORT_1, 400*1000);
-    gpio_set_function(SDA_0, GPIO_FUNC_I2C);
-    gpio_set_function(SCL_0, GPIO_FUNC_I2C);
-    gpio_set_function(SDA_1, GPIO_FUNC_I2C);
-    gpio_set_function(SCL_1, GPIO_FUNC_I2C);
-    gpio_pull_up(SDA_0);
-    gpio_pull_up(SCL_0);
-    gpio_pull_up(SDA_1);
-    gpio_pull_up(SCL_1);
-    debug("Done\n");
-
-    debug("> Init BME280... ");
-    initBME280();
-    debug("Done\n");
+    // Keeps the trace of a run that ended in a watchdog reset, for core 1 to save after the first packet
+    trace_init();
 
-    debug(">Init TMP117...");
-    initTMP117();
-    debug("Done\n");
-
-    debug(">Init AHT20...");
-    initAHT20();
-    debug("Done\n");
+    // Needs the SD card too, and must come before anything that reads the configuration
+    memory_init();
+    config_load(resume_config());
+    count_boot();
 
     debug("> Init GPS... ");
     initGPS();
     debug("Done\n");
 
-    debug("> Init Lora... ");
-    initLora();
-    debug("Done\n");
-
     debug("> Init Cutdown... ");
     init_cutdown();
     debug("Done\n");
 
+    if (config.EnableNO2){
+        debug("> Init NO2 sensor... ");
+        initNO2();
+        debug("Done\n");
+    }
+
     debug("> Init Solar... ");
     initSolar();
     debug("Done\n");
 
-    sleep_ms(2000);
-    if (ENABLE_PM == true){
-        debug("> Init PM... ");
-        initPM();
+    debug("> Init ADC sampler... ");
+    adc_service_init();
+    debug("Done\n");
+
+    // Reads the ADC sampler, from core 1. After initSolar, which would otherwise turn pin 28 into an analog input
+    // and stop the PIO seeing any pulses
+    if (ENABLE_MUON == true){
+        debug("> Init Muon line... ");
+        initMuon();
         debug("Done\n");
     }
 
-    debug("> Init internal temperature... ");
-    adc_set_temp_sensor_enabled(true);
-    debug("Done\n");
+    // Registered now, as core 1 reports their errors, and probed once core 1 is running
+    sensor_register(&bme);
+    sensor_register(&aht20);
+    sensor_register(&tmp117);
 
-    // debug("> Init memory... ");
-    // uint8_t emptyData[16 * FLASH_SECTOR_SIZE];
-    // for (int i = 0; i < 16 * FLASH_SECTOR_SIZE; i++) {
-    //     emptyData[i] = 0;
-    // }
-    // clearChunk(0, 1);
-    // readChunk(flash_target_contents, 1);
-    // writeChunk(0, emptyData, 1);
-    // readChunk(flash_target_contents, 1);
-    
-    debug("> Init watchdog... ");
-    watchdog_enable(2000, 0);
-    debug("Done\n");
+    // Flight mode, cutdown and the rest, if this is a warm restart
+    resume_restore(&state);
 
     debug("\n>>> Spooling thread... \n");
     multicore_launch_core1(core_entry);
@@ -185,28 +179,83 @@ int main() {
     } else {
         multicore_fifo_push_blocking(CORE_INIT_FLAG);
         debug("> (0) Core 0 initialised.\n");
+
+        // The flash is only written once core 1 can be parked, see memory_flush
+        while (!multicore_lockout_victim_is_initialized(1)) {
+            tight_loop_contents();
+        }
+    }
+    uint32_t core1_ms = to_ms_since_boot(get_absolute_time());
+
+    // The slow peripherals, while core 1 sends the first packets
+    debug("> Init I2C 0 and 1 @400kHz... ");
+    i2c_init(I2C_PORT_0, I2C_BAUDRATE);
+    i2c_init(I2C_PORT_1, I2C_BAUDRATE);
+    gpio_set_function(SDA_0, GPIO_FUNC_I2C);
+    gpio_set_function(SCL_0, GPIO_FUNC_I2C);
+    gpio_set_function(SDA_1, GPIO_FUNC_I2C);
+    gpio_set_function(SCL_1, GPIO_FUNC_I2C);
+    gpio_pull_up(SDA_0);
+    gpio_pull_up(SCL_0);
+    gpio_pull_up(SDA_1);
+    gpio_pull_up(SCL_1);
+    debug("Done\n");
+
+    debug("> Probing I2C sensors...\n");
+    sensor_probe_all();
+    debug("Done\n");
+
+    if (config.EnablePM){
+        debug("> Init PM... ");
+        if (fast) {
+            resumePM(resume_pm_stopped());
+        } else {
+            initPM();
+        }
+        debug("Done\n");
+    }
+
+    // Task periods from the configuration, now the drivers have set their own
+    config_apply_periods();
+
+    // A warm restart leaves anything staged during init for later
+    if (!fast) {
+        memory_flush();
     }
 
+    debug("> Init watchdog... ");
+    watchdog_enable(2000, 0);
+    debug("Done\n");
+
+    LOG_INFO("> (0) Core 1 started after %lu ms, boot finished after %lu ms\n", (unsigned long)core1_ms,
+             (unsigned long)to_ms_since_boot(get_absolute_time()));
+
     while(1) {
         //mainloop
     
         watchdog_update();
-        check_LED(&state);
-        check_BUZZER(&state);
-        check_BME(&state);
-        check_AHT20(&state);
-        check_TMP117(&state);
-        if (ENABLE_NO2 == true){
-            check_NO2(&state);
+        TRACE_TASK(trLED, check_LED(&state));
+        TRACE_TASK(trBuzzer, check_BUZZER(&state));
+        TRACE_TASK(trSensors, check_SENSORS(&state));
+        if (config.EnableNO2){
+            TRACE_TASK(trNO2, check_NO2(&state));
         }
-        check_GPS(&state);
-        check_CUTDOWN(&state);
-        check_SOLAR(&state);
-        if (ENABLE_PM == true){
-            check_PM(&state);
+        TRACE_TASK(trGPS, check_GPS(&state));
+        TRACE_TASK(trCutdown, check_CUTDOWN(&state));
+        TRACE_TASK(trSolar, check_SOLAR(&state));
+        if (config.EnablePM){
+            TRACE_TASK(trPM, check_PM(&state));
         }
 
-        check_internalTemps(&state);
+        TRACE_TASK(trInternalTemps, check_internalTemps(&state));
+        TRACE_TASK(trPower, check_POWER(&state));
+        TRACE_TASK(trMemory, check_MEMORY(&state));
+        TRACE_TASK(trResume, check_RESUME(&state));
+
+        // Nothing on this core needs to run more often than the GPS is polled
+        if (power_mode() == pwLow) {
+            power_idle(GPS_repeater.next_time());
+        }
     }
 }
 
@@ -223,18 +272,49 @@ void core_entry() {
         debug("> (1) Core 1 initialised.\n");
     }
 
+    // Lets core 0 park this core while it writes the flash. The lockout takes over the FIFO interrupt and eats
+    // whatever arrives, so it has to come after the handshake, and the FIFO is not used again.
+    multicore_lockout_victim_init();
+
+    // The radio belongs to this core, and is all the first packet waits for
+    debug("> (1) Init Lora... ");
+    initLora();
+    debug("Done\n");
+
     while(1) {
         //threadloop
-        //check_MUON();
-        check_LORA(&state);
+        if (ENABLE_MUON == true){
+            check_MUON(&state);
+        }
+        TRACE_TASK(trLoRa, check_LORA(&state));
+        trace_service();
+        check_LOCKS();
+        check_CONSOLE();
+        check_LOG();
+
+        // Sleep until the next transmission, unless the analog muon detector needs every ADC sample
+        if (!ENABLE_MUON || (MUON_MODE == MUON_MODE_PULSE)) {
+            absolute_time_t wake = Lora_repeater.next_time();
+            if (ENABLE_MUON && absolute_time_diff_us(MUON_repeater.next_time(), wake) > 0) {
+                wake = MUON_repeater.next_time();
+            }
+            if (log_pending() && absolute_time_diff_us(LOG_repeater.next_time(), wake) > 0) {
+                wake = LOG_repeater.next_time();
+            }
+            // Only listen for commands while a host is attached
+            if (stdio_usb_connected() && absolute_time_diff_us(CONSOLE_repeater.next_time(), wake) > 0) {
+                wake = CONSOLE_repeater.next_time();
+            }
+            power_idle(wake);
+        }
     }
         
 }
 
 void check_LED(struct STATE *s) {
-    mutex_enter_blocking(&mtx);
+    LOCK(&mtx);
     long alt = s->Altitude;
-    mutex_exit(&mtx);
+    UNLOCK(&mtx);
     
     if (alt < LOW_POWER_ALTITUDE && LED_repeater.can_fire()) {
         gpio_put(LED_PIN, !gpio_get(LED_PIN));
@@ -248,132 +328,270 @@ void fix_LED() {
 
 void check_BUZZER(struct STATE *s) {
     if (BZ_repeater.can_fire()) {
-        mutex_enter_blocking(&mtx);
+        LOCK(&mtx);
         TFlightMode fm = s->FlightMode;
-        mutex_exit(&mtx);
+        UNLOCK(&mtx);
         
         // If landed, flip state of buzzer pin
         if (fm == fmLanded) {
             gpio_put(BZ_PIN, !gpio_get(BZ_PIN));
         } 
+        BZ_repeater.done();
     }
 }
 
-void check_BME(struct STATE *s) {
-    if (BME_repeater.can_fire()) {
-        mutex_enter_blocking(&mtx);
-        readBME(s);
-        mutex_exit(&mtx);
-    }
-}
+void check_SENSORS(struct STATE *s) {
+    // Only sensors that were found at boot are in the active list
+    bool published = false;
+
+    // FlightMode and Altitude are only written on this core
+    sensor_set_phase(sensor_phase(s));
+
+    for (int i = 0; i < sensor_active_count(); i++) {
+        SensorDriver *sensor = sensor_active(i);
+
+        if (!sensor_due(sensor)) {
+            continue;
+        }
 
-void check_TMP117(struct STATE *s){
-    if (TMP117_repeater.can_fire()){
-        mutex_enter_blocking(&mtx);
-        readTMP117(s);
-        mutex_exit(&mtx);        
+        if (sensor_poll(sensor)) {
+            LOCK(&mtx);
+            sensor->publish(s);
+            UNLOCK(&mtx);
+            published = true;
+        } else if (sensor->health == shFailing) {
+            LOCK(&mtx);
+            sensor->withdraw(s);
+            UNLOCK(&mtx);
+        }
     }
-}
 
-void check_AHT20(struct STATE *s){
-    if (AHT20_repeater.can_fire()){
-        mutex_enter_blocking(&mtx);
-        readAHT20(s);
-        mutex_exit(&mtx);        
+    if (published) {
+        LOCK(&mtx);
+        altitude_update(s);
+        UNLOCK(&mtx);
     }
+
+    // Re-probe failed or missing sensors
+    sensor_maintain();
 }
 
 void check_NO2(struct STATE *s) {
     if (NO2_repeater.can_fire()) {
-        mutex_enter_blocking(&mtx);
-        mutex_enter_blocking(&mtx_adc);
+        LOCK(&mtx);
         readNO2(s);
-        mutex_exit(&mtx);
-        mutex_exit(&mtx_adc);
+        UNLOCK(&mtx);
+        NO2_repeater.done();
     }
 }
 
 void check_SOLAR(struct STATE *s) {
     if (Solar_repeater.can_fire()) {
-        mutex_enter_blocking(&mtx);
-        mutex_enter_blocking(&mtx_adc);
+        LOCK(&mtx);
         readSolar(s);
-        mutex_exit(&mtx);
-        mutex_exit(&mtx_adc);
+        UNLOCK(&mtx);
+        Solar_repeater.done();
     }
 }
 
 void check_PM(struct STATE *s) {
-    if (PM_repeater.can_fire()) {
-        mutex_enter_blocking(&mtx);
+    // The OPC state machine steps every loop - the repeater only sets when a reading is taken
+    if (stepPM(PM_repeater.can_fire())) {
+        LOCK(&mtx);
         readPM(s);
-        mutex_exit(&mtx);
+        UNLOCK(&mtx);
     }
 }
 
 void check_MUON(struct STATE *s) {
+    // Runs on core 1 - scan every new sample for pulses, and publish once per interval
+    // Only the publishing is traced, as the scan runs on every pass
+    processMuon();
+
     if (MUON_repeater.can_fire()) {
-        mutex_enter_blocking(&mtx);
-        mutex_enter_blocking(&mtx_adc);
+        uint32_t start = trace_start();
+        LOCK(&mtx);
+        sd_defer_begin();
         readMuon(s);
-        mutex_exit(&mtx);
-        mutex_exit(&mtx_adc);
+        UNLOCK(&mtx);
+        sd_write_deferred();
+        MUON_repeater.done();
+        trace_end(trMuon, start, 0);
     }
 }
 
 void check_GPS(struct STATE *s) {
     if (GPS_repeater.can_fire()) {
-        mutex_enter_blocking(&mtx);
+        LOCK(&mtx);
         readGPS(s);
-        mutex_exit(&mtx);
+        UNLOCK(&mtx);
+        GPS_repeater.done();
     }
     if (FM_repeater.can_fire()) {
-        mutex_enter_blocking(&mtx);
+        LOCK(&mtx);
         writeFlightMode(s);
-        mutex_exit(&mtx);
+        UNLOCK(&mtx);
+        FM_repeater.done();
     }
 }
 
 void check_CUTDOWN(struct STATE *s) {
     if (CUTDOWN_repeater.can_fire()) {
-        mutex_enter_blocking(&mtx);
+        LOCK(&mtx);
         cutdown_check(&state);
-        mutex_exit(&mtx);
+        UNLOCK(&mtx);
+        CUTDOWN_repeater.done();
     }
 }
 
 void check_LORA(struct STATE *s) {
     if (Lora_repeater.can_fire()) {
         debug("> (1) Lora can send\n");
-        mutex_enter_blocking(&mtx);
+        // The sentence is built with the state locked, and logged to the SD card once it is released
+        LOCK(&mtx);
+        sd_defer_begin();
         check_lora(&state);
-        mutex_exit(&mtx);
-        //writeStateToMem(&state);
+        UNLOCK(&mtx);
+        sd_write_deferred();
+        Lora_repeater.done();
+    }
+}
+
+
+void check_LOCKS() {
+    // Runs on core 1, without the state locked
+    if (LOCK_repeater.can_fire()) {
+        lock_report();
+        LOCK_repeater.done();
+    }
+}
+
+void check_CONSOLE() {
+    // Runs on core 1, without the state locked
+    if (CONSOLE_repeater.can_fire()) {
+        console_poll();
+        console_stream();
+        CONSOLE_repeater.done();
     }
 }
 
+void check_LOG() {
+    // Runs on core 1 - console output from both cores is written here, when USB has room for it
+    if (LOG_repeater.can_fire()) {
+        log_drain();
+        LOG_repeater.done();
+    }
+}
 
 void check_internalTemps(struct STATE *s) {
     if (iTemp_repeater.can_fire()) {
-        mutex_enter_blocking(&mtx_adc);
-        adc_select_input(4);
-        uint16_t iTempRaw = adc_read();
-        mutex_exit(&mtx_adc);
-        float iTempV = iTempRaw * ADC_CONV;
+        float iTempV = adc_service_voltage(ADC_TEMP_CHANNEL);
         float iTemp =  27 - (iTempV - 0.706) / 0.001721;
-        mutex_enter_blocking(&mtx);
+        LOCK(&mtx);
         s->InternalTemperature = iTemp;
-        mutex_exit(&mtx);
+        stats_sample(s, stInternalTemperature, iTemp);
+        UNLOCK(&mtx);
+        iTemp_repeater.done();
         //printf("> (0) Internal temperature %.2f\n", iTemp);
     }
 }
 
-void writeStateToMem(struct STATE * s) {
-    mutex_enter_blocking(&mtx);
-    uint8_t buf[FLASH_SECTOR_SIZE];
-    longToBytes(&buf[0], s->NO2WE);
-    longToBytes(&buf[4], s->NO2AE);
-    writeChunk(0, buf, 1);
-    readChunk(flash_target_contents, 32);
-    mutex_exit(&mtx);
-}
\ No newline at end of file
+void check_POWER(struct STATE *s) {
+    if (POWER_repeater.can_fire()) {
+        LOCK(&mtx);
+        bool low = power_update(s);
+        TPowerMode mode = power_select_mode(s);
+        UNLOCK(&mtx);
+
+        if (low) {
+            low_battery(s);
+        }
+
+        if ((mode != power_mode()) && time_reached(power_mode_hold)) {
+            power_set_mode(mode);
+            power_mode_hold = make_timeout_time_ms(POWER_MODE_HOLD_MS);
+
+            // The I2C dividers are worked out from clk_sys
+            i2c_set_baudrate(I2C_PORT_0, I2C_BAUDRATE);
+            i2c_set_baudrate(I2C_PORT_1, I2C_BAUDRATE);
+
+            if (ENABLE_MUON && (MUON_MODE == MUON_MODE_PULSE)) {
+                muonClockChanged();
+            }
+        }
+        POWER_repeater.done();
+    }
+}
+
+void low_battery(struct STATE *s) {
+    // Low battery policy - shed the heavy loads so the tracker keeps transmitting for as long as possible
+    debug("<!> (0) Battery low - shedding loads\n");
+    if (config.EnablePM) {
+        stopPM();
+    }
+}
+
+void count_boot() {
+    // Counts boots and watchdog resets in flash, and reports the last flight state saved before this boot
+    struct TMemoryCounters counters;
+    struct TMemoryFlight flight;
+
+    if (!memory_get(mkCounters, &counters, sizeof(counters))) {
+        memset(&counters, 0, sizeof(counters));
+    }
+    counters.Boots++;
+    if (watchdog_caused_reboot()) {
+        counters.WatchdogResets++;
+    }
+    memory_put(mkCounters, &counters, sizeof(counters));
+    LOG_INFO("> Boot %lu, %lu after a watchdog reset\n", (unsigned long)counters.Boots, (unsigned long)counters.WatchdogResets);
+
+    if (memory_get(mkFlight, &flight, sizeof(flight))) {
+        LOG_INFO("> Last saved: flight mode %ld, %scut down, %.5f, %.5f, %ld m (min %ld m, max %ld m)\n",
+              (long)flight.FlightMode, flight.HasCutDown ? "" : "not ", flight.Latitude, flight.Longitude,
+              (long)flight.Altitude, (long)flight.MinimumAltitude, (long)flight.MaximumAltitude);
+    }
+}
+
+void check_MEMORY(struct STATE *s) {
+    // Saves the flight state to flash - straight away when the flight mode or cutdown changes, otherwise every MEMORY_FLUSH_MS
+    static struct TMemoryFlight saved;
+    static absolute_time_t next_save;
+
+    if (MEMORY_repeater.can_fire()) {
+        struct TMemoryFlight flight;
+
+        LOCK(&mtx);
+        flight.FlightMode = s->FlightMode;
+        flight.HasCutDown = s->HasCutDown;
+        flight.MinimumAltitude = s->MinimumAltitude;
+        flight.MaximumAltitude = s->MaximumAltitude;
+        flight.Latitude = s->Latitude;
+        flight.Longitude = s->Longitude;
+        flight.Altitude = s->Altitude;
+        flight.Time = s->Time;
+        UNLOCK(&mtx);
+
+        bool changed = (flight.FlightMode != saved.FlightMode) || (flight.HasCutDown != saved.HasCutDown);
+
+        if (changed || time_reached(next_save)) {
+            memory_put(mkFlight, &flight, sizeof(flight));
+            saved = flight;
+            next_save = make_timeout_time_ms(MEMORY_FLUSH_MS);
+            if (changed) {
+                memory_flush();
+            }
+        }
+
+        memory_service();
+        MEMORY_repeater.done();
+    }
+}
+
+void check_RESUME(struct STATE *s) {
+    // Keeps the copy of the state that a warm restart carries on from
+    if (RESUME_repeater.can_fire()) {
+        resume_save(s);
+        RESUME_repeater.done();
+    }
+}
@@ -2,6 +2,10 @@
 #define MAIN_H
 
 #include "pico/mutex.h"
+#include "helpers/stats.h"
+#include "helpers/lock.h"
+#include "helpers/log.h"
+#include "helpers/config.h"
 
 #define DEBUG 1
 
@@ -16,6 +20,9 @@
 // Maximum lines to go in one sd card file - needed so that writing does not take too long
 #define SD_MAX_LINES 500
 
+// Log statistics for each telemetry interval to SD (true), or every sensor sample (false)
+#define SD_LOG_AGGREGATED true
+
 // Toggle if using ADC 0 and 1 for solar or N02 - CONFIGURE TO MATCH JUMPER CABLES
 #define SOLAR0_EN false
 #define SOLAR1_EN false
@@ -40,6 +47,8 @@
 #define DIO0 11
 
 //I2C
+#define I2C_BAUDRATE (400 * 1000)
+
 #define I2C_PORT_0 i2c0
 #define SDA_0 20
 #define SCL_0 21
@@ -49,12 +58,18 @@
 #define SCL_1 7
 
 //LORA -  ************** REMEMBER TO SET CALLSIGN AND LORA_TRANSMITTING BEFORE LAUNCH ***************
+// These and the SOLAR*_EN settings are defaults - config.txt on the SD card overrides them (see helpers/config.h)
 #define CALLSIGN "WSHABT"
 #define FREQUENCY 434.425
 #define LORA_MODE 1
 #define LORA_TRANSMITTING true
 #define ENABLE_PM false
 #define ENABLE_NO2 false
+#define ENABLE_MUON false
+// Analog boards give a peak voltage on the ADC, discriminator boards give a digital pulse
+#define MUON_MODE_ANALOG 0
+#define MUON_MODE_PULSE 1
+#define MUON_MODE MUON_MODE_ANALOG
 
 //GPS UART
 #define GPS_TX 4
@@ -72,19 +87,22 @@
 //MUON GPIO (ADC 2)
 #define U_PIN 28
 
+// In pulse mode pin 28 is the discriminator's digital output, so there is no Solar 2 and ADC 2 is not sampled
+#define SOLAR2_EN (!ENABLE_MUON || (MUON_MODE != MUON_MODE_PULSE))
+
 // CUTDOWN GPIO
 #define CUT_PIN 9
 
 // BUZZER GPIO
 #define BZ_PIN 2
 
-//Mutex
-static mutex_t mtx;
-static mutex_t mtx_adc;
+//Mutex - guards the state, and is shared by both cores
+extern struct TProfiledMutex mtx;
 
 
 typedef enum {fmIdle, fmLaunched, fmDescending, fmLanding, fmLanded} TFlightMode;
-static struct STATE
+typedef enum {asNone, asGPS, asBaro} TAltitudeSource;
+struct STATE
 {
     // Current state of the payload
     // READING AND WRITING OPERATIONS MUST BE MUTEX'd TO REMAIN THREADSAFE
@@ -92,12 +110,17 @@ static struct STATE
 	long SecondsInDay;					// Time in seconds since midnight.  Used for APRS timing, and LoRa timing in TDM mode
 	int Hours, Minutes, Seconds;
 	float Longitude, Latitude;
-	long Altitude, MinimumAltitude, MaximumAltitude, PreviousAltitude;
+	long Altitude, MinimumAltitude, MaximumAltitude, PreviousAltitude;	// Altitude is from the best available source
+	long GPSAltitude, BaroAltitude;
+	TAltitudeSource AltitudeSource;
 	unsigned int Satellites;
 	int Speed;
 	int Direction;
 	float AscentRate;
-	float BatteryVoltage;
+	float BatteryVoltage;				// VSYS
+	float BatteryRemaining;				// Fraction of the battery energy left, from the energy used so far
+	float Endurance;					// Hours left at the recent average power
+	bool LowBattery;
 	float InternalTemperature;
 
 	//BME280 states
@@ -107,6 +130,7 @@ static struct STATE
 
 	//TMP117 states
 	float TMP117Temperature;
+	bool TMP117Valid;					// False until the first reading, and while the sensor is failing
 	
 	//AHT20 states
 	float AHT20Temperature;
@@ -122,11 +146,13 @@ static struct STATE
 	float PM10;
 	float PMSamplePeriod;
 	float PMFlowRate;
+	float PMNumberConcentration;		// Per ml over the last telemetry interval
+	float PMVolumeConcentration;		// um^3 per ml over the last telemetry interval
 	float Solar0;
 	float Solar1;
 	float Solar2;
-	int muonCount;
-	float muonRate;
+	int muonCount;						// Pulses in the last muon interval
+	float muonRate;						// Pulses per second in the last muon interval
 	TFlightMode FlightMode;
 	float PredictedLongitude, PredictedLatitude;
 	float CDA;
@@ -135,7 +161,11 @@ static struct STATE
 	float PredictedLandingSpeed;
 	int GPSFlightMode = 0;
 	int HasCutDown = 0;
-} state;
+
+	// Statistics of each sampled field since the last telemetry sentence
+	struct TStat Stats[NUM_STATS];
+};
+extern struct STATE state;
 
 
 
@@ -143,16 +173,22 @@ void core_entry();
 void check_LED(struct STATE *s);
 void check_BUZZER(struct STATE *s);
 void fix_LED();
-void check_BME(struct STATE *s);
-void check_AHT20(struct STATE *s);
-void check_TMP117(struct STATE *s);
+void check_SENSORS(struct STATE *s);
 void check_GPS(struct STATE *s);
 void check_NO2(struct STATE *s);
 void check_LORA(struct STATE *s);
 void check_CUTDOWN(struct STATE *s);
 void check_SOLAR(struct STATE *s);
 void check_PM(struct STATE *s);
+void check_MUON(struct STATE *s);
 void check_internalTemps(struct STATE *s);
-void writeStateToMem(struct STATE * s);
+void check_POWER(struct STATE *s);
+void check_LOCKS();
+void check_CONSOLE();
+void check_LOG();
+void check_MEMORY(struct STATE *s);
+void check_RESUME(struct STATE *s);
+void count_boot();
+void low_battery(struct STATE *s);
 
 #endif
\ No newline at end of file
@@ -5,9 +5,23 @@
 
 void debug(const char * msg) {
     //Debugging
-    if (DEBUG) {
-        printf(msg);
-    }
+    LOG_DEBUG("%s", msg);
+}
+
+uint32_t crc32(const uint8_t *data, size_t len)
+{
+	// CRC-32 as used by zip and PNG
+	uint32_t crc = 0xFFFFFFFF;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		crc ^= data[i];
+		for (int j = 0; j < 8; j++)
+		{
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
 }
 
 char Hex(char Character)
@@ -1,7 +1,11 @@
 #ifndef MISC_H
 #define MISC_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 void debug (const char* msg);
 char Hex(char Character);
+uint32_t crc32(const uint8_t *data, size_t len);
 
 #endif
\ No newline at end of file
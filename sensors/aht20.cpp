@@ -1,91 +1,142 @@
 #include <stdio.h>
 #include "pico/stdlib.h"
 #include "hardware/i2c.h"
-#include "AHT20.h"
+#include "../helpers/frame.h"
+#include "aht20.h"
 #include "../main.h"
 #include "../misc.h"
 
-//#define I2C_PORT_0 i2c0
-
-static float tempReading = 0;
-static float humReading = 0;
-static const int addr = 0x38;  // I2C address of the AHT20 sensor
-static int DeviceAddress = 0;
-
-// Forward declarations
-static bool checkCalibration();
+static const uint8_t AHT20_ADDRESSES[] = {0x38};  // I2C address of the AHT20 sensor
+
+// Measurement frame - status, then 20 bit humidity and temperature sharing byte 3, then a CRC of all that
+struct AHT20Frame {
+    typedef LEField<uint8_t, 0> Status;
+    typedef BEBits<uint32_t, 1, 3, 4, 20> Humidity;
+    typedef BEBits<uint32_t, 3, 3, 0, 20> Temperature;
+    typedef LEField<uint8_t, 6> CRC;
+    static const size_t size = CRC::end;
+};
+
+#define AHT20_STATUS_BUSY 0x80
+#define AHT20_STATUS_CALIBRATED 0x08
+
+AHT20Sensor::AHT20Sensor() : SensorDriver("AHT20", AHT20_ADDRESSES, 1, 1000) {
+    temperature = 0;
+    humidity = 0;
+    measuring = false;
+    busy_polls = 0;
+    check_calibration = true;
+}
 
+bool AHT20Sensor::probe() {
+    // The AHT20 has no ID register, so accept anything that returns a status byte
+    uint8_t status;
+    return read(&status, 1);
+}
 
-// Initialize the sensor (send initialization command to sensor)
-int initAHT20() {
+// Make sure the sensor is calibrated, initialising it if not
+bool AHT20Sensor::start() {
+    measuring = false;
 
-    int bytes_transferred;
-    uint8_t rxdata;
+    if (!calibrated()) {
+        uint8_t reg[3] = {0xBE, 0x08, 0x00};
 
-    if (i2c_read_blocking(I2C_PORT_0, DeviceAddress = addr, &rxdata, 1, false) <= 0)
-	{
-        printf("FAIL (No Device)\n");
-        DeviceAddress = 0;
-		
-	}
+        if (!write(reg, 3)) {
+            return false;
+        }
+        sleep_ms(10);   // Only at start up or after an error
 
-    uint8_t reg[3] = {0xBE, 0x08, 0x00};
+        if (!calibrated()) {
+            LOG_WARN("<!> AHT20 would not calibrate\n");
+            return false;
+        }
+    }
 
-    i2c_write_blocking(I2C_PORT_0, DeviceAddress, reg, 3, false);
-    
-    return 0;
+    check_calibration = false;
+    return true;
 }
 
 // Check if the sensor is calibrated (based on a status register bit)
-static bool checkCalibration() {
+bool AHT20Sensor::calibrated() {
     uint8_t statusReg = 0x71;
-    uint8_t cal;  // Calibration result byte
-    i2c_write_blocking(I2C_PORT_0, DeviceAddress, &statusReg, 1, false);
-    i2c_read_blocking(I2C_PORT_0, DeviceAddress, &cal, 1, false);
+    uint8_t status;
+    if (!write(&statusReg, 1) || !read(&status, 1)) {
+        return false;
+    }
+
+    return (status & AHT20_STATUS_CALIBRATED) != 0;
+}
+
+static uint8_t crc8(const uint8_t *data, int len) {
+    // CRC-8, polynomial x^8 + x^5 + x^4 + 1, initial value 0xFF
+    uint8_t crc = 0xFF;
 
-    return ((cal >> 4) & 1) == 1;  // Check if the 4th bit is equal to 1
+    for (int i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : crc << 1;
+        }
+    }
+    return crc;
 }
 
-// Trigger a measurement on the sensor
-void readAHT20(struct STATE *s) {
-    // Ensure sensor is calibrated before proceeding
-    while (!checkCalibration()) {
-        initAHT20();
+TPollResult AHT20Sensor::poll() {
+    if (!measuring) {
+        // Calibration is only checked again after something has gone wrong
+        if (check_calibration && !start()) {
+            return prFailed;
+        }
+
+        // Trigger measurement, and come back for it when it should be done
+        uint8_t measureCommand[3] = {0xAC, 0x33, 0x00};
+
+        if (!write(measureCommand, 3)) {
+            check_calibration = true;
+            return prFailed;
+        }
+
+        measuring = true;
+        busy_polls = 0;
+        collect_after_ms(80);
+        return prPending;
     }
 
-    uint8_t measureCommand[3] = {0xAC, 0x33, 0x00};
-    uint8_t status;  // Result status byte
-    uint8_t data[6];  // Data array to store readings
+    uint8_t data[AHT20Frame::size];  // Data array to store readings
 
-    // Trigger measurement
-    i2c_write_blocking(I2C_PORT_0, DeviceAddress, measureCommand, 3, false);
-    sleep_ms(80);  // Wait for measurement
+    if (!read(data, AHT20Frame::size)) {
+        measuring = false;
+        check_calibration = true;
+        return prFailed;
+    }
 
-    // Read status byte to check measurement completion
-    i2c_read_blocking(I2C_PORT_0, DeviceAddress, &status, 1, false);
-    while (((status >> 8) & 1) != 0) {
-        i2c_read_blocking(I2C_PORT_0, DeviceAddress, &status, 1, false);
+    if (AHT20Frame::Status::get(data) & AHT20_STATUS_BUSY) {
+        if (++busy_polls > AHT20_MAX_BUSY_POLLS) {
+            measuring = false;
+            check_calibration = true;
+            return prFailed;
+        }
+        collect_after_ms(10);
+        return prPending;
     }
+    measuring = false;
 
-    // Read measurement data
-    i2c_read_blocking(I2C_PORT_0, DeviceAddress, data, 6, false);
+    if (crc8(data, AHT20Frame::CRC::end - 1) != AHT20Frame::CRC::get(data)) {
+        errors++;
+        check_calibration = true;
+        return prFailed;
+    }
 
     // Convert data to meaningful readings (humidity and temperature)
-    uint32_t humidity = data[1];
-    humidity <<= 8;
-    humidity |= data[2];
-    humidity <<= 4;
-    humidity |= data[3] >> 4;
-    humReading = ((float)humidity * 100) / 1048576;
-
-    uint32_t temp = data[3] & 0x0F;
-    temp <<= 8;
-    temp |= data[4];
-    temp <<= 8;
-    temp |= data[5];
-    tempReading = ((float)temp * 200 / 1048576) - 50;
+    humidity = ((float)AHT20Frame::Humidity::get(data) * 100) / 1048576;
+    temperature = ((float)AHT20Frame::Temperature::get(data) * 200 / 1048576) - 50;
+    return prDone;
+}
 
+void AHT20Sensor::publish(struct STATE *s) {
     // Store the readings in the STATE struct
-    s->AHT20Temperature = tempReading;
-    s->AHT20Humidity = humReading;
+    s->AHT20Temperature = temperature;
+    s->AHT20Humidity = humidity;
+
+    stats_sample(s, stAHT20Temperature, temperature);
+    stats_sample(s, stAHT20Humidity, humidity);
 }
@@ -1,7 +1,26 @@
 #ifndef AHT20_INCLUDED
 #define AHT20_INCLUDED
 
-void readAHT20(struct STATE *s);  // Read the sensor values and store them in the STATE struct
-int initAHT20();            //Initialises the sensor
+#include "../helpers/sensor.h"
 
-#endif // AHT20_INCLUDED
\ No newline at end of file
+// Busy polls, 10 ms apart, after the 80 ms measurement time before the reading is abandoned
+#define AHT20_MAX_BUSY_POLLS 5
+
+class AHT20Sensor : public SensorDriver {
+
+    float temperature, humidity;
+    bool measuring;
+    int busy_polls;
+    bool check_calibration;
+
+    bool calibrated();
+
+    public:
+        AHT20Sensor();
+        bool probe();
+        bool start();               // Calibrates the sensor if it needs it
+        TPollResult poll();         // Trigger a measurement, then collect it
+        void publish(struct STATE *s);
+};
+
+#endif // AHT20_INCLUDED
@@ -4,45 +4,47 @@
 #include "hardware/i2c.h"
 #include "../main.h"
 #include "../misc.h"
+#include "../helpers/frame.h"
 #include "bme.h"
 
 
+// We check on both address 0x76 and 0x77
+static const uint8_t BME280_ADDRESSES[] = {0x76, 0x77};
 
-static int DeviceAddress = 0;	// We check on both address 0x76 and 0x77     
-
-int32_t t_fine;
-
-uint16_t dig_T1;
-int16_t dig_T2, dig_T3;
-uint16_t dig_P1;
-int16_t dig_P2, dig_P3, dig_P4, dig_P5, dig_P6, dig_P7, dig_P8, dig_P9;
-uint8_t dig_H1, dig_H3;
-int8_t dig_H6;
-int16_t dig_H2, dig_H4, dig_H5;
+// Settings for each flight phase - oversampling is the register value (1 = x1, 2 = x2, 3 = x4, 4 = x8, 5 = x16)
+// The IIR filter smooths out pressure changes from wind and the payload swinging, but lags real changes
+static const struct TBME280Settings BME280_PHASE_SETTINGS[] = {
+    // osrs_t osrs_p osrs_h filter  period
+    {1,      1,     1,     0,      5000},     // spIdle - sitting on the ground
+    {2,      4,     1,     2,      1000},     // spAscent - IIR x4
+    {2,      5,     2,     3,      250},      // spNearBurst - IIR x8, to catch the burst
+    {2,      5,     2,     2,      250},      // spDescent - IIR x4, changing fast
+    {1,      1,     1,     0,      60000}     // spLanded
+};
 
 /* The following compensation functions are required to convert from the raw ADC
 data from the chip to something usable. Each chip has a different set of
 compensation parameters stored on the chip at point of manufacture, which are
 read from the chip at startup and used inthese routines.
 */
-int32_t compensate_temp(int32_t adc_T) {
+int32_t BME280Sensor::compensate_temp(int32_t adc_T) {
     int32_t var1, var2, T;
-    var1 = ((((adc_T>>3) - ((int32_t)dig_T1<<1))) * ((int32_t)dig_T2)) >> 11;
-    var2 = (((((adc_T>>4) - ((int32_t)dig_T1)) * ((adc_T>>4) - ((int32_t)dig_T1))) >> 12) * ((int32_t)dig_T3)) >> 14;
+    var1 = ((((adc_T>>3) - ((int32_t)cal.dig_T1<<1))) * ((int32_t)cal.dig_T2)) >> 11;
+    var2 = (((((adc_T>>4) - ((int32_t)cal.dig_T1)) * ((adc_T>>4) - ((int32_t)cal.dig_T1))) >> 12) * ((int32_t)cal.dig_T3)) >> 14;
 
     t_fine = var1 + var2;
     T =(t_fine*5+128)>>8;
     return T;
 }
 
-uint32_t compensate_pressure(int32_t adc_P) {
+uint32_t BME280Sensor::compensate_pressure(int32_t adc_P) {
     int32_t var1, var2;
     uint32_t p;
     var1 = (((int32_t)t_fine)>>1) - (int32_t)64000;
-    var2 = (((var1>>2) * (var1>>2)) >> 11 ) * ((int32_t)dig_P6);
-    var2 = var2 + ((var1*((int32_t)dig_P5))<<1);
-    var2 = (var2>>2)+(((int32_t)dig_P4)<<16);
-    var1 = (((dig_P3 * (((var1>>2) * (var1>>2)) >> 13 )) >> 3) + ((((int32_t)dig_P2) * var1)>>1))>>18; var1 =((((32768+var1))*((int32_t)dig_P1))>>15);
+    var2 = (((var1>>2) * (var1>>2)) >> 11 ) * ((int32_t)cal.dig_P6);
+    var2 = var2 + ((var1*((int32_t)cal.dig_P5))<<1);
+    var2 = (var2>>2)+(((int32_t)cal.dig_P4)<<16);
+    var1 = (((cal.dig_P3 * (((var1>>2) * (var1>>2)) >> 13 )) >> 3) + ((((int32_t)cal.dig_P2) * var1)>>1))>>18; var1 =((((32768+var1))*((int32_t)cal.dig_P1))>>15);
     if (var1 == 0)
         return 0;
 
@@ -52,144 +54,220 @@ uint32_t compensate_pressure(int32_t adc_P) {
     else
         p = (p / (uint32_t)var1) * 2;
 
-    var1 = (((int32_t)dig_P9) * ((int32_t)(((p>>3) * (p>>3))>>13)))>>12; var2 = (((int32_t)(p>>2)) * ((int32_t)dig_P8))>>13;
-    p = (uint32_t)((int32_t)p + ((var1 + var2 + dig_P7) >> 4));
+    var1 = (((int32_t)cal.dig_P9) * ((int32_t)(((p>>3) * (p>>3))>>13)))>>12; var2 = (((int32_t)(p>>2)) * ((int32_t)cal.dig_P8))>>13;
+    p = (uint32_t)((int32_t)p + ((var1 + var2 + cal.dig_P7) >> 4));
 
     return p;
 }
 
-uint32_t compensate_humidity(int32_t adc_H) {
+uint32_t BME280Sensor::compensate_humidity(int32_t adc_H) {
     int32_t v_x1_u32r;
     v_x1_u32r = (t_fine - ((int32_t)76800));
-    v_x1_u32r = (((((adc_H << 14) - (((int32_t)dig_H4) << 20) - (((int32_t)dig_H5) * v_x1_u32r)) +
-                ((int32_t)16384)) >> 15) * (((((((v_x1_u32r * ((int32_t)dig_H6)) >> 10) * (((v_x1_u32r *
-                ((int32_t)dig_H3)) >> 11) + ((int32_t)32768))) >> 10) + ((int32_t)2097152)) *
-                ((int32_t)dig_H2) + 8192) >> 14));
-    v_x1_u32r = (v_x1_u32r - (((((v_x1_u32r >> 15) * (v_x1_u32r >> 15)) >> 7) * ((int32_t)dig_H1)) >> 4));
+    v_x1_u32r = (((((adc_H << 14) - (((int32_t)cal.dig_H4) << 20) - (((int32_t)cal.dig_H5) * v_x1_u32r)) +
+                ((int32_t)16384)) >> 15) * (((((((v_x1_u32r * ((int32_t)cal.dig_H6)) >> 10) * (((v_x1_u32r *
+                ((int32_t)cal.dig_H3)) >> 11) + ((int32_t)32768))) >> 10) + ((int32_t)2097152)) *
+                ((int32_t)cal.dig_H2) + 8192) >> 14));
+    v_x1_u32r = (v_x1_u32r - (((((v_x1_u32r >> 15) * (v_x1_u32r >> 15)) >> 7) * ((int32_t)cal.dig_H1)) >> 4));
     v_x1_u32r = (v_x1_u32r < 0 ? 0 : v_x1_u32r);
     v_x1_u32r = (v_x1_u32r > 419430400 ? 419430400 : v_x1_u32r);
 
     return (uint32_t)(v_x1_u32r >> 12);
 }
 
-static void write_register(uint8_t reg, uint8_t data)
-{
-	uint8_t buffer[2];
-	
-	buffer[0] = reg;
-	buffer[1] = data;
-	
-	i2c_write_blocking(I2C_PORT_0, DeviceAddress, buffer, 2, false);
+BME280Sensor::BME280Sensor() : SensorDriver("BME280", BME280_ADDRESSES, 2, 500) {
+    temperature = 0;
+    pressure = 0;
+    humidity = 0;
+    t_fine = 0;
+    measuring = false;
+    busy_polls = 0;
+    settings = &BME280_PHASE_SETTINGS[spIdle];
 }
 
-static void read_registers(uint8_t reg, uint8_t *buffer, uint16_t len)
-{
-	
-    i2c_write_blocking(I2C_PORT_0, DeviceAddress, &reg, 1, true); // true to keep master control of bus
-    i2c_read_blocking(I2C_PORT_0, DeviceAddress, buffer, len, false);
-}
+// Calibration block at 0x88
+struct BME280CalibrationFrame {
+    typedef LEField<uint16_t, 0> T1;
+    typedef LEField<int16_t, 2> T2;
+    typedef LEField<int16_t, 4> T3;
+    typedef LEField<uint16_t, 6> P1;
+    typedef LEField<int16_t, 8> P2;
+    typedef LEField<int16_t, 10> P3;
+    typedef LEField<int16_t, 12> P4;
+    typedef LEField<int16_t, 14> P5;
+    typedef LEField<int16_t, 16> P6;
+    typedef LEField<int16_t, 18> P7;
+    typedef LEField<int16_t, 20> P8;
+    typedef LEField<int16_t, 22> P9;
+    typedef LEField<uint8_t, 25> H1;
+    static const size_t size = H1::end;
+};
+
+// Humidity calibration block at 0xE1 - H4 and H5 share 0xE5
+struct BME280HumidityFrame {
+    typedef LEField<int16_t, 0> H2;
+    typedef LEField<uint8_t, 2> H3;
+    typedef JoinedField<int16_t, LEField<int8_t, 3>, LEBits<uint8_t, 4, 1, 0, 4>, 4> H4;
+    typedef LEBits<int16_t, 4, 2, 4, 12> H5;
+    typedef LEField<int8_t, 6> H6;
+    static const size_t size = H6::end;
+};
+
+// Measurement registers from 0xF7, 20 bit pressure and temperature, 16 bit humidity, all MSB first
+struct BME280DataFrame {
+    typedef BEBits<uint32_t, 0, 3, 4, 20> Pressure;
+    typedef BEBits<uint32_t, 3, 3, 4, 20> Temperature;
+    typedef BEBits<uint32_t, 6, 2, 0, 16> Humidity;
+    static const size_t size = Humidity::end;
+};
 
 /* This function reads the manufacturing assigned compensation parameters from the device */
-void read_compensation_parameters()
+bool BME280Sensor::read_compensation_parameters()
 {
-    uint8_t buffer[26];
-
-    read_registers(0x88, buffer, 24);
-
-    dig_T1 = buffer[0] | (buffer[1] << 8);
-    dig_T2 = buffer[2] | (buffer[3] << 8);
-    dig_T3 = buffer[4] | (buffer[5] << 8);
+    typedef BME280CalibrationFrame C;
+    typedef BME280HumidityFrame H;
+    uint8_t buffer[C::size];
+
+    if (!read_registers(0x88, buffer, C::size)) {
+        return false;
+    }
+
+    cal.dig_T1 = C::T1::get(buffer);
+    cal.dig_T2 = C::T2::get(buffer);
+    cal.dig_T3 = C::T3::get(buffer);
+
+    cal.dig_P1 = C::P1::get(buffer);
+    cal.dig_P2 = C::P2::get(buffer);
+    cal.dig_P3 = C::P3::get(buffer);
+    cal.dig_P4 = C::P4::get(buffer);
+    cal.dig_P5 = C::P5::get(buffer);
+    cal.dig_P6 = C::P6::get(buffer);
+    cal.dig_P7 = C::P7::get(buffer);
+    cal.dig_P8 = C::P8::get(buffer);
+    cal.dig_P9 = C::P9::get(buffer);
+
+    cal.dig_H1 = C::H1::get(buffer);
+
+    if (!read_registers(0xE1, buffer, H::size)) {
+        return false;
+    }
+
+    cal.dig_H2 = H::H2::get(buffer);
+    cal.dig_H3 = H::H3::get(buffer);
+    cal.dig_H4 = H::H4::get(buffer);
+    cal.dig_H5 = H::H5::get(buffer);
+    cal.dig_H6 = H::H6::get(buffer);
+    return true;
+}
 
-    dig_P1 = buffer[6] | (buffer[7] << 8);
-    dig_P2 = buffer[8] | (buffer[9] << 8);
-    dig_P3 = buffer[10] | (buffer[11] << 8);
-    dig_P4 = buffer[12] | (buffer[13] << 8);
-    dig_P5 = buffer[14] | (buffer[15] << 8);
-    dig_P6 = buffer[16] | (buffer[17] << 8);
-    dig_P7 = buffer[18] | (buffer[19] << 8);
-    dig_P8 = buffer[20] | (buffer[21] << 8);
-    dig_P9 = buffer[22] | (buffer[23] << 8);
+bool BME280Sensor::probe()
+{
+	// Interrogate the device for its I2C ID number, should be 0x60
+	uint8_t id;
 
-    dig_H1 = buffer[25];
+	if (!read_registers(0xD0, &id, 1)) {
+		return false;
+	}
 
-    read_registers(0xE1, buffer, 8);
+	if (id != 0x60) {
+		// Wrong type of device
+		LOG_INFO("> Device at 0x%02x is not a BME280 (id 0x%02x)\n", address, id);
+		return false;
+	}
+	return true;
+}
 
-    dig_H2 = buffer[0] | (buffer[1] << 8);
-    dig_H3 = (int8_t)buffer[2];
-    dig_H4 = buffer[3] << 4 | (buffer[4] & 0xf);
-    dig_H5 = (buffer[5] >> 4) | (buffer[6] << 4);
-    dig_H6 = (int8_t)buffer[7];
+bool BME280Sensor::start()
+{
+	// Forced mode - the BME280 sleeps between the conversions poll() asks for
+	measuring = false;
+	return read_compensation_parameters() &&
+		write_register(0xF4, 0x00);		// Sleep, so the config register can be written
 }
 
-static void bme280_read_raw(int32_t *humidity, int32_t *pressure, int32_t *temperature) {
-    uint8_t buffer[8];
+bool BME280Sensor::configure(TSensorPhase phase)
+{
+	settings = &BME280_PHASE_SETTINGS[phase];
+	repeater.set_delay(settings->period_ms);
+
+	// The config register may be ignored unless the chip is asleep, and a conversion started with the old settings
+	// would be collected on the wrong delay - so drop it, and the next poll starts again
+	if (measuring) {
+		measuring = false;
+		if (!write_register(0xF4, 0x00)) {
+			return false;
+		}
+	}
 
-    read_registers(0xF7, buffer, 8);
-    *pressure = ((uint32_t)buffer[0] << 12) | ((uint32_t)buffer[1] << 4) | (buffer[2] >> 4);
-    *temperature = ((uint32_t)buffer[3] << 12) | ((uint32_t)buffer[4] << 4) | (buffer[5] >> 4);
-    *humidity = (uint32_t)buffer[6] << 8 | buffer[7];
+	// Changes to ctrl_hum only take effect on the next write to ctrl_meas, which every conversion does
+	return write_register(0xF5, settings->filter << 2) &&
+		write_register(0xF2, settings->osrs_h);
 }
 
+static uint32_t oversampling(uint8_t osrs) {
+	return osrs ? 1 << (osrs - 1) : 0;
+}
 
-int initBME280()
+TPollResult BME280Sensor::poll()
 {
-	int bytes_transferred;
-	uint8_t rxdata;
-	
-    if (i2c_read_blocking(I2C_PORT_0, DeviceAddress = 0x76, &rxdata, 1, false) <= 0)
-	{
-        printf("FAIL (1st attempt failed)");
-		if (i2c_read_blocking(I2C_PORT_0, DeviceAddress = 0x77, &rxdata, 1, false) <= 0) //changed to 0x77
-		{
-			printf("FAIL (No Device)\n");
-			DeviceAddress = 0;
+	if (!measuring) {
+		// Start a conversion and come back when it should be done - maximum times from the datasheet
+		if (!write_register(0xF4, (settings->osrs_t << 5) | (settings->osrs_p << 2) | 0x01)) {
+			return prFailed;
 		}
-	}
 
-	if (DeviceAddress > 0)
-	{
-		// Interrogate the device for its I2C ID number, should be 0x60
-		uint8_t id;
+		uint32_t time_us = 1250 + 2300 * oversampling(settings->osrs_t) +
+						   2300 * oversampling(settings->osrs_p) + 575 +
+						   2300 * oversampling(settings->osrs_h) + 575;
 
-		read_registers(0xD0, &id, 1);
-		
-		if (id == 0x60)
-		{
-			
-			read_compensation_parameters();
+		measuring = true;
+		busy_polls = 0;
+		collect_after_ms((time_us + 999) / 1000);
+		return prPending;
+	}
 
-			write_register(0xF2, 0x1); // Humidity oversampling register - going for x1
-			write_register(0xF4, 0x27);// Set rest of oversampling modes and run mode to normal
-		}
-		else
-		{
-			// Wrong type of device
-			printf("FAIL (Wrong Device)\n");
-			DeviceAddress = 0;
+	// Status bit 3 is set while converting
+	uint8_t status;
+	if (!read_registers(0xF3, &status, 1)) {
+		measuring = false;
+		return prFailed;
+	}
+	if (status & 0x08) {
+		if (++busy_polls > BME280_MAX_BUSY_POLLS) {
+			measuring = false;
+			return prFailed;
 		}
+		collect_after_ms(1);
+		return prPending;
 	}
-    return 1;
+	measuring = false;
+
+	uint8_t buffer[BME280DataFrame::size];
+
+	if (!read_registers(0xF7, buffer, BME280DataFrame::size)) {
+		return prFailed;
+	}
+
+	int32_t raw_pressure = BME280DataFrame::Pressure::get(buffer);
+	int32_t raw_temperature = BME280DataFrame::Temperature::get(buffer);
+	int32_t raw_humidity = BME280DataFrame::Humidity::get(buffer);
+
+	// These are the raw numbers from the chip, so we need to run through the
+	// compensations to get human understandable numbers
+	// Temperature first, as it sets t_fine for the other two
+	temperature = compensate_temp(raw_temperature) / 100.0;
+	pressure = compensate_pressure(raw_pressure);
+	humidity = compensate_humidity(raw_humidity) / 1024.0;
+	//printf("> (0) Temp: %.2f | Pres: %.0f | Humi: %.2f\n", temperature, pressure, humidity);
+	return prDone;
 }
 
-void readBME(struct STATE *state)
+void BME280Sensor::publish(struct STATE *state)
 {
-	if (DeviceAddress > 0)
-	{
-			int32_t humidity, pressure, temperature;
-
-			bme280_read_raw(&humidity, &pressure, &temperature);
-
-			// These are the raw numbers from the chip, so we need to run through the
-			// compensations to get human understandable numbers
-			pressure = compensate_pressure(pressure);
-			temperature = compensate_temp(temperature);
-			humidity = compensate_humidity(humidity);
-            //printf("> (0) Temp: %.2f | Pres: %u | Humi: %.2f\n", temperature/100.0, pressure, humidity/1024.0);
-            
-			state->BMETemperature = temperature / 100.0;
-			state->BMEPressure = pressure;
-			state->BMEHumidity = humidity / 1024.0;
-            
-		
-	}
+	state->BMETemperature = temperature;
+	state->BMEPressure = pressure;
+	state->BMEHumidity = humidity;
+
+	stats_sample(state, stBMETemperature, temperature);
+	stats_sample(state, stBMEPressure, pressure);
+	stats_sample(state, stBMEHumidity, humidity);
 }
@@ -1,6 +1,49 @@
 #ifndef BMP_INCLUDED
 #define BMP_INCLUDED
 
-int initBME280();
-void readBME(struct STATE *s);
-#endif
\ No newline at end of file
+#include "../helpers/sensor.h"
+
+// Conversions are never longer than the datasheet maximum, so this is just a margin for a slow device
+#define BME280_MAX_BUSY_POLLS 10
+
+// Compensation parameters, different for every chip
+struct TBME280Calibration {
+    uint16_t dig_T1;
+    int16_t dig_T2, dig_T3;
+    uint16_t dig_P1;
+    int16_t dig_P2, dig_P3, dig_P4, dig_P5, dig_P6, dig_P7, dig_P8, dig_P9;
+    uint8_t dig_H1, dig_H3;
+    int8_t dig_H6;
+    int16_t dig_H2, dig_H4, dig_H5;
+};
+
+struct TBME280Settings {
+    uint8_t osrs_t, osrs_p, osrs_h;     // Oversampling register values
+    uint8_t filter;                     // IIR filter register value
+    uint32_t period_ms;
+};
+
+class BME280Sensor : public SensorDriver {
+
+    float temperature, pressure, humidity;
+    struct TBME280Calibration cal;
+    int32_t t_fine;
+    const struct TBME280Settings *settings;
+    bool measuring;
+    int busy_polls;
+
+    bool read_compensation_parameters();
+    int32_t compensate_temp(int32_t adc_T);
+    uint32_t compensate_pressure(int32_t adc_P);
+    uint32_t compensate_humidity(int32_t adc_H);
+
+    public:
+        BME280Sensor();
+        bool probe();
+        bool start();
+        bool configure(TSensorPhase phase);
+        TPollResult poll();
+        void publish(struct STATE *s);
+};
+
+#endif
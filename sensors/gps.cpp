@@ -8,6 +8,7 @@
 
 #include "../misc.h"
 #include "../main.h"
+#include "../altitude.h"
 #include "gps.h"
 
 #define LANDING_ALTITUDE    100
@@ -111,10 +112,13 @@ void ProcessLine(struct STATE *state, unsigned char *b, int Count)
 					if (ns == 'S') state->Latitude = -state->Latitude;
 					state->Longitude = FixPosition(longitude);
 					if (ew == 'W') state->Longitude = -state->Longitude;
-					state->Altitude = altitude;
+					altitude_gps_fix(state, altitude);
 				}
 
 				state->Satellites = satellites;
+
+				// Falls back to barometric altitude if there is no fix
+				altitude_update(state);
 				
 				
 				if (state->Altitude > state->MaximumAltitude)
@@ -131,21 +135,21 @@ void ProcessLine(struct STATE *state, unsigned char *b, int Count)
 				if ((state->AscentRate >= 1.0) && (state->Altitude > (state->MinimumAltitude+150)) && (state->FlightMode == fmIdle))
 				{
 					state->FlightMode = fmLaunched;
-					printf("*** LAUNCHED ***\n");
+					LOG_INFO("*** LAUNCHED ***\n");
 				}
 
 				// Burst?
 				if ((state->AscentRate < -10.0) && (state->Altitude < (state->MaximumAltitude+50)) && (state->MaximumAltitude >= (state->MinimumAltitude+2000)) && (state->FlightMode == fmLaunched))
 				{
 					state->FlightMode = fmDescending;
-					printf("*** DESCENDING ***\n");
+					LOG_INFO("*** DESCENDING ***\n");
 				}
 
 				// Landed?
 				if ((state->AscentRate >= -0.1) && (state->Altitude <= LANDING_ALTITUDE+2000) && (state->FlightMode >= fmDescending) && (state->FlightMode < fmLanded))
 				{
 					state->FlightMode = fmLanded;
-					printf("*** LANDED ***\n");
+					LOG_INFO("*** LANDED ***\n");
 				}      
 			}
 		}
@@ -167,46 +171,46 @@ void ProcessLine(struct STATE *state, unsigned char *b, int Count)
 		else if (strncmp(Buffer+3, "GSV", 3) == 0)
         {
             // Disable GSV
-            printf("Disabling GSV\r\n");
+            LOG_DEBUG("Disabling GSV\r\n");
             unsigned char setGSV[] = { 0xB5, 0x62, 0x06, 0x01, 0x08, 0x00, 0xF0, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x03, 0x39 };
             SendUBX(setGSV, sizeof(setGSV));
         }
 		else if (strncmp(Buffer+3, "GLL", 3) == 0)
         {
             // Disable GLL
-            printf("Disabling GLL\r\n");
+            LOG_DEBUG("Disabling GLL\r\n");
             unsigned char setGLL[] = { 0xB5, 0x62, 0x06, 0x01, 0x08, 0x00, 0xF0, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x2B };
             SendUBX(setGLL, sizeof(setGLL));
         }
 		else if (strncmp(Buffer+3, "GSA", 3) == 0)
         {
             // Disable GSA
-            printf("Disabling GSA\r\n");
+            LOG_DEBUG("Disabling GSA\r\n");
             unsigned char setGSA[] = { 0xB5, 0x62, 0x06, 0x01, 0x08, 0x00, 0xF0, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x32 };
             SendUBX(setGSA, sizeof(setGSA));
         }
 		else if (strncmp(Buffer+3, "VTG", 3) == 0)
         {
             // Disable VTG
-            printf("Disabling VTG\r\n");
+            LOG_DEBUG("Disabling VTG\r\n");
             unsigned char setVTG[] = {0xB5, 0x62, 0x06, 0x01, 0x08, 0x00, 0xF0, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x05, 0x47};
             SendUBX(setVTG, sizeof(setVTG));
         }
 		else if (strncmp(Buffer+3, "TXT", 3) == 0)
         {
 			if (strncmp(Buffer+7, "01,01,01,More than 100 frame errors, UART RX was disabled*70", 60) == 0) {
-				printf("<!> (0) GPS error... Wait for watchdog\n");
+				LOG_ERROR("<!> (0) GPS error... Wait for watchdog\n");
 				sleep_ms(5000);
 			}
 		}
         else
         {
-            printf("Unknown NMEA sentence: %s\n", Buffer);
+            LOG_DEBUG("Unknown NMEA sentence: %s\n", Buffer);
         }
     }
     else
     {
-       printf("Bad checksum\r\n");
+       LOG_DEBUG("Bad checksum\r\n");
 	}
 }
 
@@ -250,7 +254,7 @@ void readGPS(struct STATE *state)
 			if (Character == '\n')
 			{
 				Line[Length] = '\0';
-				printf("> (0) %s", Line);
+				LOG_DEBUG("> (0) %s", Line);
 				ProcessLine(state, Line, Length);
 				Length = 0;
 			}
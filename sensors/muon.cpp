@@ -2,23 +2,274 @@
 #include <string.h>
 #include "pico/stdlib.h"
 #include "hardware/adc.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/pio.h"
 #include "../main.h"
 #include "../misc.h"
+#include "../helpers/adc_service.h"
+#include "../helpers/sd.h"
 #include "muon.h"
+#include "muon_pulse.pio.h"
 
+// Muon detector
+// MUON_MODE_ANALOG: the ADC service samples the detector output continuously. processMuon() runs on core 1
+// and scans every new sample on ADC 2 for pulses, recording the peak of each. Peaks are converted to SiPM
+// voltage through a lookup table built from the calibration polynomial at boot, as evaluating it per pulse
+// in soft floating point would be far too slow.
+// MUON_MODE_PULSE: a PIO state machine timestamps every rising edge of the discriminator output and DMA
+// copies the timestamps into a ring, so no pulse costs any CPU time until the ring is read. The histogram
+// is then of the intervals between pulses rather than of their height.
+
+// Calibration polynomial, highest power first, from a 10 bit ADC reading to SiPM voltage in mV
 const long double cal[] = {-9.085681659276021e-27, 4.6790804314609205e-23, -1.0317125207013292e-19,
   1.2741066484319192e-16, -9.684460759517656e-14, 4.6937937442284284e-11, -1.4553498837275352e-08,
    2.8216624998078298e-06, -0.000323032620672037, 0.019538631135788468, -0.3774384056850066, 12.324891083404246};
 
 const int cal_max = 1023;
 
-void initMuon() {
+// Samples are skipped rather than misread if the ring is this close to being overwritten
+#define MUON_RING_MARGIN 256
+
+static float muon_lut[cal_max + 1];
+
+static uint32_t next_position = 0;      // Position in the ADC run of the next sample to scan
+static absolute_time_t last_scan;
+static bool scanning = false;
+
+static bool in_pulse = false;
+static uint16_t peak = 0;
+
+static uint32_t interval_count = 0;
+static uint32_t interval_scanned = 0;
+static uint32_t interval_lost = 0;
+static uint32_t histogram[MUON_HIST_BINS];
+static absolute_time_t interval_start;
+
+// Pulse mode
+static volatile uint32_t timestamps[MUON_RING_WORDS] __attribute__((aligned(1 << MUON_RING_BITS)));
+static int pulse_dma;
+static int pulse_sm = -1;
+static uint32_t pulse_read = 0;         // Timestamps taken from the ring so far
+static uint32_t last_timestamp;
+static bool has_timestamp = false;
+static uint32_t interval_coincidences = 0;
+static uint32_t interval_gaps = 0;
+static uint64_t interval_gap_sum = 0;
+static uint32_t interval_gap_min = 0xFFFFFFFF;
+
+
+static void init_analog() {
     adc_gpio_init(U_PIN);
+
+    for (int adc = 0; adc <= cal_max; adc++) {
+        long double voltage = 0;
+        for (unsigned int i = 0; i < sizeof(cal) / sizeof(cal[0]); i++) {
+            voltage = voltage * adc + cal[i];
+        }
+        muon_lut[adc] = voltage;
+    }
+}
+
+static void init_pulse() {
+    PIO pio = pio0;
+    uint offset = pio_add_program(pio, &muon_pulse_program);
+    uint sm = pio_claim_unused_sm(pio, true);
+
+    pulse_dma = dma_claim_unused_channel(true);
+    dma_channel_config c = dma_channel_get_default_config(pulse_dma);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_dreq(&c, pio_get_dreq(pio, sm, false));
+    channel_config_set_ring(&c, true, MUON_RING_BITS);
+    // One transfer per pulse, so this is good for 2^32 pulses
+    dma_channel_configure(pulse_dma, &c, timestamps, &pio->rxf[sm], 0xFFFFFFFF, true);
+
+    muon_pulse_program_init(pio, sm, offset, U_PIN);
+    pulse_sm = sm;
+    muonClockChanged();
+}
+
+void muonClockChanged() {
+    // Keep the PIO counter at MUON_PIO_HZ whatever clk_sys is doing
+    if (pulse_sm >= 0) {
+        pio_sm_set_clkdiv(pio0, pulse_sm, (float)clock_get_hz(clk_sys) / MUON_PIO_HZ);
+    }
+}
+
+void initMuon() {
+    if (MUON_MODE == MUON_MODE_PULSE) {
+        init_pulse();
+    } else {
+        init_analog();
+    }
+
+    interval_start = get_absolute_time();
+}
+
+static void add_to_histogram(uint32_t value) {
+    // Bin i holds values of 2^i to 2^(i+1)
+    int bin = 0;
+    while ((value > 1) && (bin < MUON_HIST_BINS - 1)) {
+        value >>= 1;
+        bin++;
+    }
+
+    histogram[bin]++;
+}
+
+static void record_pulse(uint16_t peak) {
+    // Calibration is for a 10 bit ADC
+    float mv = muon_lut[peak >> 2];
+
+    add_to_histogram(mv > 0 ? (uint32_t)mv : 0);
+    interval_count++;
+}
+
+static void process_analog() {
+    const volatile uint16_t *ring = adc_service_ring();
+    uint32_t run_length = adc_service_run_length();
+    uint32_t channels = adc_service_num_channels();
+    uint32_t slot = adc_service_slot(2);
+    uint32_t written = adc_service_run_position();
+    absolute_time_t now = get_absolute_time();
+
+    if (!scanning) {
+        next_position = written;
+        last_scan = now;
+        scanning = true;
+        return;
+    }
+
+    uint32_t available = (written + run_length - next_position) % run_length;
+    int64_t elapsed = absolute_time_diff_us(last_scan, now);
+    last_scan = now;
+
+    // If we have fallen too far behind the DMA, the oldest samples have already been overwritten
+    if ((available > ADC_RING_SAMPLES - MUON_RING_MARGIN) ||
+        (elapsed * (ADC_SAMPLE_RATE / 1000) / 1000 > ADC_RING_SAMPLES - MUON_RING_MARGIN)) {
+        interval_lost += available / channels;
+        next_position = written;
+        in_pulse = false;
+        return;
+    }
+
+    // First sample from our channel
+    uint32_t i = (slot + channels - next_position % channels) % channels;
+
+    for (; i < available; i += channels) {
+        uint16_t sample = ring[(next_position + i) % ADC_RING_SAMPLES];
+
+        if (in_pulse) {
+            if (sample > peak) {
+                peak = sample;
+            } else if (sample < RESET_THRESHOLD) {
+                record_pulse(peak);
+                in_pulse = false;
+            }
+        } else if (sample > SIGNAL_THRESHOLD) {
+            in_pulse = true;
+            peak = sample;
+        }
+    }
+
+    interval_scanned += available / channels;
+    next_position = (next_position + available) % run_length;
+}
+
+static void process_pulses() {
+    uint32_t written = 0xFFFFFFFF - dma_hw->ch[pulse_dma].transfer_count;
+    uint32_t ticks_per_us = MUON_PIO_HZ / 2 / 1000000;
+
+    // Any timestamps the DMA has lapped are lost, though we still know how many there were
+    if (written - pulse_read > MUON_RING_WORDS - 16) {
+        uint32_t skip = written - pulse_read - (MUON_RING_WORDS - 16);
+        interval_lost += skip;
+        pulse_read += skip;
+        has_timestamp = false;
+    }
+
+    while (pulse_read != written) {
+        uint32_t timestamp = timestamps[pulse_read % MUON_RING_WORDS];
+        pulse_read++;
+
+        if (has_timestamp) {
+            // The PIO counter runs down
+            uint32_t gap = last_timestamp - timestamp;
+
+            if (gap < MUON_COINCIDENCE_US * ticks_per_us) {
+                interval_coincidences++;
+            }
+            if (gap < interval_gap_min) {
+                interval_gap_min = gap;
+            }
+            interval_gap_sum += gap;
+            interval_gaps++;
+            add_to_histogram(gap / ticks_per_us / 1000);
+        }
+
+        last_timestamp = timestamp;
+        has_timestamp = true;
+        interval_count++;
+    }
+}
+
+void processMuon() {
+    if (MUON_MODE == MUON_MODE_PULSE) {
+        process_pulses();
+    } else {
+        process_analog();
+    }
 }
 
 void readMuon(struct STATE *state) {
-    adc_select_input(2);
-    uint16_t muonADC16bit = adc_read();
-    //printf("> (0) NO2 | rWV : %u | rAV : %u | WV : %.3f | AV : %.3f\n", workingVoltage, auxillaryVoltage, convWV, convAV);
-    
+    // Publish and log the interval that has just finished
+    absolute_time_t now = get_absolute_time();
+    float seconds = absolute_time_diff_us(interval_start, now) / 1000000.0f;
+    char log_string[256];
+    char *pos = log_string;
+
+    pos += sprintf(pos, "%02d:%02d:%02d", state->Hours, state->Minutes, state->Seconds);
+
+    if (MUON_MODE == MUON_MODE_PULSE) {
+        process_pulses();
+
+        // Lost pulses were still counted by the DMA, so they count towards the rate
+        uint32_t ticks_per_us = MUON_PIO_HZ / 2 / 1000000;
+        state->muonCount = interval_count + interval_lost;
+        state->muonRate = state->muonCount / seconds;
+
+        pos += sprintf(pos, ",%d,%.3f,%lu,%lu,%lu,%lu", state->muonCount, state->muonRate,
+                       (unsigned long)interval_lost, (unsigned long)interval_coincidences,
+                       (unsigned long)(interval_gaps ? interval_gap_min / ticks_per_us : 0),
+                       (unsigned long)(interval_gaps ? interval_gap_sum / interval_gaps / ticks_per_us : 0));
+    } else {
+        // Only the time we were actually looking counts towards the rate
+        float live = (interval_scanned + interval_lost) ? (float)interval_scanned / (interval_scanned + interval_lost) : 0;
+
+        state->muonCount = interval_count;
+        state->muonRate = (live > 0) ? interval_count / (seconds * live) : 0;
+
+        pos += sprintf(pos, ",%d,%.3f,%.3f", state->muonCount, state->muonRate, live);
+    }
+
+    for (int i = 0; i < MUON_HIST_BINS; i++) {
+        pos += sprintf(pos, ",%lu", (unsigned long)histogram[i]);
+    }
+    sprintf(pos, "\n");
+
+    char muon_filename[20];
+    sprintf(muon_filename, "muon_log%d.txt", sd_log_file(slMuon, 1));
+    logStringToSD(log_string, muon_filename);
+
+    interval_count = 0;
+    interval_scanned = 0;
+    interval_lost = 0;
+    interval_coincidences = 0;
+    interval_gaps = 0;
+    interval_gap_sum = 0;
+    interval_gap_min = 0xFFFFFFFF;
+    memset(histogram, 0, sizeof(histogram));
+    interval_start = now;
 }
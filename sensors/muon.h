@@ -1,10 +1,26 @@
 #ifndef MUON_INCLUDED
 #define MUON_INCLUDED
 
-#define SIGNAL_THRESHOLD = 30 * 8;
-#define RESET_THRESHOLD = 15 * 8;
+// Pulse thresholds in 12 bit ADC counts - a pulse starts above SIGNAL_THRESHOLD and ends below RESET_THRESHOLD
+#define SIGNAL_THRESHOLD (30 * 8)
+#define RESET_THRESHOLD (15 * 8)
+
+// Counts, rate and histogram are published and logged once per interval
+#define MUON_INTERVAL_MS 10000
+// Histogram bin i holds pulses with a peak SiPM voltage of 2^i to 2^(i+1) mV
+#define MUON_HIST_BINS 12
+
+// Pulse mode - ring of discriminator edge timestamps, in ticks of 2 PIO clocks
+// The PIO clock is divided down from clk_sys to this, which needs clk_sys to stay at or above it
+#define MUON_PIO_HZ 48000000
+#define MUON_RING_BITS 12
+#define MUON_RING_WORDS ((1 << MUON_RING_BITS) / 4)
+// Pulses closer together than this are counted as a coincidence
+#define MUON_COINCIDENCE_US 10
 
 void initMuon();
+void processMuon();
 void readMuon(struct STATE *state);
+void muonClockChanged();
 
-#endif
\ No newline at end of file
+#endif
@@ -4,36 +4,40 @@
 #include "hardware/adc.h"
 #include "../main.h"
 #include "../misc.h"
+#include "../helpers/adc_service.h"
 #include "no2.h"
 
 void initNO2() {
-    if (!SOLAR0_EN) {
+    if (!config.Solar0Enabled) {
         adc_gpio_init(B4WE);
     }
-    if (!SOLAR1_EN) {
+    if (!config.Solar1Enabled) {
         adc_gpio_init(B4AE);
     }
 }
 
 void readNO2(struct STATE *state) {
-    uint16_t workingVoltage = 0;
-    uint16_t auxillaryVoltage = 0;
+    float convWV = 0;
+    float convAV = 0;
 
     // Only read of solar panels not enabled
-    if (!SOLAR0_EN) {
-        adc_select_input(0);
-        workingVoltage = adc_read();
+    if (!config.Solar0Enabled) {
+        convWV = adc_service_voltage(0);
     }
 
-    if (!SOLAR1_EN) {
-        adc_select_input(1);
-        auxillaryVoltage = adc_read();
+    if (!config.Solar1Enabled) {
+        convAV = adc_service_voltage(1);
     }
 
-    float convWV = workingVoltage * ADC_CONV;
-    float convAV = auxillaryVoltage * ADC_CONV;
     state->NO2WE = convWV;
     state->NO2AE = convAV;
-    // DEBUG: printf("> (0) NO2 | rWV : %u | rAV : %u | WV : %.3f | AV : %.3f\n", workingVoltage, auxillaryVoltage, convWV, convAV);
+
+    if (!config.Solar0Enabled) {
+        stats_sample(state, stNO2WE, convWV);
+    }
+    if (!config.Solar1Enabled) {
+        stats_sample(state, stNO2AE, convAV);
+    }
+    // DEBUG: printf("> (0) NO2 | WV : %.3f | AV : %.3f\n", convWV, convAV);
     
 }
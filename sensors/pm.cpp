@@ -1,32 +1,55 @@
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <string>
 #include <iostream>
 #include <iterator>
-#include <cmath>
 
 #include "pico/stdlib.h"
 #include "hardware/spi.h"
 #include "../main.h"
 #include "../misc.h"
 #include "../helpers/sd.h"
+#include "../helpers/spi_bus.h"
+#include "../helpers/power.h"
 #include "pm.h"
-
-static int pm_sd_line_count = 0;
-static int pm_sd_file_count = 0;
-
-// select CS pin (active low)
-inline void pm_cs_select() {
-    asm volatile("nop \n nop \n nop");
-    gpio_put(CS_PM, 0);
-    asm volatile("nop \n nop \n nop");
-}
-
-inline void pm_cs_deselect() {
-    asm volatile("nop \n nop \n nop");
-    gpio_put(CS_PM, 1);
-    asm volatile("nop \n nop \n nop");
-}
+#include "pm_distribution.h"
+
+// OPC-N3 driver
+// Every exchange with the OPC is a transaction: send the command byte until the OPC answers ready (0xF3),
+// pause, then clock the data in or out with the command byte repeated. Each step is one state of a
+// state machine stepped from the main loop, so a reading never holds up core 0 for more than
+// PM_CHUNK_BYTES byte times. The bus is only held while chip select is low.
+//
+// From the ready answer to the end of the data phase chip select has to stay low, so spi0 is kept from one pass
+// of the loop to the next, and the other tasks on core 0 take mtx meanwhile. That is the opposite of the rank
+// order, but cannot deadlock: core 1 never waits for spi0 holding mtx, as its SD writes are deferred until it
+// has let go (sd_defer_begin). The bus is taken off the rank checks for that stretch with lock_detach.
+
+typedef enum {pmPowerUp, pmStart, pmCommand, pmSettle, pmTransfer, pmPowerWait, pmIdle, pmReset, pmFailed, pmStopped} TPMState;
+typedef enum {pmjResume, pmjFanOn, pmjLaserOn, pmjConfig, pmjHistogram, pmjLaserOff, pmjFanOff} TPMJob;
+
+static TPMState pm_state = pmStart;
+static TPMJob pm_job = pmjFanOn;
+static absolute_time_t pm_wait_until;
+
+// Current transaction
+static uint8_t pm_reg;
+static bool pm_writing;                 // Write pm_command after the ready handshake, rather than reading
+static uint8_t pm_command;
+static uint8_t pm_buffer[168];
+static uint16_t pm_length, pm_position;
+static int pm_polls;                    // Ready polls in this attempt
+static int pm_resets;                   // SPI resets in this transaction
+static int pm_retries;                  // Attempts at the current job
+
+static bool pm_stop_requested = false;
+static bool pm_have_histogram = false;
+static bool pm_have_config = false;
+static uint8_t pm_histogram[OPCHistogramFrame::size];
+static uint8_t pm_config[168];
+
+static const struct TSPIDevice opc = {"OPC-N3", CS_PM, SPI_CPOL_0, SPI_CPHA_1, PM_SPI_BAUDRATE, false};
 
 // Compute checksum for validating PM data
 uint16_t compute_checksum(const uint8_t* data, int num_bytes) {
@@ -48,170 +71,6 @@ uint16_t compute_checksum(const uint8_t* data, int num_bytes) {
     return crc;
 }
 
-// continuously checks status and only returns when the status is F3 i.e. free
-// remember to CS select before calling this function
-int check_status(uint8_t reg) {
-    uint8_t status;
-    int counter = 0;
-    spi_write_read_blocking(SPI_PORT_0, &reg, &status, 1);
-    while (status != 0xF3) {
-        sleep_ms(10);
-        ++counter;
-        if (counter >= 60) {
-            if (status == 0x31) {
-                printf("OPC N3 always busy, resetting...\n");
-            }
-            else {
-                printf("Lost connection to the OPC, trying again...\n");
-            }
-            sleep_ms(2000); // wait for 2s for the OPC N3 to reset
-            counter = 0;
-        }
-        spi_write_read_blocking(SPI_PORT_0, &reg, &status, 1);
-    }
-    sleep_ms(10);
-    return 0;
-}
-
-// read registers
-void read_registers(uint8_t reg, uint8_t *values, uint16_t len) {
-    uint8_t status;
-    pm_cs_select();
-    check_status(reg);
-    for (int j=0; j<len; j++) {
-        spi_read_blocking(SPI_PORT_0, reg, &values[j], 1);
-        sleep_us(10);
-    }
-    pm_cs_deselect();
-    sleep_ms(10); // wait 10ms before executing the next command
-}
-
-void write_register(uint8_t reg, uint8_t data) {
-    // DEBUG: printf("Writing %02x to register %02x\n", data, reg);
-
-    pm_cs_select();
-    check_status(reg);
-    spi_write_blocking(SPI_PORT_0, &data, 1);
-    pm_cs_deselect();
-    sleep_ms(10);
-}
-
-bool set_peripheral_status(uint8_t command) {
-    uint8_t powerstatus[6];
-    int index, value;
-    if (command==FAN_ON) {
-        index = 0;
-        value = 1;
-        printf("Turning fan on...\n");
-    }
-    else if (command==FAN_OFF) {
-        index = 0;
-        value = 0;
-        printf("Turning fan off...\n");
-    }
-    else if (command==LASER_ON) {
-        index = 1;
-        value = 1;
-        printf("Turning laser on...\n");
-    }
-    else if (command==LASER_OFF) {
-        index = 1;
-        value = 0;
-        printf("Turning laser off...\n");
-    }
-
-    bool successful = false;
-    while (!successful) {
-        write_register(REG_COMMANDBYTE, command);
-        printf("Waiting for 600ms to complete instruction\n");
-        sleep_ms(600); // wait for 600ms for the instruction to execute
-
-        read_registers(REG_POWERSTATUS, powerstatus, 6);
-
-        /* DEBUG: printf("Power status:   ");
-        for (int j=0; j < 6; j++)
-            printf("%02x ", powerstatus[j]);
-        printf("\n"); */
-
-        if (powerstatus[index] == value) {
-            printf("Completed instruction\n");
-            sleep_ms(10); // delay for next instruction
-            successful = true;
-            return true;
-        }
-        else {
-            printf("Failed instruction, waiting 5000ms then trying again\n");
-            sleep_ms(5000);
-        }
-    }
-
-    // can delete if the code above works
-    // for (int i=0; i<4; i++) {
-    //     write_register(REG_COMMANDBYTE, command);
-    //     sleep_ms(600); // wait for 600ms for the fan to turn on
-    //     read_registers(REG_POWERSTATUS, powerstatus, 6);
-
-    //     /* DEBUG: printf("Power status:   ");
-    //     for (int j=0; j < 6; j++)
-    //         printf("%02x ", powerstatus[j]);
-    //     printf("\n"); */
-
-    //     if (powerstatus[index] == value) {
-    //         printf("Completed instruction\n");
-    //         sleep_ms(10); // delay for next instruction
-    //         return true;
-    //     }
-    // }
-
-    printf("Instruction failed\n");
-    return false;
-}
-
-float convert_32bit_IEEE_to_float(uint32_t value) {
-    int bit;
-
-    unsigned int sign = value >> 31; // 31 bit shifts to the right
-    signed int exponent = ((value >> 23)&0xFF)-127;
-    float mantissa = 1;
-    value &= 0x7FFFFF;
-    for (int i=1; i<24; i++) {
-        bit = (value >> (23-i))&0x01;
-        mantissa += (bit*pow(2, -1*i));
-    }
-
-    int sign_term;
-    float exponent_term;
-
-    if (sign==0) { // positive number
-        sign_term = 1;
-    }
-    else {
-        sign_term = -1;
-    }
-
-    if (exponent == 0) {
-        exponent_term = 1;
-    }
-    else {
-        exponent_term = pow(2, exponent);
-    }
-
-    float flt = sign_term*exponent_term*mantissa;
-    return flt;
-}
-
-uint32_t convert_8bits_to_32bit(uint8_t *array, int start_index) {
-    uint32_t combined = ((uint32_t)array[start_index+3]<<24) | ((uint32_t)array[start_index+2]<<16) | ((uint32_t)array[start_index+1]<<8) | (uint32_t)array[start_index];
-    return combined;
-}
-
-uint16_t convert_8bits_to_16bit(uint8_t *array, int start_index) {
-    uint8_t lsb = array[start_index];
-    uint8_t msb = array[start_index+1];
-    uint16_t combined = (msb << 8) | lsb;
-    return combined;
-}
-
 void log_data_to_sd(struct PMData * data, struct STATE * state){
     // Format string
     char log_string[512];
@@ -226,7 +85,7 @@ void log_data_to_sd(struct PMData * data, struct STATE * state){
         pos += sprintf(pos, "%d,", data->mtof[i]);
     }
 
-    pos += sprintf(pos, "%.2f,%.2f,%.1f,%.1f,%.5f,%.5f,%.5f,%d,%d,%d,%d,%d,%d\n", 
+    pos += sprintf(pos, "%.2f,%.2f,%.1f,%.1f,%.5f,%.5f,%.5f,%d,%d,%d,%d,%d,%d,%.3f,%.3f\n", 
         data->sampling_period,
         data->flow_rate,
         data->temperature,
@@ -239,22 +98,16 @@ void log_data_to_sd(struct PMData * data, struct STATE * state){
         data->reject_count_ratio,
         data->reject_count_out_of_range,
         data->fan_rev_count,
-        data->laser_status
+        data->laser_status,
+        data->number_total,
+        data->volume_total
     );
 
     //printf(log_string);
 
-    // Increment count so that files are no longer than 1000 lines
-    pm_sd_line_count++;
-
-    if (pm_sd_line_count > SD_MAX_LINES) {
-        pm_sd_line_count = 0;
-        pm_sd_file_count++;
-    }
-
-    // Format filename - each file contains 1000 lines and file is pm_log[X].txt
+    // Format filename - each file contains SD_MAX_LINES lines and file is pm_log[X].txt
     char pm_filename[16];
-    sprintf(pm_filename, "pm_log%d.txt", pm_sd_file_count);
+    sprintf(pm_filename, "pm_log%d.txt", sd_log_file(slPM, 1));
 
     // Log string to sd 
     debug("> (0) Logging PM data to SD...");
@@ -262,86 +115,313 @@ void log_data_to_sd(struct PMData * data, struct STATE * state){
     debug("Done\n");
 }
 
-void initPM() {
-    // Initialise PM Sensor
-    bool fan_on = set_peripheral_status(FAN_ON);
-    bool laser_on = set_peripheral_status(LASER_ON);
-
-    // Read and log configuration variables
-    uint8_t config_data[168];
-    read_registers(REG_CONFIG, config_data, 168);
 
-    char config_log_string[512];
-    char* pos = config_log_string;
+static void start_transaction(uint8_t reg, uint16_t length, bool writing, uint8_t command) {
+    pm_reg = reg;
+    pm_length = length;
+    pm_position = 0;
+    pm_writing = writing;
+    pm_command = command;
+    pm_polls = 0;
+    pm_resets = 0;
+    pm_state = pmCommand;
+}
 
-    for (int i = 0; i < 168; i++) {
-        pos += sprintf(pos, "%02x", config_data[i]);
+static void start_job(TPMJob job) {
+    pm_job = job;
+
+    switch (job) {
+        case pmjResume:
+            start_transaction(REG_POWERSTATUS, 6, false, 0);
+            break;
+        case pmjFanOn:
+            start_transaction(REG_COMMANDBYTE, 0, true, FAN_ON);
+            break;
+        case pmjLaserOn:
+            start_transaction(REG_COMMANDBYTE, 0, true, LASER_ON);
+            break;
+        case pmjConfig:
+            start_transaction(REG_CONFIG, sizeof(pm_config), false, 0);
+            break;
+        case pmjHistogram:
+            start_transaction(REG_HISTOGRAMDATA, sizeof(pm_histogram), false, 0);
+            break;
+        case pmjLaserOff:
+            start_transaction(REG_COMMANDBYTE, 0, true, LASER_OFF);
+            break;
+        case pmjFanOff:
+            start_transaction(REG_COMMANDBYTE, 0, true, FAN_OFF);
+            break;
     }
+}
 
-    sprintf(pos, "\n\n");
+static void wait_ms(TPMState state, uint32_t ms) {
+    pm_state = state;
+    pm_wait_until = make_timeout_time_ms(ms);
+}
 
-    logStringToSD(config_log_string, "pm_config.txt");
-    printf("Saved condiguration data to pm_config.txt");
+static void job_failed(const char *reason) {
+    // Retry the whole job a few times, then give up for a while
+    LOG_WARN("<!> OPC %s\n", reason);
 
-    return;
+    if (++pm_retries >= PM_MAX_RETRIES) {
+        LOG_WARN("<!> OPC failed - retrying in %d s\n", PM_FAILED_RETRY_MS / 1000);
+        wait_ms(pmFailed, PM_FAILED_RETRY_MS);
+    } else {
+        wait_ms(pmReset, PM_RETRY_MS);
+    }
 }
 
-void readPM(struct STATE *state) {
-    // Read data from PM sensor
-    // Set spi to correct mode for PM sensor
-    spi_set_format(SPI_PORT_0, 8, SPI_CPOL_0, SPI_CPHA_1, SPI_MSB_FIRST);
-    
-    uint8_t histogramdata[86];
-
-    read_registers(REG_HISTOGRAMDATA, histogramdata, 86);
-
-    uint16_t checksum_actual = convert_8bits_to_16bit(histogramdata, BYTE_CHECKSUM);
-    uint16_t checksum_calc = compute_checksum(histogramdata, 84);
-    // DEBUG: printf("Calculated checksum: %04x, Transmitted checksum: %04x\n", checksum_calc, checksum_actual);
-    if (checksum_actual != checksum_calc) {
-        printf("Bad checksum from PM sensor - ignoring data\n");
-        return;
+static void transaction_done() {
+    // Decide what to do with the data of a finished transaction
+    switch (pm_job) {
+        case pmjResume:
+            // Pick up from whatever the OPC was left doing - the configuration was logged before the reset
+            pm_retries = 0;
+            if (pm_buffer[0] != 1) {
+                start_job(pmjFanOn);
+            } else if (pm_buffer[1] != 1) {
+                power_load(plPMFan, true);
+                start_job(pmjLaserOn);
+            } else {
+                power_load(plPMFan, true);
+                power_load(plPMLaser, true);
+                LOG_INFO("> OPC still running\n");
+                pm_state = pmIdle;
+            }
+            break;
+
+        case pmjFanOn:
+        case pmjLaserOn:
+            if (pm_reg == REG_COMMANDBYTE) {
+                // Give the command time to act, then check the power status
+                wait_ms(pmPowerWait, 600);
+            } else if (pm_buffer[pm_job == pmjFanOn ? 0 : 1] == 1) {
+                power_load(pm_job == pmjFanOn ? plPMFan : plPMLaser, true);
+                pm_retries = 0;
+                start_job(pm_job == pmjFanOn ? pmjLaserOn : pmjConfig);
+            } else {
+                job_failed(pm_job == pmjFanOn ? "fan did not start" : "laser did not start");
+            }
+            break;
+
+        case pmjConfig:
+            memcpy(pm_config, pm_buffer, sizeof(pm_config));
+            pm_have_config = true;
+            pm_retries = 0;
+            pm_state = pmIdle;
+            break;
+
+        case pmjLaserOff:
+            power_load(plPMLaser, false);
+            start_job(pmjFanOff);
+            break;
+
+        case pmjFanOff:
+            power_load(plPMFan, false);
+            LOG_INFO("> OPC stopped\n");
+            pm_state = pmStopped;
+            break;
+
+        case pmjHistogram:
+            if (OPCHistogramFrame::Checksum::get(pm_buffer) != compute_checksum(pm_buffer, OPCHistogramFrame::Checksum::end - 2)) {
+                LOG_WARN("Bad checksum from PM sensor - ignoring data\n");
+            } else {
+                memcpy(pm_histogram, pm_buffer, sizeof(pm_histogram));
+                pm_have_histogram = true;
+            }
+            pm_state = pmIdle;
+            break;
     }
+}
 
-    // Create a struct to hold all data
-    PMData pm_data;
+void initPM() {
+    // Fan, laser and configuration are started by the state machine, once the OPC has had time to power up
+    spi_bus_add(&opc);
+    pm_retries = 0;
+    wait_ms(pmPowerUp, PM_POWER_UP_MS);
+}
 
-    // Store bins
-    for (int i = 0; i < 24; i++) {
-        uint16_t bin = convert_8bits_to_16bit(histogramdata, BYTE_BINS + (2*i));
-        pm_data.bins[i] = bin;
+void resumePM(bool stopped) {
+    // After a warm restart - the OPC kept its power, so check what is still running before starting anything
+    spi_bus_add(&opc);
+    pm_retries = 0;
+
+    if (stopped) {
+        pm_stop_requested = true;
+        pm_state = pmStopped;
+    } else {
+        start_job(pmjResume);
     }
+}
 
-    // Store mtof data
-    for (int i = 0; i < 4; i++) {
-        pm_data.mtof[i] = histogramdata[BYTE_MTOF + i];
+bool isPMStopped() {
+    return pm_stop_requested;
+}
+
+void stopPM() {
+    // Turn the laser and fan off once the current transaction is finished, and take no more readings
+    pm_stop_requested = true;
+}
+
+bool stepPM(bool reading_due) {
+    // Advances the OPC state machine by one step; true when there is something for readPM to publish
+    uint8_t status;
+
+    switch (pm_state) {
+        case pmPowerUp:
+            if (pm_stop_requested) {
+                pm_state = pmStopped;
+            } else if (time_reached(pm_wait_until)) {
+                pm_state = pmStart;
+            }
+            break;
+
+        case pmStart:
+            start_job(pmjFanOn);
+            break;
+
+        case pmCommand:
+            if (!time_reached(pm_wait_until) || !spi_bus_begin(&opc, false)) {
+                break;
+            }
+            spi_bus_transfer(&opc, &pm_reg, &status, 1);
+
+            if (status == 0xF3) {
+                // Ready - keep the bus and chip select for the data phase
+                lock_detach(spi_bus_lock());
+                wait_ms(pmSettle, PM_SETTLE_MS);
+                break;
+            }
+
+            spi_bus_end(&opc);
+
+            if (++pm_polls < PM_MAX_POLLS) {
+                wait_ms(pmCommand, 10);
+            } else if (++pm_resets < PM_MAX_RESETS) {
+                LOG_WARN(status == 0x31 ? "OPC N3 always busy, resetting...\n" : "Lost connection to the OPC, trying again...\n");
+                // Give the OPC SPI interface 2 s to reset
+                pm_polls = 0;
+                wait_ms(pmCommand, 2000);
+            } else {
+                job_failed("not responding");
+            }
+            break;
+
+        case pmSettle:
+            if (!time_reached(pm_wait_until)) {
+                break;
+            }
+            if (pm_writing) {
+                spi_bus_transfer(&opc, &pm_command, NULL, 1);
+                spi_bus_end(&opc);
+                transaction_done();
+            } else {
+                pm_state = pmTransfer;
+            }
+            break;
+
+        case pmTransfer:
+            for (int i = 0; (i < PM_CHUNK_BYTES) && (pm_position < pm_length); i++) {
+                spi_bus_transfer(&opc, &pm_reg, &pm_buffer[pm_position++], 1);
+                sleep_us(10);
+            }
+            if (pm_position >= pm_length) {
+                spi_bus_end(&opc);
+                transaction_done();
+            }
+            break;
+
+        case pmPowerWait:
+            if (time_reached(pm_wait_until)) {
+                start_transaction(REG_POWERSTATUS, 6, false, 0);
+            }
+            break;
+
+        case pmIdle:
+            if (pm_stop_requested) {
+                start_job(pmjLaserOff);
+            } else if (reading_due) {
+                start_job(pmjHistogram);
+            }
+            break;
+
+        case pmReset:
+            // Waiting to retry the current job
+            if (time_reached(pm_wait_until)) {
+                start_job(pm_job);
+            }
+            break;
+
+        case pmFailed:
+            if (pm_stop_requested) {
+                pm_state = pmStopped;
+            } else if (time_reached(pm_wait_until)) {
+                LOG_INFO("> OPC restarting\n");
+                pm_retries = 0;
+                pm_state = pmStart;
+            }
+            break;
+
+        case pmStopped:
+            break;
+    }
+
+    return pm_have_histogram || pm_have_config;
+}
+
+void readPM(struct STATE *state) {
+    // Publish and log anything new from the state machine - called with mtx held
+    if (pm_have_config) {
+        char config_log_string[512];
+        char* pos = config_log_string;
+
+        for (unsigned int i = 0; i < sizeof(pm_config); i++) {
+            pos += sprintf(pos, "%02x", pm_config[i]);
+        }
+
+        sprintf(pos, "\n\n");
+
+        logStringToSD(config_log_string, "pm_config.txt");
+        LOG_INFO("Saved configuration data to pm_config.txt\n");
+        pm_have_config = false;
     }
 
-    pm_data.sampling_period = (float) convert_8bits_to_16bit(histogramdata, BYTE_SAMPLINGPERIOD)/100;
-    pm_data.flow_rate = (float) convert_8bits_to_16bit(histogramdata, BYTE_FLOWRATE)/100;
+    if (!pm_have_histogram) {
+        return;
+    }
+    pm_have_histogram = false;
 
-    uint16_t temp16 = convert_8bits_to_16bit(histogramdata, BYTE_TEMPERATURE);
-    pm_data.temperature = -45+175*((float)temp16/ 65535.0);
+    typedef OPCHistogramFrame F;
+    const uint8_t *frame = pm_histogram;
 
-    uint16_t rhumidity16 = convert_8bits_to_16bit(histogramdata, BYTE_RHUMIDITY);
-    pm_data.rhumidity = 100*((float)rhumidity16/ 65535.0);
+    // Create a struct to hold all data
+    PMData pm_data;
 
-    uint32_t PM1_IEEE = convert_8bits_to_32bit(histogramdata, BYTE_PM1);
-    pm_data.pm1 = convert_32bit_IEEE_to_float(PM1_IEEE);
+    for (size_t i = 0; i < F::Bins::count; i++) {
+        pm_data.bins[i] = F::Bins::get(frame, i);
+    }
+    for (size_t i = 0; i < F::MToF::count; i++) {
+        pm_data.mtof[i] = F::MToF::get(frame, i);
+    }
 
-    uint32_t PM2_IEEE = convert_8bits_to_32bit(histogramdata, BYTE_PM2);
-    pm_data.pm2 = convert_32bit_IEEE_to_float(PM2_IEEE);
+    pm_data.sampling_period = F::SamplingPeriod::get(frame) / 100.0f;
+    pm_data.flow_rate = F::FlowRate::get(frame) / 100.0f;
+    pm_data.temperature = -45 + 175 * (F::Temperature::get(frame) / 65535.0f);
+    pm_data.rhumidity = 100 * (F::RHumidity::get(frame) / 65535.0f);
 
-    uint32_t PM10_IEEE = convert_8bits_to_32bit(histogramdata, BYTE_PM10);
-    pm_data.pm10 = convert_32bit_IEEE_to_float(PM10_IEEE);
+    // The OPC sends these as IEEE floats, same as ours
+    pm_data.pm1 = F::PM1::get(frame);
+    pm_data.pm2 = F::PM2::get(frame);
+    pm_data.pm10 = F::PM10::get(frame);
 
-    pm_data.reject_count_glitch = convert_8bits_to_16bit(histogramdata, BYTE_REJECT_GLITCH);
-    pm_data.reject_count_long_tof = convert_8bits_to_16bit(histogramdata, BYTE_REJECT_LONG_TOF);
-    pm_data.reject_count_ratio = convert_8bits_to_16bit(histogramdata, BYTE_REJECT_RATIO);
-    pm_data.reject_count_out_of_range = convert_8bits_to_16bit(histogramdata, BYTE_REJECT_OUT_OF_RANGE);
+    pm_data.reject_count_glitch = F::RejectGlitch::get(frame);
+    pm_data.reject_count_long_tof = F::RejectLongTOF::get(frame);
+    pm_data.reject_count_ratio = F::RejectRatio::get(frame);
+    pm_data.reject_count_out_of_range = F::RejectOutOfRange::get(frame);
 
-    pm_data.fan_rev_count = convert_8bits_to_16bit(histogramdata, BYTE_FAN_REV_COUNT);
-    pm_data.laser_status = convert_8bits_to_16bit(histogramdata, BYTE_LASER_STATUS);
+    pm_data.fan_rev_count = F::FanRevCount::get(frame);
+    pm_data.laser_status = F::LaserStatus::get(frame);
 
     // Create a struct with all data
     //PMData pm_data = {sampling_period, flow_rate, temperature, pm1_data, pm2_data, pm10_data};
@@ -355,6 +435,8 @@ void readPM(struct STATE *state) {
     state->PMSamplePeriod = pm_data.sampling_period;
     state->PMFlowRate = pm_data.flow_rate;
 
+    pm_distribution_add(&pm_data);
+
     // Log data to sd card
     log_data_to_sd(&pm_data, state);
     return;
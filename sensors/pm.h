@@ -1,6 +1,8 @@
 #ifndef PM_INCLUDED
 #define PM_INCLUDED
 
+#include "../helpers/frame.h"
+
 
 // TODO: temporary pin numbers, need to configure in main.h
 //#define MISO 8
@@ -29,23 +31,38 @@
 #define LASER_OFF 0x06
 #define LASER_ON 0x07
 
-// byte index in histogram data
-#define BYTE_BINS 00 // 24x 16 bit values
-#define BYTE_MTOF 48 // 4x 8 bit values
-#define BYTE_SAMPLINGPERIOD 52 // 16 bit
-#define BYTE_FLOWRATE 54 // 16 bit
-#define BYTE_TEMPERATURE 56 // 16 bit
-#define BYTE_RHUMIDITY 58 // 16 bit
-#define BYTE_PM1 60 // 32 bit
-#define BYTE_PM2 64 // 32 bit
-#define BYTE_PM10 68 // 32 bit
-#define BYTE_REJECT_GLITCH 72 // 16 bit
-#define BYTE_REJECT_LONG_TOF 74 // 16 bit
-#define BYTE_REJECT_RATIO 76 // 16 bit
-#define BYTE_REJECT_OUT_OF_RANGE 78 // 16 bit
-#define BYTE_FAN_REV_COUNT 80 // 16 bit
-#define BYTE_LASER_STATUS 82 // 16 bit
-#define BYTE_CHECKSUM 84 // 16 bit
+// histogram data layout
+struct OPCHistogramFrame {
+    typedef LEArray<uint16_t, 0, 24> Bins;
+    typedef LEArray<uint8_t, 48, 4> MToF;
+    typedef LEField<uint16_t, 52> SamplingPeriod; // 1/100 s
+    typedef LEField<uint16_t, 54> FlowRate; // 1/100 ml/s
+    typedef LEField<uint16_t, 56> Temperature;
+    typedef LEField<uint16_t, 58> RHumidity;
+    typedef LEField<float, 60> PM1;
+    typedef LEField<float, 64> PM2;
+    typedef LEField<float, 68> PM10;
+    typedef LEField<uint16_t, 72> RejectGlitch;
+    typedef LEField<uint16_t, 74> RejectLongTOF;
+    typedef LEField<uint16_t, 76> RejectRatio;
+    typedef LEField<uint16_t, 78> RejectOutOfRange;
+    typedef LEField<uint16_t, 80> FanRevCount;
+    typedef LEField<uint16_t, 82> LaserStatus;
+    typedef LEField<uint16_t, 84> Checksum;
+    static const size_t size = Checksum::end;
+};
+
+#define PM_SPI_BAUDRATE (500 * 1000)
+
+// state machine limits
+#define PM_SETTLE_MS 10 // from the ready answer to the data phase
+#define PM_CHUNK_BYTES 8 // bytes read per step, about 20us each
+#define PM_MAX_POLLS 60 // ready polls, 10ms apart, before resetting the OPC SPI interface
+#define PM_MAX_RESETS 3 // SPI resets before the job is retried
+#define PM_MAX_RETRIES 5 // job retries, 5s apart, before giving up
+#define PM_RETRY_MS 5000
+#define PM_FAILED_RETRY_MS (5 * 60 * 1000)
+#define PM_POWER_UP_MS 2000 // from initPM to the first command
 
 // information for checksum calculator
 #define CRC_POLYNOMIAL 0xA001
@@ -64,9 +81,18 @@ struct PMData {
     uint16_t reject_count_glitch, reject_count_long_tof, reject_count_ratio, reject_count_out_of_range;
     uint16_t fan_rev_count;
     uint16_t laser_status;
+    // derived from the bins, per ml of air
+    float number_concentration[24];
+    float volume_concentration[24]; // um^3
+    float number_total;
+    float volume_total;
 };
 
 void initPM();
+void resumePM(bool stopped);
+bool isPMStopped();
+bool stepPM(bool reading_due);
+void stopPM();
 void readPM(struct STATE *state);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "pico/stdlib.h"
+#include "../main.h"
+#include "../misc.h"
+#include "../helpers/sd.h"
+#include "pm.h"
+#include "pm_distribution.h"
+
+// Bin boundaries of the OPC-N3 in um
+static const float BIN_EDGES[PM_NUM_BINS + 1] = {
+    0.35f, 0.46f, 0.66f, 1.0f, 1.3f, 1.7f, 2.3f, 3.0f, 4.0f, 5.2f, 6.5f, 8.0f, 10.0f,
+    12.0f, 14.0f, 16.0f, 18.0f, 20.0f, 22.0f, 25.0f, 28.0f, 31.0f, 34.0f, 37.0f, 40.0f
+};
+
+// Running distribution for this interval
+static uint32_t interval_counts[PM_NUM_BINS];
+static float interval_volume = 0;       // ml of air sampled
+static uint32_t interval_readings = 0;
+
+// Bin counts of the last record in the file, which the next one is coded against
+static uint32_t previous_counts[PM_NUM_BINS];
+
+// Latest radio record
+static uint8_t frame[PM_RECORD_MAX];
+static int frame_length = 0;
+
+static int pm_hist_file_count = 0;
+
+// Whether the last record may not have reached the file, and the SD failures and skipped writes just after it
+static bool record_lost = false;
+static uint32_t sd_losses = 0;
+
+static float particle_volume(int bin) {
+    // Volume of a sphere at the geometric middle of the bin, in um^3
+    float d = sqrtf(BIN_EDGES[bin] * BIN_EDGES[bin + 1]);
+    return 0.5235988f * d * d * d;
+}
+
+void pm_distribution_add(struct PMData *data) {
+    // Fills in the concentrations of a reading, and adds it to the interval
+    float volume = data->flow_rate * data->sampling_period;
+
+    data->number_total = 0;
+    data->volume_total = 0;
+
+    for (int i = 0; i < PM_NUM_BINS; i++) {
+        data->number_concentration[i] = (volume > 0) ? data->bins[i] / volume : 0;
+        data->volume_concentration[i] = data->number_concentration[i] * particle_volume(i);
+        data->number_total += data->number_concentration[i];
+        data->volume_total += data->volume_concentration[i];
+
+        interval_counts[i] += data->bins[i];
+    }
+
+    interval_volume += volume;
+    interval_readings++;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint32_t value) {
+    while (value >= 0x80) {
+        *p++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+static uint32_t zigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+void pm_distribution_end_interval(struct STATE *state) {
+    // Publishes the distribution for the interval just finished, and logs it as a record - called with mtx held
+    if (interval_readings == 0) {
+        return;
+    }
+
+    state->PMNumberConcentration = 0;
+    state->PMVolumeConcentration = 0;
+    if (interval_volume > 0) {
+        for (int i = 0; i < PM_NUM_BINS; i++) {
+            float number = interval_counts[i] / interval_volume;
+            state->PMNumberConcentration += number;
+            state->PMVolumeConcentration += number * particle_volume(i);
+        }
+    }
+
+    // A deferred write can still fail after logBytesToSD() said it was kept, and the stats don't say which one it was,
+    // so any lost write since the last record counts.  The next record would be coded against counts that never
+    // reached the card, so it goes in a new file instead
+    struct TSDStats *stats = sd_stats();
+    if (record_lost || (stats->failures + stats->skipped != sd_losses)) {
+        sd_log_new_file(slPMHist);
+    }
+
+    // Each file starts from zero so it can be decoded on its own
+    int file = sd_log_file(slPMHist, 1);
+    if (file != pm_hist_file_count) {
+        pm_hist_file_count = file;
+        memset(previous_counts, 0, sizeof(previous_counts));
+    }
+
+    uint8_t record[PM_RECORD_MAX];
+    uint8_t *p = record;
+    uint8_t *f = frame;
+
+    *p++ = 'H';
+    *f++ = 'h';
+    p = put_varint(p, state->SecondsInDay);
+    f = put_varint(f, state->SecondsInDay);
+    p = put_varint(p, (uint32_t)(interval_volume * 100));
+    f = put_varint(f, (uint32_t)(interval_volume * 100));
+    p = put_varint(p, interval_readings);
+    f = put_varint(f, interval_readings);
+
+    for (int i = 0; i < PM_NUM_BINS; i++) {
+        p = put_varint(p, zigzag((int32_t)(interval_counts[i] - previous_counts[i])));
+        f = put_varint(f, zigzag((int32_t)(interval_counts[i] - (i ? interval_counts[i - 1] : 0))));
+    }
+
+    frame_length = f - frame;
+
+    char pm_filename[20];
+    sprintf(pm_filename, "pm_hist%d.bin", pm_hist_file_count);
+    record_lost = !logBytesToSD(record, p - record, pm_filename);
+    sd_losses = stats->failures + stats->skipped;
+    if (!record_lost) {
+        memcpy(previous_counts, interval_counts, sizeof(previous_counts));
+    }
+
+    memset(interval_counts, 0, sizeof(interval_counts));
+    interval_volume = 0;
+    interval_readings = 0;
+}
+
+int pm_distribution_frame(uint8_t *buffer) {
+    // Copy of the latest radio record
+    memcpy(buffer, frame, frame_length);
+    return frame_length;
+}
@@ -0,0 +1,17 @@
+#ifndef PM_DISTRIBUTION_INCLUDED
+#define PM_DISTRIBUTION_INCLUDED
+
+// Size distribution from the OPC-N3 histogram, accumulated over each telemetry interval
+// At the end of an interval the bin counts are written to pm_hist[X].bin as a record:
+//   'H', seconds in day, sampled volume (0.01 ml), readings, then 24 bin counts
+// all as LEB128 varints, with each bin count zigzag coded as the difference from the previous record in the file.
+// After an SD write is lost the records carry on in a new file, so a file never has a gap in it.
+// The radio gets the same record starting 'h', coded against the previous bin instead, as packets get lost.
+#define PM_NUM_BINS 24
+#define PM_RECORD_MAX (1 + 5 * (3 + PM_NUM_BINS))
+
+void pm_distribution_add(struct PMData *data);
+void pm_distribution_end_interval(struct STATE *state);
+int pm_distribution_frame(uint8_t *buffer);
+
+#endif
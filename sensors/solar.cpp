@@ -4,6 +4,7 @@
 #include "hardware/adc.h"
 #include "../main.h"
 #include "../misc.h"
+#include "../helpers/adc_service.h"
 #include "solar.h"
 // include "ads1115.h"
 
@@ -22,40 +23,46 @@ void initSolar() {
     //}
 
     // Init all required pins as adc gpio
-    if (SOLAR0_EN) {
+    if (config.Solar0Enabled) {
         adc_gpio_init(SOLAR0);
     }
-    if (SOLAR1_EN) {
+    if (config.Solar1Enabled) {
         adc_gpio_init(SOLAR1);
     }
-    adc_gpio_init(SOLAR2);
+    if (SOLAR2_EN) {
+        adc_gpio_init(SOLAR2);
+    }
 }
 
 void readSolar(struct STATE *state) {
+    // Oversampled values from the ADC service - no ADC access here
+    float conv0 = 0;
+    float conv1 = 0;
+    float conv2 = 0;
 
-    uint16_t solar0_raw = 0;
-    uint16_t solar1_raw = 0;
-    uint16_t solar2_raw = 0;
-
-    if (SOLAR0_EN) {
-        adc_select_input(0);
-        solar0_raw = adc_read();
+    if (config.Solar0Enabled) {
+        conv0 = adc_service_voltage(0);
     }
-    if (SOLAR1_EN) {
-        adc_select_input(1);
-        solar1_raw = adc_read();
+    if (config.Solar1Enabled) {
+        conv1 = adc_service_voltage(1);
+    }
+    if (SOLAR2_EN) {
+        conv2 = adc_service_voltage(2);
     }
-    
-    adc_select_input(2);
-    solar2_raw = adc_read();
-
-    float conv0 = solar0_raw * ADC_CONV;
-    float conv1 = solar1_raw * ADC_CONV;
-    float conv2 = solar2_raw * ADC_CONV;
 
     state->Solar0 = conv0;
     state->Solar1 = conv1;
     state->Solar2 = conv2;
+
+    if (config.Solar0Enabled) {
+        stats_sample(state, stSolar0, conv0);
+    }
+    if (config.Solar1Enabled) {
+        stats_sample(state, stSolar1, conv1);
+    }
+    if (SOLAR2_EN) {
+        stats_sample(state, stSolar2, conv2);
+    }
     //printf("> (0) NO2 | rWV : %u | rAV : %u | WV : %.3f | AV : %.3f\n", workingVoltage, auxillaryVoltage, convWV, convAV);
     
 }
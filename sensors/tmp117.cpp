@@ -2,72 +2,132 @@
 #include <string.h>
 #include "pico/stdlib.h"
 #include "hardware/i2c.h"
+#include "hardware/gpio.h"
 #include "../main.h"
 #include "../misc.h"
 #include "tmp117.h"
 
-static int tmp117_addr = 0x48;
-static int DeviceAddress = 0;
-
-//#define I2C_PORT_0  i2c0                Defined in "../main.h"
+// 0x48 is shared with the ADS1115, so probe() checks the device ID
+static const uint8_t TMP117_ADDRESSES[] = {0x48};
 
 //define useful registers on TMP117
 #define TemperatureRegister 0x00
 #define ConfigurationRegister 0x01
-#define READ_BIT  0x80
+#define DeviceIDRegister 0x0F
+#define TMP117_DEVICE_ID 0x117
+
+// Configuration register bits
+#define TMP117_DATA_READY (1 << 13)     // Cleared by reading the configuration or temperature
+#define TMP117_DR_ALERT (1 << 2)        // ALERT pin follows data ready
+
+// The averaging sets a minimum conversion time, so each cycle here is at least that long
+static const struct TTMP117Settings TMP117_PHASE_SETTINGS[] = {
+    {5, 3, 4000},       // spIdle       - 64 averages, 4 s
+    {4, 1, 1000},       // spAscent     - 8 averages, 1 s
+    {3, 1, 500},        // spNearBurst  - 8 averages, 0.5 s
+    {4, 2, 1000},       // spDescent    - 32 averages, 1 s
+    {7, 3, 16000}       // spLanded     - 64 averages, 16 s
+};
+
+static volatile bool alert_fired = false;
+
+static void alert_callback(uint gpio, uint32_t events) {
+    alert_fired = true;
+}
 
-//Check (Defined in "../main.h"):
-//#define SDA_PIN 20  
-//#define SCL_PIN 21  
+TMP117Sensor::TMP117Sensor() : SensorDriver("TMP117", TMP117_ADDRESSES, 1, 1000) {
+    temperature = 0;
+    ready_polls = 0;
+}
+
+bool TMP117Sensor::probe() {
+    uint8_t buffer[2];
+    if (!read_registers(DeviceIDRegister, buffer, 2)) {
+        return false;
+    }
+    // Bottom 12 bits are the device ID, top 4 the revision
+    return ((buffer[0] << 8 | buffer[1]) & 0x0FFF) == TMP117_DEVICE_ID;
+}
 
-static void write_register16(uint8_t reg, uint8_t data0, uint8_t data1) {
-    uint8_t buf[3];
-    buf[0] = reg; buf[1] = data0; buf[2] = data1;
-    i2c_write_blocking(I2C_PORT_0, DeviceAddress, buf, 3, true);
+bool TMP117Sensor::start() {
+    if (TMP117_ALERT_PIN >= 0) {
+        // ALERT is open drain and active low
+        gpio_init(TMP117_ALERT_PIN);
+        gpio_set_dir(TMP117_ALERT_PIN, GPIO_IN);
+        gpio_pull_up(TMP117_ALERT_PIN);
+        gpio_set_irq_enabled_with_callback(TMP117_ALERT_PIN, GPIO_IRQ_EDGE_FALL, true, &alert_callback);
+    }
+    return true;
 }
 
-static int32_t tmp117_read_raw() {
-    if (DeviceAddress > 0) {
-        uint8_t buffer[2];
-        uint8_t val = TemperatureRegister | READ_BIT;
-        i2c_write_blocking(I2C_PORT_0, DeviceAddress, &val, 1, true);
-        i2c_read_blocking(I2C_PORT_0, DeviceAddress, buffer, 2, false);
-        int16_t temp = buffer[0] << 8 | buffer[1];
-        return ( -(temp & 0b1000000000000000) | (temp & 0b0111111111111111) );
+bool TMP117Sensor::configure(TSensorPhase phase) {
+    // Continuous conversion, with the cycle and averaging for the phase
+    const struct TTMP117Settings *settings = &TMP117_PHASE_SETTINGS[phase];
+    uint16_t config = (settings->conv << 7) | (settings->avg << 5);
+
+    if (TMP117_ALERT_PIN >= 0) {
+        config |= TMP117_DR_ALERT;
     }
-    else{
-        return 64; // Device not found, return a clearly erroneous value
+
+    uint8_t buf[3] = {ConfigurationRegister, (uint8_t)(config >> 8), (uint8_t)config};
+    if (!write(buf, 3)) {
+        return false;
     }
+
+    repeater.set_delay(settings->period_ms);
+    alert_fired = false;
+    return true;
 }
 
-void initTMP117()
-{
-
-    // setup i2c
-    // Set up in "../main.cpp"
-    //int f = i2c_init(I2C_PORT_0, 400 * 1000);
-    //gpio_set_function(SDA_PIN, GPIO_FUNC_I2C);
-    //gpio_set_function(SCL_PIN, GPIO_FUNC_I2C);
-    //gpio_pull_up(SDA_PIN);
-    //gpio_pull_up(SCL_PIN);
-
-    // Configuration
-    uint8_t rxdata;
-	
-    if (i2c_read_blocking(I2C_PORT_0, DeviceAddress = tmp117_addr, &rxdata, 1, false) <= 0)
-	{
-        printf("FAIL (No Device on I2C 0)");
-		DeviceAddress = 0;
-	}
-    if (DeviceAddress > 0){
-        write_register16(ConfigurationRegister, 0x00, 0x60);
+bool TMP117Sensor::data_ready(bool *ready) {
+    // False if the device did not answer, which is a failure rather than a conversion still running
+    if (TMP117_ALERT_PIN >= 0) {
+        *ready = alert_fired;
+        alert_fired = false;
+        return true;
+    }
+
+    uint8_t buffer[2];
+    if (!read_registers(ConfigurationRegister, buffer, 2)) {
+        return false;
     }
-    return;
+    *ready = ((buffer[0] << 8 | buffer[1]) & TMP117_DATA_READY) != 0;
+    return true;
 }
 
-void readTMP117(struct STATE *state ) {
-    if (DeviceAddress > 0){
-        int32_t temperature_raw = tmp117_read_raw();
-        state -> TMP117Temperature = temperature_raw * 7.8125 /1000;
+TPollResult TMP117Sensor::poll() {
+    // The repeater runs at the conversion cycle, so the data is usually ready first time
+    bool ready;
+
+    if (!data_ready(&ready)) {
+        ready_polls = 0;
+        return prFailed;
+    }
+    if (!ready) {
+        if (++ready_polls > TMP117_MAX_READY_POLLS) {
+            ready_polls = 0;
+            return prFailed;
+        }
+        collect_after_ms(10);
+        return prPending;
+    }
+    ready_polls = 0;
+
+    uint8_t buffer[2];
+    if (!read_registers(TemperatureRegister, buffer, 2)) {
+        return prFailed;
     }
+    int16_t temperature_raw = buffer[0] << 8 | buffer[1];
+    temperature = temperature_raw * 7.8125 / 1000;
+    return prDone;
+}
+
+void TMP117Sensor::publish(struct STATE *state) {
+    state->TMP117Temperature = temperature;
+    state->TMP117Valid = true;
+    stats_sample(state, stTMP117Temperature, temperature);
+}
+
+void TMP117Sensor::withdraw(struct STATE *state) {
+    state->TMP117Valid = false;
 }
@@ -1,6 +1,35 @@
 #ifndef TMP117_INCLUDED
 #define TMP117_INCLUDED
 
-void initTMP117();
-void readTMP117(struct STATE *s);
+#include "../helpers/sensor.h"
+
+// GPIO wired to the TMP117 ALERT pin, or -1 to poll the data ready flag instead
+#define TMP117_ALERT_PIN -1
+// Polls, 10 ms apart, for a conversion that should already have finished before the reading is abandoned
+#define TMP117_MAX_READY_POLLS 20
+
+// Continuous conversion settings for a flight phase
+struct TTMP117Settings {
+    uint8_t conv;           // Conversion cycle code, config bits 9:7
+    uint8_t avg;            // Averaging code, config bits 6:5 - 0 none, 1 8, 2 32, 3 64
+    uint32_t period_ms;     // Conversion cycle time that those give
+};
+
+class TMP117Sensor : public SensorDriver {
+
+    float temperature;
+    int ready_polls;
+
+    bool data_ready(bool *ready);
+
+    public:
+        TMP117Sensor();
+        bool probe();
+        bool start();
+        bool configure(TSensorPhase phase);
+        TPollResult poll();                 // Reads the temperature once a new conversion is ready
+        void publish(struct STATE *s);
+        void withdraw(struct STATE *s);
+};
+
 #endif
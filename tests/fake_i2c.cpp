@@ -0,0 +1,100 @@
+#include <string.h>
+#include "helpers/i2c_bus.h"
+#include "fake_i2c.h"
+
+#define FAKE_I2C_MAX_DEVICES 8
+#define FAKE_I2C_NACK -2            // PICO_ERROR_GENERIC
+
+static struct {
+    i2c_inst_t *i2c;
+    uint8_t address;
+    FakeI2CDevice *device;
+} devices[FAKE_I2C_MAX_DEVICES];
+static int num_devices = 0;
+
+static struct TI2CBusHealth health[2];
+
+i2c_inst_t i2c0_inst = {0};
+i2c_inst_t i2c1_inst = {1};
+
+void fake_i2c_attach(i2c_inst_t *i2c, uint8_t address, FakeI2CDevice *device) {
+    if (num_devices < FAKE_I2C_MAX_DEVICES) {
+        devices[num_devices].i2c = i2c;
+        devices[num_devices].address = address;
+        devices[num_devices].device = device;
+        num_devices++;
+    }
+}
+
+void fake_i2c_detach_all() {
+    num_devices = 0;
+}
+
+static FakeI2CDevice *find(i2c_inst_t *i2c, uint8_t address) {
+    for (int i = 0; i < num_devices; i++) {
+        if ((devices[i].i2c == i2c) && (devices[i].address == address) && devices[i].device->present) {
+            return devices[i].device;
+        }
+    }
+    return NULL;
+}
+
+int i2c_bus_write(i2c_inst_t *i2c, uint8_t address, const uint8_t *src, size_t len, bool nostop) {
+    FakeI2CDevice *device = find(i2c, address);
+
+    health[i2c->index].transactions++;
+    if (!device) {
+        health[i2c->index].nacks++;
+        return FAKE_I2C_NACK;
+    }
+    device->writes++;
+    return device->write(src, len) ? (int)len : FAKE_I2C_NACK;
+}
+
+int i2c_bus_read(i2c_inst_t *i2c, uint8_t address, uint8_t *dst, size_t len, bool nostop) {
+    FakeI2CDevice *device = find(i2c, address);
+
+    health[i2c->index].transactions++;
+    if (!device) {
+        health[i2c->index].nacks++;
+        return FAKE_I2C_NACK;
+    }
+    device->reads++;
+    return device->read(dst, len) ? (int)len : FAKE_I2C_NACK;
+}
+
+void i2c_bus_recover(i2c_inst_t *i2c) {
+}
+
+struct TI2CBusHealth *i2c_bus_health(i2c_inst_t *i2c) {
+    return &health[i2c->index];
+}
+
+FakeRegisterDevice::FakeRegisterDevice() {
+    memset(registers, 0, sizeof(registers));
+    pointer = 0;
+}
+
+bool FakeRegisterDevice::write(const uint8_t *data, size_t len) {
+    // The register number, then optionally a value to write to it
+    if ((len != 1) && (len != 3)) {
+        return false;
+    }
+    pointer = data[0];
+    if (len == 3) {
+        register_write(pointer, data[1] << 8 | data[2]);
+    }
+    return true;
+}
+
+bool FakeRegisterDevice::read(uint8_t *data, size_t len) {
+    // Reads go on into the following registers, as on the TMP117
+    for (size_t i = 0; i < len; i += 2) {
+        uint16_t value = register_read(pointer++);
+        data[i] = value >> 8;
+        if (i + 1 < len) {
+            data[i + 1] = value;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,43 @@
+#ifndef FAKE_I2C_INCLUDED
+#define FAKE_I2C_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hardware/i2c.h"
+
+// Simulated I2C devices
+// Tests attach devices at an address on either bus, and i2c_bus_write/read are routed to them.
+// A transaction to an address with nothing attached, or to a device that is not present, is NACKed.
+class FakeI2CDevice {
+
+    public:
+        bool present;
+        uint32_t writes, reads;
+
+        FakeI2CDevice() : present(true), writes(0), reads(0) {}
+        virtual ~FakeI2CDevice() {}
+
+        virtual bool write(const uint8_t *data, size_t len) = 0;
+        virtual bool read(uint8_t *data, size_t len) = 0;
+};
+
+// Devices with 16 bit big-endian registers, selected by writing the register number first, such as the TMP117
+class FakeRegisterDevice : public FakeI2CDevice {
+
+    protected:
+        virtual uint16_t register_read(uint8_t reg) { return registers[reg]; }
+        virtual void register_write(uint8_t reg, uint16_t value) { registers[reg] = value; }
+
+    public:
+        uint16_t registers[256];
+        uint8_t pointer;
+
+        FakeRegisterDevice();
+        bool write(const uint8_t *data, size_t len);
+        bool read(uint8_t *data, size_t len);
+};
+
+void fake_i2c_attach(i2c_inst_t *i2c, uint8_t address, FakeI2CDevice *device);
+void fake_i2c_detach_all();
+
+#endif
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "pico/critical_section.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "main.h"
+#include "cutdown.h"
+#include "helpers/sd.h"
+#include "fakes.h"
+
+// Host versions of the SDK functions and firmware modules the tested code calls, kept as simple as will do
+
+// Time
+
+static uint64_t now_us = 0;
+
+absolute_time_t get_absolute_time() {
+    return now_us;
+}
+
+int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) {
+    return (int64_t)(to - from);
+}
+
+absolute_time_t delayed_by_us(absolute_time_t t, uint64_t us) {
+    return t + us;
+}
+
+absolute_time_t make_timeout_time_ms(uint32_t ms) {
+    return now_us + ms * 1000ull;
+}
+
+bool time_reached(absolute_time_t t) {
+    return now_us >= t;
+}
+
+uint32_t to_ms_since_boot(absolute_time_t t) {
+    return t / 1000;
+}
+
+uint32_t time_us_32() {
+    return now_us;
+}
+
+void sleep_ms(uint32_t ms) {
+    now_us += ms * 1000ull;
+}
+
+void fake_advance_us(uint64_t us) {
+    now_us += us;
+}
+
+// GPIO - nothing is wired up
+
+void gpio_init(uint gpio) {
+}
+
+void gpio_set_dir(uint gpio, bool out) {
+}
+
+void gpio_pull_up(uint gpio) {
+}
+
+void gpio_set_irq_enabled_with_callback(uint gpio, uint32_t event_mask, bool enabled, gpio_irq_callback_t callback) {
+}
+
+// Flash, as it behaves - erasing sets every bit and programming can only clear them
+
+uint8_t fake_flash[PICO_FLASH_SIZE_BYTES];
+
+void flash_range_erase(uint32_t flash_offs, size_t count) {
+    memset(fake_flash + flash_offs, 0xFF, count);
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        fake_flash[flash_offs + i] &= data[i];
+    }
+}
+
+void fake_flash_erase_all() {
+    memset(fake_flash, 0xFF, sizeof(fake_flash));
+}
+
+// One core, no interrupts
+
+void critical_section_init(critical_section_t *crit_sec) {
+    crit_sec->depth = 0;
+}
+
+void critical_section_enter_blocking(critical_section_t *crit_sec) {
+    crit_sec->depth++;
+}
+
+void critical_section_exit(critical_section_t *crit_sec) {
+    crit_sec->depth--;
+}
+
+bool multicore_lockout_victim_is_initialized(uint core_num) {
+    return false;
+}
+
+void multicore_lockout_start_blocking() {
+}
+
+void multicore_lockout_end_blocking() {
+}
+
+uint32_t save_and_disable_interrupts() {
+    return 0;
+}
+
+void restore_interrupts(uint32_t status) {
+}
+
+// Firmware modules
+
+struct TProfiledMutex mtx;
+
+void lock_enter(struct TProfiledMutex *lock, struct TLockSite *site) {
+}
+
+void lock_exit(struct TProfiledMutex *lock) {
+}
+
+void log_write(TLogLevel level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+void stats_sample(struct STATE *state, TStatField field, float value) {
+}
+
+const float GEOFENCE[2 * GEOFENCE_POINTS] = {0};
+
+// The SD card holds at most one file, set by the test
+
+static const char *sd_file_name = NULL;
+static const char *sd_file_text = NULL;
+
+void fake_sd_file(const char *filename, const char *text) {
+    sd_file_name = filename;
+    sd_file_text = text;
+}
+
+int readFileFromSD(const char *filename, char *buffer, size_t size) {
+    if (!sd_file_name || (strcmp(filename, sd_file_name) != 0) || (strlen(sd_file_text) >= size)) {
+        return -1;
+    }
+    strcpy(buffer, sd_file_text);
+    return strlen(buffer);
+}
+
+bool logStringToSD(const char *text, const char *filename) {
+    return true;
+}
+
+int sd_log_file(TSDLog log, int lines) {
+    return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef FAKES_INCLUDED
+#define FAKES_INCLUDED
+
+// Controls for the host versions of the SDK and firmware modules in fakes.cpp
+// fake_advance_us() is declared with the other time functions in stubs/pico/time.h
+
+void fake_flash_erase_all();
+void fake_sd_file(const char *filename, const char *text);     // NULL for no card
+
+#endif
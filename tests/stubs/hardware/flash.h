@@ -0,0 +1,18 @@
+#ifndef TEST_HARDWARE_FLASH_INCLUDED
+#define TEST_HARDWARE_FLASH_INCLUDED
+
+#include "pico/types.h"
+
+#define FLASH_PAGE_SIZE (1u << 8)
+#define FLASH_SECTOR_SIZE (1u << 12)
+
+// The flash is just big enough for the key-value store, and is read through fake_flash rather than XIP
+#define FAKE_FLASH_SECTORS 8
+#define PICO_FLASH_SIZE_BYTES (FAKE_FLASH_SECTORS * FLASH_SECTOR_SIZE)
+extern uint8_t fake_flash[PICO_FLASH_SIZE_BYTES];
+#define XIP_BASE ((uintptr_t)fake_flash)
+
+void flash_range_erase(uint32_t flash_offs, size_t count);
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count);
+
+#endif
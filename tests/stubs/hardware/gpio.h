@@ -0,0 +1,17 @@
+#ifndef TEST_HARDWARE_GPIO_INCLUDED
+#define TEST_HARDWARE_GPIO_INCLUDED
+
+#include "pico/types.h"
+
+#define GPIO_IN 0
+#define GPIO_OUT 1
+#define GPIO_IRQ_EDGE_FALL 0x4u
+
+typedef void (*gpio_irq_callback_t)(uint gpio, uint32_t event_mask);
+
+void gpio_init(uint gpio);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_pull_up(uint gpio);
+void gpio_set_irq_enabled_with_callback(uint gpio, uint32_t event_mask, bool enabled, gpio_irq_callback_t callback);
+
+#endif
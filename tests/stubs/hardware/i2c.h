@@ -0,0 +1,15 @@
+#ifndef TEST_HARDWARE_I2C_INCLUDED
+#define TEST_HARDWARE_I2C_INCLUDED
+
+#include "pico/types.h"
+
+// Only the bus identities - transactions go through i2c_bus_read/write, which tests/fake_i2c.cpp provides
+typedef struct i2c_inst {
+    int index;
+} i2c_inst_t;
+
+extern i2c_inst_t i2c0_inst, i2c1_inst;
+#define i2c0 (&i2c0_inst)
+#define i2c1 (&i2c1_inst)
+
+#endif
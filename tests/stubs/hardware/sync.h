@@ -0,0 +1,9 @@
+#ifndef TEST_HARDWARE_SYNC_INCLUDED
+#define TEST_HARDWARE_SYNC_INCLUDED
+
+#include "pico/types.h"
+
+uint32_t save_and_disable_interrupts(void);
+void restore_interrupts(uint32_t status);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef TEST_PICO_CRITICAL_SECTION_INCLUDED
+#define TEST_PICO_CRITICAL_SECTION_INCLUDED
+
+#include "pico/types.h"
+
+typedef struct {
+    int depth;
+} critical_section_t;
+
+void critical_section_init(critical_section_t *crit_sec);
+void critical_section_enter_blocking(critical_section_t *crit_sec);
+void critical_section_exit(critical_section_t *crit_sec);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef TEST_PICO_MULTICORE_INCLUDED
+#define TEST_PICO_MULTICORE_INCLUDED
+
+#include "pico/types.h"
+
+// Core 1 never runs on the host
+bool multicore_lockout_victim_is_initialized(uint core_num);
+void multicore_lockout_start_blocking(void);
+void multicore_lockout_end_blocking(void);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef TEST_PICO_MUTEX_INCLUDED
+#define TEST_PICO_MUTEX_INCLUDED
+
+#include "pico/types.h"
+
+typedef struct {
+    int owner;
+} mutex_t;
+
+#endif
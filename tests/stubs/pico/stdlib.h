@@ -0,0 +1,8 @@
+#ifndef TEST_PICO_STDLIB_INCLUDED
+#define TEST_PICO_STDLIB_INCLUDED
+
+#include "pico/types.h"
+#include "pico/time.h"
+#include "hardware/gpio.h"
+
+#endif
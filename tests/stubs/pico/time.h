@@ -0,0 +1,18 @@
+#ifndef TEST_PICO_TIME_INCLUDED
+#define TEST_PICO_TIME_INCLUDED
+
+#include "pico/types.h"
+
+// Time only moves when a test calls fake_advance_us() or the code under test sleeps
+absolute_time_t get_absolute_time(void);
+int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to);
+absolute_time_t delayed_by_us(absolute_time_t t, uint64_t us);
+absolute_time_t make_timeout_time_ms(uint32_t ms);
+bool time_reached(absolute_time_t t);
+uint32_t to_ms_since_boot(absolute_time_t t);
+uint32_t time_us_32(void);
+void sleep_ms(uint32_t ms);
+
+void fake_advance_us(uint64_t us);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef TEST_PICO_TYPES_INCLUDED
+#define TEST_PICO_TYPES_INCLUDED
+
+// Host stand-ins for the parts of the Pico SDK the tested modules use - see tests/fakes.cpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t;
+
+static inline void tight_loop_contents(void) {}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef TEST_INCLUDED
+#define TEST_INCLUDED
+
+#include <stdio.h>
+#include <math.h>
+#include "fake_i2c.h"
+
+// Host tests
+// Each test program runs its tests in turn and exits non-zero if any check failed, so ctest reports it.
+// A failed check is printed and the test carries on, so one run shows every failure.
+
+static int test_failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define CHECK_EQUAL(expected, actual) do { \
+    long long _expected = (long long)(expected), _actual = (long long)(actual); \
+    if (_expected != _actual) { \
+        printf("%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, _actual, _expected); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define CHECK_NEAR(expected, actual, tolerance) do { \
+    double _expected = (expected), _actual = (actual); \
+    if (fabs(_expected - _actual) > (tolerance)) { \
+        printf("%s:%d: %s is %g, expected %g\n", __FILE__, __LINE__, #actual, _actual, _expected); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define RUN_TEST(test) do { \
+    printf("- %s\n", #test); \
+    test(); \
+} while (0)
+
+// Sensor tests start each test with a new fake device and driver. Repeaters register themselves by address,
+// so the old driver is left alone rather than deleted or reused
+template <class TDriver, class TDevice>
+static void test_sensor_setup(TDriver *&sensor, TDevice *&device, i2c_inst_t *i2c, uint8_t address) {
+    device = new TDevice();
+    fake_i2c_detach_all();
+    fake_i2c_attach(i2c, address, device);
+
+    sensor = new TDriver();
+    sensor->i2c = i2c;
+    sensor->address = address;
+}
+
+static inline int test_result() {
+    printf(test_failures ? "%d checks failed\n" : "All passed\n", test_failures);
+    return test_failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,133 @@
+#include <string.h>
+#include "main.h"
+#include "helpers/sensor.h"
+#include "sensors/aht20.h"
+#include "fake_i2c.h"
+#include "test.h"
+
+#define STATUS_CALIBRATED 0x08
+#define STATUS_BUSY 0x80
+
+// Frames with their CRC-8 worked out separately, as the datasheet has no example
+// 50 %, 30 C
+static const uint8_t FRAME_50_30[7] = {0x1C, 0x80, 0x00, 0x06, 0x66, 0x66, 0x5C};
+// 40 %, 20 C
+static const uint8_t FRAME_40_20[7] = {0x1C, 0x66, 0x66, 0x65, 0x99, 0x9A, 0xF8};
+
+// An AHT20 that answers a measurement with a given frame, after a given number of busy reads
+class FakeAHT20 : public FakeI2CDevice {
+
+    public:
+        uint8_t status;
+        uint8_t frame[7];
+        int busy_reads;
+        bool measuring;
+
+        FakeAHT20() {
+            status = 0x18 | STATUS_CALIBRATED;
+            memcpy(frame, FRAME_50_30, sizeof(frame));
+            busy_reads = 0;
+            measuring = false;
+        }
+
+        bool write(const uint8_t *data, size_t len) {
+            if (data[0] == 0xAC) {
+                measuring = true;
+            } else if (data[0] == 0xBE) {
+                status |= STATUS_CALIBRATED;
+            }
+            return true;
+        }
+
+        bool read(uint8_t *data, size_t len) {
+            if (!measuring || (len < sizeof(frame))) {
+                memset(data, 0, len);
+                data[0] = status;
+                return true;
+            }
+            if (busy_reads > 0) {
+                busy_reads--;
+                memset(data, 0xFF, len);
+                data[0] = status | STATUS_BUSY;
+                return true;
+            }
+            memcpy(data, frame, sizeof(frame));
+            measuring = false;
+            return true;
+        }
+};
+
+static FakeAHT20 *device;
+static AHT20Sensor *sensor;
+static struct STATE s;
+
+static void setup() {
+    test_sensor_setup(sensor, device, I2C_PORT_0, 0x38);
+    s = STATE();
+}
+
+static TPollResult measure() {
+    // Start a measurement and collect it
+    TPollResult result = sensor->poll();
+    if (result != prPending) {
+        return result;
+    }
+    while ((result = sensor->poll()) == prPending) {
+    }
+    return result;
+}
+
+static void test_reading() {
+    setup();
+    CHECK(sensor->probe());
+    CHECK(sensor->start());
+
+    CHECK_EQUAL(prDone, measure());
+    sensor->publish(&s);
+    CHECK_NEAR(50.0, s.AHT20Humidity, 0.01);
+    CHECK_NEAR(30.0, s.AHT20Temperature, 0.01);
+
+    memcpy(device->frame, FRAME_40_20, sizeof(device->frame));
+    CHECK_EQUAL(prDone, measure());
+    sensor->publish(&s);
+    CHECK_NEAR(40.0, s.AHT20Humidity, 0.01);
+    CHECK_NEAR(20.0, s.AHT20Temperature, 0.01);
+    CHECK_EQUAL(0, sensor->errors);
+}
+
+static void test_crc_rejects_bit_errors() {
+    // Every single bit error in the frame, CRC included, is caught
+    setup();
+    sensor->start();
+
+    for (int bit = 0; bit < 7 * 8; bit++) {
+        memcpy(device->frame, FRAME_50_30, sizeof(device->frame));
+        device->frame[bit / 8] ^= 1 << (bit % 8);
+
+        // A corrupted status byte can read as busy, which is retried until it gives up
+        CHECK_EQUAL(prFailed, measure());
+    }
+
+    // The bad frames were counted, and the sensor carries on once they stop
+    CHECK(sensor->errors > 0);
+    memcpy(device->frame, FRAME_50_30, sizeof(device->frame));
+    CHECK_EQUAL(prDone, measure());
+}
+
+static void test_busy() {
+    setup();
+    sensor->start();
+
+    device->busy_reads = AHT20_MAX_BUSY_POLLS;
+    CHECK_EQUAL(prDone, measure());
+
+    device->busy_reads = AHT20_MAX_BUSY_POLLS + 1;
+    CHECK_EQUAL(prFailed, measure());
+}
+
+int main() {
+    RUN_TEST(test_reading);
+    RUN_TEST(test_crc_rejects_bit_errors);
+    RUN_TEST(test_busy);
+    return test_result();
+}
@@ -0,0 +1,228 @@
+#include <string.h>
+#include <strings.h>
+#include "main.h"
+#include "cutdown.h"
+#include "helpers/config.h"
+#include "helpers/memory.h"
+#include "fakes.h"
+#include "test.h"
+
+// The configuration parser, and the flash key-value store that keeps the last good config.txt
+
+static void test_memory_round_trip() {
+    fake_flash_erase_all();
+    memory_init();
+
+    struct TMemoryCounters counters = {5, 2}, read;
+    CHECK(!memory_get(mkCounters, &read, sizeof(read)));
+
+    // Staged values can be read back before they are written
+    CHECK(memory_put(mkCounters, &counters, sizeof(counters)));
+    CHECK(memory_get(mkCounters, &read, sizeof(read)));
+    CHECK_EQUAL(5, read.Boots);
+
+    memory_flush();
+    memory_init();
+    CHECK(memory_get(mkCounters, &read, sizeof(read)));
+    CHECK_EQUAL(5, read.Boots);
+    CHECK_EQUAL(2, read.WatchdogResets);
+
+    // Only a value of the size asked for is returned
+    uint32_t wrong_size;
+    CHECK(!memory_get(mkCounters, &wrong_size, sizeof(wrong_size)));
+}
+
+static void test_memory_wraps() {
+    // Values outlive many passes round the sectors, and a key that is never written again is carried along
+    fake_flash_erase_all();
+    memory_init();
+
+    struct TMemoryFlight flight = {3, 1, 100, 25000, 51.5f, -0.1f, 1200, 43200};
+    memory_put(mkFlight, &flight, sizeof(flight));
+    memory_flush();
+
+    struct TMemoryCounters counters = {0, 0};
+    for (uint32_t boot = 1; boot <= 3 * MEMORY_SECTORS * FLASH_SECTOR_SIZE / 16; boot++) {
+        counters.Boots = boot;
+        memory_put(mkCounters, &counters, sizeof(counters));
+        memory_flush();
+    }
+
+    memory_init();
+    struct TMemoryCounters read;
+    struct TMemoryFlight read_flight;
+    CHECK(memory_get(mkCounters, &read, sizeof(read)));
+    CHECK_EQUAL(counters.Boots, read.Boots);
+    CHECK(memory_get(mkFlight, &read_flight, sizeof(read_flight)));
+    CHECK_EQUAL(25000, read_flight.MaximumAltitude);
+}
+
+static void test_memory_torn_record() {
+    // A record cut short by a reset is ignored, and the one before it used
+    fake_flash_erase_all();
+    memory_init();
+
+    struct TMemoryCounters counters = {1, 0}, read;
+    memory_put(mkCounters, &counters, sizeof(counters));
+    memory_flush();
+
+    // The second record goes straight after the first, in the first sector
+    counters.Boots = 2;
+    memory_put(mkCounters, &counters, sizeof(counters));
+    memory_flush();
+    uint8_t *last = NULL;
+    for (uint32_t i = 8; i + sizeof(counters) <= FLASH_SECTOR_SIZE; i += 4) {
+        // The value follows the CRC, the key and the length
+        uint16_t key, length;
+        uint32_t boots;
+        memcpy(&key, fake_flash + i - 4, sizeof(key));
+        memcpy(&length, fake_flash + i - 2, sizeof(length));
+        memcpy(&boots, fake_flash + i, sizeof(boots));
+        if ((key == mkCounters) && (length == sizeof(counters)) && (boots == 2)) {
+            last = fake_flash + i;
+        }
+    }
+    CHECK(last != NULL);
+    if (!last) {
+        return;
+    }
+    last[0] = 0;
+
+    memory_init();
+    CHECK(memory_get(mkCounters, &read, sizeof(read)));
+    CHECK_EQUAL(1, read.Boots);
+
+    // Writing carries on in a fresh sector
+    counters.Boots = 3;
+    memory_put(mkCounters, &counters, sizeof(counters));
+    memory_flush();
+    memory_init();
+    CHECK(memory_get(mkCounters, &read, sizeof(read)));
+    CHECK_EQUAL(3, read.Boots);
+}
+
+static void test_config_defaults() {
+    fake_flash_erase_all();
+    memory_init();
+    fake_sd_file(NULL, NULL);
+
+    CHECK_EQUAL(csDefaults, config_load(NULL));
+    CHECK(strcmp(config.Callsign, CALLSIGN) == 0);
+    CHECK_NEAR(FREQUENCY, config.Frequency, 0.0001);
+    CHECK_EQUAL(CEILING_ALT, config.CeilingAltitude);
+    CHECK_EQUAL(GEOFENCE_POINTS, config.FencePoints);
+    CHECK_EQUAL(0, config.NumPeriods);
+}
+
+static void test_config_file() {
+    fake_flash_erase_all();
+    memory_init();
+    fake_sd_file(CONFIG_FILE,
+                 "# Test flight\n"
+                 "callsign = TEST1\n"
+                 "  Frequency=434.250   # MHz\n"
+                 "lora_mode = 2\n"
+                 "lora_transmitting = no\n"
+                 "enable_pm = yes\n"
+                 "ceiling_alt = 18000\n"
+                 "\n"
+                 "fence = -1.5, 51.0\n"
+                 "fence = -1.0, 51.5\n"
+                 "fence = -0.5, 51.0\n"
+                 "period GPS = 2000\n"
+                 "period LoRa = 5000\n"
+                 "period gps = 3000\n");
+
+    CHECK_EQUAL(csSD, config_load(NULL));
+    CHECK(strcmp(config.Callsign, "TEST1") == 0);
+    CHECK_NEAR(434.25, config.Frequency, 0.0001);
+    CHECK_EQUAL(2, config.LoRaMode);
+    CHECK(!config.LoRaTransmitting);
+    CHECK(config.EnablePM);
+    CHECK_EQUAL(18000, config.CeilingAltitude);
+
+    CHECK_EQUAL(3, config.FencePoints);
+    CHECK_NEAR(-1.0, config.Fence[2], 0.0001);
+    CHECK_NEAR(51.5, config.Fence[3], 0.0001);
+
+    // A task given twice keeps the last period
+    CHECK_EQUAL(2, config.NumPeriods);
+    CHECK(strcasecmp(config.Periods[0].Task, "GPS") == 0);
+    CHECK_EQUAL(3000, config.Periods[0].Period);
+    CHECK_EQUAL(5000, config.Periods[1].Period);
+
+    // A clean file is kept in flash, and used when the card is not read
+    memory_flush();
+    memory_init();
+    fake_sd_file(NULL, NULL);
+    CHECK_EQUAL(csFlash, config_load(NULL));
+    CHECK(strcmp(config.Callsign, "TEST1") == 0);
+    CHECK_EQUAL(3, config.FencePoints);
+}
+
+static void test_config_bad_lines() {
+    // Lines that cannot be used are skipped, and the file is not kept in flash
+    fake_flash_erase_all();
+    memory_init();
+    fake_sd_file(CONFIG_FILE,
+                 "callsign = ACALLSIGNTHATISTOOLONG\n"
+                 "frequency = 434.x\n"
+                 "lora_mode = 3\n"
+                 "lora_transmitting = maybe\n"
+                 "ceiling_alt = 12000\n"
+                 "no equals sign\n"
+                 "unknown = 1\n"
+                 "period GPS = -5\n"
+                 "fence = -1.5, 51.0\n"
+                 "fence = -1.0\n");
+
+    CHECK_EQUAL(csSD, config_load(NULL));
+    CHECK(strcmp(config.Callsign, CALLSIGN) == 0);
+    CHECK_NEAR(FREQUENCY, config.Frequency, 0.0001);
+    CHECK_EQUAL(LORA_MODE, config.LoRaMode);
+    CHECK_EQUAL(LORA_TRANSMITTING, config.LoRaTransmitting);
+    CHECK_EQUAL(12000, config.CeilingAltitude);
+    CHECK_EQUAL(0, config.NumPeriods);
+
+    // A fence of fewer than three points is replaced by the built in one
+    CHECK_EQUAL(GEOFENCE_POINTS, config.FencePoints);
+    CHECK(memcmp(config.Fence, GEOFENCE, sizeof(float) * 2 * GEOFENCE_POINTS) == 0);
+
+    memory_flush();
+    memory_init();
+    fake_sd_file(NULL, NULL);
+    CHECK_EQUAL(csDefaults, config_load(NULL));
+}
+
+static void test_config_resumed() {
+    // A warm restart carries on with the configuration in use, even one that was never saved to flash
+    fake_flash_erase_all();
+    memory_init();
+    fake_sd_file(CONFIG_FILE,
+                 "callsign = TEST2\n"
+                 "frequency = 434.1\n"
+                 "not a setting\n");
+    CHECK_EQUAL(csSD, config_load(NULL));
+    struct TConfig resumed = config;
+
+    fake_sd_file(NULL, NULL);
+    CHECK_EQUAL(csResumed, config_load(&resumed));
+    CHECK(strcmp(config.Callsign, "TEST2") == 0);
+    CHECK_NEAR(434.1, config.Frequency, 0.0001);
+    CHECK(memcmp(&config, &resumed, sizeof(config)) == 0);
+
+    // A damaged copy is not used
+    resumed.Frequency = 433.0;
+    CHECK_EQUAL(csDefaults, config_load(&resumed));
+}
+
+int main() {
+    RUN_TEST(test_memory_round_trip);
+    RUN_TEST(test_memory_wraps);
+    RUN_TEST(test_memory_torn_record);
+    RUN_TEST(test_config_defaults);
+    RUN_TEST(test_config_file);
+    RUN_TEST(test_config_bad_lines);
+    RUN_TEST(test_config_resumed);
+    return test_result();
+}
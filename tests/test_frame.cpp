@@ -0,0 +1,67 @@
+#include "helpers/frame.h"
+#include "test.h"
+
+static const uint8_t FRAME[] = {0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC, 0xDE, 0xF0, 0x00, 0x00, 0x80, 0x3F};
+
+static void test_le_fields() {
+    CHECK_EQUAL(0x12, (LEField<uint8_t, 0>::get(FRAME)));
+    CHECK_EQUAL(0x3412, (LEField<uint16_t, 0>::get(FRAME)));
+    CHECK_EQUAL(0x78563412, (LEField<uint32_t, 0>::get(FRAME)));
+    CHECK_EQUAL(-0x4366, (LEField<int16_t, 4>::get(FRAME)));
+
+    // Unaligned
+    CHECK_EQUAL(0x9A785634, (LEField<uint32_t, 1>::get(FRAME)));
+
+    // Floats are the bits as they are
+    CHECK((LEField<float, 8>::get(FRAME)) == 1.0f);
+
+    CHECK_EQUAL(4, (LEField<uint16_t, 2>::end));
+    CHECK_EQUAL(12, (LEField<float, 8>::end));
+}
+
+static void test_le_arrays() {
+    typedef LEArray<uint16_t, 2, 3> Bins;
+
+    CHECK_EQUAL(3, Bins::count);
+    CHECK_EQUAL(8, Bins::end);
+    CHECK_EQUAL(0x7856, Bins::get(FRAME, 0));
+    CHECK_EQUAL(0xBC9A, Bins::get(FRAME, 1));
+    CHECK_EQUAL(0xF0DE, Bins::get(FRAME, 2));
+}
+
+static void test_bit_fields() {
+    // Big-endian 20 bit values sharing a byte, as the AHT20 sends them
+    const uint8_t aht20[] = {0x1C, 0xAB, 0xCD, 0xEF, 0x12, 0x34};
+    CHECK_EQUAL(0xABCDE, (BEBits<uint32_t, 1, 3, 4, 20>::get(aht20)));
+    CHECK_EQUAL(0xF1234, (BEBits<uint32_t, 3, 3, 0, 20>::get(aht20)));
+    CHECK_EQUAL(4, (BEBits<uint32_t, 1, 3, 4, 20>::end));
+
+    // Little-endian, as the BME280 calibration is laid out
+    CHECK_EQUAL(0x1, (LEBits<uint8_t, 0, 1, 4, 4>::get(FRAME)));
+    CHECK_EQUAL(0x412, (LEBits<uint16_t, 0, 2, 0, 12>::get(FRAME)));
+
+    // Signed fields are sign extended
+    CHECK_EQUAL(-6, (BEBits<int8_t, 1, 1, 4, 4>::get(aht20)));
+    CHECK_EQUAL(2, (BEBits<int8_t, 1, 1, 2, 3>::get(aht20)));
+    CHECK_EQUAL(-0x10EE, (BEBits<int16_t, 3, 2, 0, 16>::get(aht20)));
+
+    // All 32 bits
+    CHECK_EQUAL(0x12345678, (BEBits<uint32_t, 0, 4, 0, 32>::get(FRAME)));
+}
+
+static void test_joined_fields() {
+    // The BME280's dig_H4 - the high 8 bits in one byte and the low 4 in the bottom of the next
+    typedef JoinedField<int16_t, LEField<int8_t, 0>, LEBits<uint8_t, 1, 1, 0, 4>, 4> H4;
+    const uint8_t positive[] = {0x15, 0x0A};
+    const uint8_t negative[] = {0xF5, 0x0A};
+    CHECK_EQUAL(0x15A, H4::get(positive));
+    CHECK_EQUAL(-166, H4::get(negative));
+}
+
+int main() {
+    RUN_TEST(test_le_fields);
+    RUN_TEST(test_le_arrays);
+    RUN_TEST(test_bit_fields);
+    RUN_TEST(test_joined_fields);
+    return test_result();
+}
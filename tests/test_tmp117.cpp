@@ -0,0 +1,210 @@
+#include "main.h"
+#include "helpers/sensor.h"
+#include "sensors/tmp117.h"
+#include "fake_i2c.h"
+#include "test.h"
+
+#define TEMPERATURE 0x00
+#define CONFIGURATION 0x01
+#define DEVICE_ID 0x0F
+#define DATA_READY (1 << 13)
+
+// Conversion cycle time in ms from the datasheet, by CONV (rows) and AVG (columns)
+static const uint32_t CYCLE_MS[8][4] = {
+    {16, 125, 500, 1000},
+    {125, 125, 500, 1000},
+    {250, 250, 500, 1000},
+    {500, 500, 500, 1000},
+    {1000, 1000, 1000, 1000},
+    {4000, 4000, 4000, 4000},
+    {8000, 8000, 8000, 8000},
+    {16000, 16000, 16000, 16000}
+};
+
+// A TMP117 whose data ready flag is cleared by reading the configuration or temperature, as on the real part
+class FakeTMP117 : public FakeRegisterDevice {
+
+    protected:
+        uint16_t register_read(uint8_t reg) {
+            uint16_t value = registers[reg];
+            if ((reg == CONFIGURATION) || (reg == TEMPERATURE)) {
+                registers[CONFIGURATION] &= ~DATA_READY;
+            }
+            return value;
+        }
+
+        void register_write(uint8_t reg, uint16_t value) {
+            if (reg == CONFIGURATION) {
+                configured++;
+                value = (value & ~DATA_READY) | (registers[CONFIGURATION] & DATA_READY);
+            }
+            registers[reg] = value;
+        }
+
+    public:
+        int configured;
+
+        FakeTMP117() {
+            registers[DEVICE_ID] = 0x1117;      // Revision 1
+            configured = 0;
+        }
+
+        void convert(int16_t raw) {
+            registers[TEMPERATURE] = raw;
+            registers[CONFIGURATION] |= DATA_READY;
+        }
+};
+
+static FakeTMP117 *device;
+static TMP117Sensor *sensor;
+static struct STATE s;
+
+static void setup() {
+    test_sensor_setup(sensor, device, I2C_PORT_1, 0x48);
+    s = STATE();
+}
+
+static void test_probe() {
+    setup();
+    CHECK(sensor->probe());
+
+    // An ADS1115 at the same address has no device ID register
+    device->registers[DEVICE_ID] = 0x0000;
+    CHECK(!sensor->probe());
+
+    device->present = false;
+    CHECK(!sensor->probe());
+}
+
+static void test_phase_settings() {
+    // Each phase is continuous conversion, and the repeater runs at the cycle time that CONV and AVG give
+    setup();
+
+    for (int phase = spIdle; phase <= spLanded; phase++) {
+        CHECK(sensor->configure((TSensorPhase)phase));
+
+        uint16_t config = device->registers[CONFIGURATION];
+        int mode = (config >> 10) & 3;
+        int conv = (config >> 7) & 7;
+        int avg = (config >> 5) & 3;
+        std::list<uint64_t> *delays = sensor->repeater.queue();
+
+        printf("  phase %d: CONV %d, AVG %d, %lu ms\n", phase, conv, avg, (unsigned long)(delays->front() / 1000));
+        CHECK_EQUAL(0, mode);
+        CHECK_EQUAL(0, config & 0x0004);            // ALERT pin not used for data ready
+        CHECK_EQUAL(1, delays->size());
+        CHECK_EQUAL(CYCLE_MS[conv][avg] * 1000ull, delays->front());
+    }
+    CHECK_EQUAL(spLanded - spIdle + 1, device->configured);
+
+    // More averaging on the ground and on the way down, and the fastest cycle near the burst
+    sensor->configure(spNearBurst);
+    uint64_t near_burst = sensor->repeater.queue()->front();
+    sensor->configure(spAscent);
+    CHECK(near_burst < sensor->repeater.queue()->front());
+}
+
+static void test_ready_reading() {
+    setup();
+    sensor->configure(spAscent);
+
+    device->convert(0x0C80);                         // 25 C
+    CHECK_EQUAL(prDone, sensor->poll());
+    CHECK(!sensor->pending);
+
+    sensor->publish(&s);
+    CHECK(s.TMP117Valid);
+    CHECK_NEAR(25.0, s.TMP117Temperature, 0.001);
+
+    device->convert(-0x0A00);                        // -20 C
+    CHECK_EQUAL(prDone, sensor->poll());
+    sensor->publish(&s);
+    CHECK_NEAR(-20.0, s.TMP117Temperature, 0.001);
+}
+
+static void test_data_ready_polling() {
+    // A conversion that is not ready yet is collected 10 ms later rather than read stale
+    setup();
+    sensor->configure(spAscent);
+
+    CHECK_EQUAL(prPending, sensor->poll());
+    CHECK(sensor->pending);
+    CHECK(!time_reached(sensor->collect_time));
+    fake_advance_us(10000);
+    CHECK(time_reached(sensor->collect_time));
+
+    sensor->pending = false;
+    CHECK_EQUAL(prPending, sensor->poll());
+
+    device->convert(0x0100);                         // 2 C
+    sensor->pending = false;
+    CHECK_EQUAL(prDone, sensor->poll());
+    sensor->publish(&s);
+    CHECK_NEAR(2.0, s.TMP117Temperature, 0.001);
+
+    // The flag was cleared by the read, so the next poll waits for the next conversion
+    sensor->pending = false;
+    CHECK_EQUAL(prPending, sensor->poll());
+}
+
+static void test_data_ready_gives_up() {
+    // A conversion that never finishes fails the poll rather than waiting forever
+    setup();
+    sensor->configure(spAscent);
+
+    int polls = 0;
+    TPollResult result;
+    do {
+        sensor->pending = false;
+        result = sensor->poll();
+        polls++;
+    } while ((result == prPending) && (polls < 100));
+
+    CHECK_EQUAL(prFailed, result);
+    CHECK_EQUAL(TMP117_MAX_READY_POLLS + 1, polls);
+
+    // And the count starts again for the next reading
+    device->convert(0x0080);
+    sensor->pending = false;
+    CHECK_EQUAL(prDone, sensor->poll());
+}
+
+static void test_withdraw() {
+    // A sensor that stops answering is taken off the schedule and its reading marked as stale
+    setup();
+    sensor->health = shOK;
+    sensor->configure(spAscent);
+    device->convert(0x0C80);
+    CHECK(sensor_poll(sensor));
+    sensor->publish(&s);
+    CHECK(s.TMP117Valid);
+
+    device->present = false;
+    for (int i = 0; i < SENSOR_MAX_FAILURES; i++) {
+        CHECK_EQUAL(shOK, sensor->health);
+        CHECK(!sensor_poll(sensor));
+    }
+    CHECK_EQUAL(shFailing, sensor->health);
+    CHECK_EQUAL(SENSOR_MAX_FAILURES, sensor->consecutive_failures);
+
+    // As check_SENSORS does for a failing sensor
+    sensor->withdraw(&s);
+    CHECK(!s.TMP117Valid);
+
+    // A reading once it is back makes it valid again
+    device->present = true;
+    device->convert(0x0C80);
+    CHECK(sensor_poll(sensor));
+    sensor->publish(&s);
+    CHECK(s.TMP117Valid);
+}
+
+int main() {
+    RUN_TEST(test_probe);
+    RUN_TEST(test_phase_settings);
+    RUN_TEST(test_ready_reading);
+    RUN_TEST(test_data_ready_polling);
+    RUN_TEST(test_data_ready_gives_up);
+    RUN_TEST(test_withdraw);
+    return test_result();
+}
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""Convert tracker trace dumps to Chrome / Perfetto trace JSON.
+
+Input is either a trace[X].bin file from the SD card, or a USB serial log
+containing the "TRACE <hex>" lines printed alongside it. A file can hold
+several dumps one after another; each becomes its own process in the trace.
+
+    python3 tools/trace_to_chrome.py trace0.bin > trace.json
+
+Open the result at ui.perfetto.dev or chrome://tracing.
+"""
+
+import json
+import re
+import struct
+import sys
+
+EVENT = struct.Struct("<IIHBB")
+
+
+def read_input(path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    lines = re.findall(rb"^TRACE ([0-9A-Fa-f]+)\r?$", data, re.MULTILINE)
+    if lines:
+        return bytes.fromhex(b"".join(lines).decode())
+    return data
+
+
+def read_string(data, pos):
+    end = data.index(b"\0", pos)
+    return data[pos:end].decode(errors="replace"), end + 1
+
+
+def parse_dumps(data):
+    # Yields (reason, names, dump time, {core: [events]}) for each dump
+    pos = 0
+    while pos < len(data):
+        if data[pos:pos + 4] != b"TRC1":
+            raise ValueError("no trace header at offset %d" % pos)
+        pos += 4
+
+        count = data[pos]
+        pos += 1
+        names = []
+        for _ in range(count):
+            name, pos = read_string(data, pos)
+            names.append(name)
+        reason, pos = read_string(data, pos)
+        (dump_time,) = struct.unpack_from("<I", data, pos)
+        pos += 4
+
+        cores = {}
+        for _ in range(2):
+            core, events = struct.unpack_from("<BH", data, pos)
+            pos += 3
+            cores[core] = [EVENT.unpack_from(data, pos + i * EVENT.size) for i in range(events)]
+            pos += events * EVENT.size
+
+        yield reason, names, dump_time, cores
+
+
+def to_chrome(dumps):
+    trace = []
+
+    for pid, (reason, names, dump_time, cores) in enumerate(dumps):
+        trace.append({"name": "process_name", "ph": "M", "pid": pid, "args": {"name": "Dump %d - %s" % (pid, reason)}})
+
+        for core, events in cores.items():
+            trace.append({"name": "thread_name", "ph": "M", "pid": pid, "tid": core, "args": {"name": "Core %d" % core}})
+
+            for start, duration, arg, ident, instant in events:
+                # time_us_32 wraps every 71 minutes, so times are taken relative to the dump
+                ts = ((start - dump_time + 0x80000000) & 0xFFFFFFFF) - 0x80000000
+                event = {
+                    "name": names[ident] if ident < len(names) else "id%d" % ident,
+                    "pid": pid,
+                    "tid": core,
+                    "ts": ts,
+                    "args": {"arg": arg},
+                }
+                if instant:
+                    event.update({"ph": "i", "s": "t"})
+                else:
+                    event.update({"ph": "X", "dur": duration})
+                trace.append(event)
+
+    return {"traceEvents": trace, "displayTimeUnit": "ms"}
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: trace_to_chrome.py <trace.bin | serial log>")
+
+    dumps = list(parse_dumps(read_input(sys.argv[1])))
+    json.dump(to_chrome(dumps), sys.stdout, indent=1)
+
+
+if __name__ == "__main__":
+    main()